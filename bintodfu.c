@@ -1,7 +1,52 @@
 /*
 bintodfu.c :
-Takes a .bin file containing the memory image for flashing, and wraps it up in STM's
-DfuSe file format.
+Takes .bin files containing memory images for flashing, and wraps them up in STM's
+DfuSe file format. Each .bin becomes an image element at the address given after
+an @ (start of flash by default). An ELF file becomes one image element per
+loadable segment, at the addresses it was linked for, so a config page at the
+end of flash doesn't drag a padded out .bin along with it, and an Intel HEX
+(.hex) or S-record (.srec) file one per run of records that follow on from each
+other (see dfuinput.h). Those are recognised by their contents, not their
+names, and carry their own addresses. An @, or a name ending .bin, makes a
+file a flat binary whatever its first bytes look like.
+-a puts the files that follow in a target for another alternate setting, e.g.
+for option bytes:
+
+	bintodfu boot.bin app.bin@0x08004000 -a 1 opt.bin@0x1ffff800 out.dfuse
+
+-n names the target the files that follow go in, so that stmdfu --target
+can pick it out of a package with a target for each board variant:
+
+	bintodfu -n rev-a a.elf -n rev-b b.elf boards.dfuse
+
+-g drops runs of at least that many bytes of 0xff from the files that follow,
+in whole flash pages (-p, 2K by default), splitting them into an element either
+side. The pages in the gaps aren't written, so they must already be erased on
+the device, e.g. by a masserase:
+
+	bintodfu -g 8192 app.bin app.dfuse
+
+-d makes the next file a delta against a base image, the firmware a unit
+already runs: only the pages (-p) that changed are kept, and the target is
+named with a hash of what the base held in them, which stmdfu checks on the
+device before applying it (see dfuse_delta in dfuse.h). The base takes the
+same @address as the file:
+
+	bintodfu -d v1.bin v2.bin v1-to-v2.dfuse
+
+-z writes a packed file instead (see dfulz.h), each element compressed in
+independent page sized blocks that stmdfu decodes as it downloads them, for
+keeping lots of images around. Nothing but stmdfu reads a packed file:
+
+	bintodfu -z app.elf app.dfuz
+
+An input of - is read from stdin, and an output of - goes to stdout, so it
+can sit in a pipeline:
+
+	objcopy -O binary app.elf /dev/stdout | bintodfu -@0x08004000 - > app.dfuse
+
+Inputs are mapped (or read from a pipe in large chunks) and the file is
+written in one pass with vectored writes, the crc worked out on the way.
 
 More information on the DfuSe file format is available in DfuSe File Format
 Specification, UM0391.
@@ -17,48 +62,226 @@ Specification, UM0391.
 
 #include "crc32.h"
 #include "dfuse.h"
+#include "dfulz.h"
+#include "dfuinput.h"
 
 int main(int argc, char * argv[])
 {
 	int i, j;
 	int binfile;
 	int dfufile;
+	int alternate = 0;
+	int target = -1;
+	int rv;
+	uint32_t address;
+	char * at;
 	dfuse_file * dfusefile;
+	dfuinput_image ** images;
+	dfuinput_image * image;
+	int nimages = 0;
+	uint32_t gap = 0;
+	uint32_t page = DFUINPUT_PAGE_SIZE;
+	uint32_t dropped;
+	char * basename = NULL;
+	char * name = NULL;
+	dfuinput_image * base;
+	dfuse_delta delta;
+	int pack = 0;
+	uint32_t unpacked = 0;
+	uint32_t packed = 0;
 	
-	binfile = open(argv[1], O_RDONLY);
-	
-	if (binfile == -1)
+	if (argc < 3)
 	{
-		printf("Could not open %s\n", argv[1]);
+		printf("usage: bintodfu [-z] [-n name] [-a alt] [-g gap] [-p page] [-d base.bin] <input> [[-a alt] <input> ...] <file.dfuse>\n");
+		printf("       <input> is file.bin[@address], file.elf, file.hex or file.srec, an @address makes any file a .bin\n");
+		printf("       - reads an input from stdin, or writes the .dfuse to stdout\n");
+		printf("       -n names the target the files that follow go in\n");
+		printf("       -g leaves out runs of 0xff of at least gap bytes, in whole pages\n");
+		printf("       -p sets the flash page size -g and -d work in (2048 by default)\n");
+		printf("       -d base.bin makes the next file a delta, only the pages that differ from base.bin\n");
+		printf("       -z writes a packed (compressed) file, for stmdfu only\n");
 		return -1;
 	}
 	
-	dfufile = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+	dfusefile = dfuse_new();
 	
-	if (dfufile == -1)
+	images = (dfuinput_image **)malloc(sizeof(dfuinput_image *) * argc);
+	
+	//-z is for the whole file, wherever it is
+	for (i=1; i<argc-1; i++)
 	{
-		printf("Could not create %s\n", argv[2]);
-		return -2;
+		if (!strcmp(argv[i], "-z"))
+			pack = 1;
 	}
 	
-	dfusefile = dfuse_init(binfile);
-	
-	dfuse_readbin(dfusefile, binfile);
+	//every input but the last argument becomes one or more image
+	//elements, -a starts a new target for the alternate setting that
+	//follows, -n a new target with that name, -g and -p set how the
+	//files that follow are split
+	for (i=1; i<argc-1; i++)
+	{
+		if (!strcmp(argv[i], "-z"))
+			continue;
+		
+		if (!strcmp(argv[i], "-a") && (i+1 < argc-1))
+		{
+			alternate = strtol(argv[++i], NULL, 0);
+			continue;
+		}
+		
+		if (!strcmp(argv[i], "-g") && (i+1 < argc-1))
+		{
+			gap = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		
+		if (!strcmp(argv[i], "-p") && (i+1 < argc-1))
+		{
+			page = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		
+		if (!strcmp(argv[i], "-n") && (i+1 < argc-1))
+		{
+			name = argv[++i];
+			target = -1;
+			continue;
+		}
+		
+		if (!strcmp(argv[i], "-d") && (i+1 < argc-1))
+		{
+			basename = argv[++i];
+			continue;
+		}
+		
+		address = 0x08000000;
+		at = strrchr(argv[i], '@');
+		if (NULL != at)
+		{
+			*at = 0;
+			address = strtoul(at+1, NULL, 0);
+		}
+		
+		if (!strcmp(argv[i], "-"))
+			binfile = STDIN_FILENO;
+		else
+			binfile = open(argv[i], O_RDONLY);
+		
+		if (binfile == -1)
+		{
+			printf("Could not open %s\n", argv[i]);
+			return -1;
+		}
+		
+		image = dfuinput_load(binfile, argv[i], address, (NULL != at));
+		
+		if (binfile != STDIN_FILENO)
+			close(binfile);
+		
+		if (NULL == image)
+			return -1;
+		images[nimages++] = image;
+		
+		//a delta gets a target of its own, named for its base
+		if (NULL != basename)
+		{
+			binfile = open(basename, O_RDONLY);
+			if (binfile == -1)
+			{
+				printf("Could not open %s\n", basename);
+				return -1;
+			}
+			
+			base = dfuinput_load(binfile, basename, address, (NULL != at));
+			close(binfile);
+			if (NULL == base)
+				return -1;
+			
+			rv = dfuinput_delta(image, base, page, &delta, argv[i]);
+			dfuinput_free(base);
+			if (0 != rv)
+				return -1;
+			
+			target = dfuse_addtarget(dfusefile, alternate);
+			dfuse_delta_name(dfusefile->images[target]->tarprefix, &delta);
+			
+			for (j=0, dropped=0; j<image->nsegments; j++)
+				dropped += image->segments[j].size;
+			fprintf(stderr, "%s: %u of %u bytes changed since %s, %d elements\n",
+					argv[i], dropped, delta.length, basename, image->nsegments);
+		} else
+		{
+			dropped = dfuinput_split(image, gap, page);
+			if (dropped > 0)
+			{
+				fprintf(stderr, "%s: left out %u bytes of 0xff, %d elements\n",
+						argv[i], dropped, image->nsegments);
+			}
+			
+			if ((target < 0) || (dfusefile->images[target]->tarprefix->alternate_setting != alternate) ||
+				(0 == dfuse_delta_parse(dfusefile->images[target]->tarprefix, &delta)))
+			{
+				target = dfuse_addtarget(dfusefile, alternate);
+				if (NULL != name)
+				{
+					memset(dfusefile->images[target]->tarprefix->target_name, 0,
+							sizeof(dfusefile->images[target]->tarprefix->target_name));
+					strncpy(dfusefile->images[target]->tarprefix->target_name, name,
+							sizeof(dfusefile->images[target]->tarprefix->target_name) - 1);
+				}
+			}
+		}
+		
+		if (pack)
+		{
+			for (j=0; j<image->nsegments; j++)
+				unpacked += image->segments[j].size;
+			packed += dfuinput_pack(image);
+		}
+		
+		for (j=0; j<image->nsegments; j++)
+		{
+			dfuse_addelement_data(dfusefile, target, image->segments[j].address,
+					image->segments[j].data, image->segments[j].size);
+		}
+		
+		basename = NULL;
+	}
 	
-	dfuse_writeprefix(dfusefile, dfufile);
+	if (pack)
+	{
+		memcpy(dfusefile->prefix->signature, DFULZ_SIGNATURE, 5);
+		fprintf(stderr, "packed %u bytes into %u\n", unpacked, packed);
+	}
 	
-	dfuse_writetarprefix(dfusefile, dfufile);
+	if (!strcmp(argv[argc-1], "-"))
+		dfufile = STDOUT_FILENO;
+	else
+		dfufile = open(argv[argc-1], O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 	
-	dfuse_writeimgelement(dfusefile, dfufile);
+	if (dfufile == -1)
+	{
+		printf("Could not create %s\n", argv[argc-1]);
+		return -2;
+	}
 	
-	dfuse_writesuffix(dfusefile, dfufile);
+	rv = dfuse_writefile(dfusefile, dfufile);
+	if (rv != 0)
+	{
+		fprintf(stderr, "Could not write %s\n", argv[argc-1]);
+		rv = -2;
+	}
 	
 // 	printf("Checksum: <%x>\n", dfusefile->suffix->crc);
 	
 	dfuse_struct_cleanup(dfusefile);
 	
-	close(binfile);
-	close(dfufile);
+	for (i=0; i<nimages; i++)
+		dfuinput_free(images[i]);
+	free(images);
+	
+	if (dfufile != STDOUT_FILENO)
+		close(dfufile);
 	
-	return 0;
-}
\ No newline at end of file
+	return rv;
+}
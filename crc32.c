@@ -1,78 +1,337 @@
-/*
-crc32.{c,h} :
-Provides routines for calculating 32 bit Cyclic Redundancy Checks (CRCs).
-DfuSe uses a CRC to verify the contents of the DfuSe file.
-*/
-
-/*
- * efone - Distributed internet phone system.
- *
- * (c) 1999,2000 Krzysztof Dabrowski
- * (c) 1999,2000 ElysiuM deeZine
- *
- * This program is free software; you can redistribute it and/or
- * modify it under the terms of the GNU General Public License
- * as published by the Free Software Foundation; either version
- * 2 of the License, or (at your option) any later version.
- *
- */
-
-/* based on implementation by Finn Yannick Jacobs */
-
-#include <stdio.h>
-#include <stdlib.h>
-
-#define CRCPOLYNOMIAL 0xedb88320
-
-/* crc_tab[] -- this crcTable is being build by chksum_crc32GenTab().
- *		so make sure, you call it before using the other
- *		functions!
- */
-u_int32_t crc_tab[256];
-
-/* chksum_crc32() -- to a given block, this one calculates the
- *				crc32-checksum until the length is
- *				reached. the crc32-checksum will be
- *				the result.
- */
-u_int32_t chksum_crc32 (unsigned char *block, unsigned int length)
-{
-   register unsigned long crc;
-   unsigned long i;
-
-   crc = 0xFFFFFFFF;
-   for (i = 0; i < length; i++)
-   {
-      crc = ((crc >> 8) & 0x00FFFFFF) ^ crc_tab[(crc ^ *block++) & 0xFF];
-   }
-   return (crc ^ 0xFFFFFFFF);
-}
-
-/* chksum_crc32gentab() --      to a global crc_tab[256], this one will
- *				calculate the crcTable for crc32-checksums.
- *				it is generated to the polynom [..]
- */
-
-void chksum_crc32gentab ()
-{
-   unsigned long crc, poly;
-   int i, j;
-
-   poly = CRCPOLYNOMIAL;
-   for (i = 0; i < 256; i++)
-   {
-      crc = i;
-      for (j = 8; j > 0; j--)
-      {
-	 if (crc & 1)
-	 {
-	    crc = (crc >> 1) ^ poly;
-	 }
-	 else
-	 {
-	    crc >>= 1;
-	 }
-      }
-      crc_tab[i] = crc;
-   }
-}
+/*
+crc32.{c,h} :
+Provides routines for calculating 32 bit Cyclic Redundancy Checks (CRCs).
+DfuSe uses a CRC to verify the contents of the DfuSe file.
+*/
+
+/*
+ * efone - Distributed internet phone system.
+ *
+ * (c) 1999,2000 Krzysztof Dabrowski
+ * (c) 1999,2000 ElysiuM deeZine
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+/* based on implementation by Finn Yannick Jacobs */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CRC32_HAVE_CLMUL 1
+#endif
+
+#define CRCPOLYNOMIAL 0xedb88320
+
+#ifndef CRC32_MAKETAB
+/* crc_tab8[][] -- generated from CRCPOLYNOMIAL at build time by
+ *		"make crc32tab.h", so there's nothing to set up at run
+ *		time and nothing shared that can change under another
+ *		thread. crc_tab8[0] is the byte at a time table, and
+ *		crc_tab8[k][b] is the crc of byte b followed by k zero
+ *		bytes, so eight bytes can be folded in with eight
+ *		independent lookups (slicing-by-8).
+ */
+#include "crc32tab.h"
+
+/* chksum_crc32_bytewise() -- the original byte at a time loop, one
+ *				table lookup per byte. kept as the
+ *				reference the faster kernels are checked
+ *				and benchmarked against.
+ */
+u_int32_t chksum_crc32_bytewise (unsigned char *block, unsigned int length)
+{
+   register unsigned long crc;
+   unsigned long i;
+
+   crc = 0xFFFFFFFF;
+   for (i = 0; i < length; i++)
+   {
+      crc = ((crc >> 8) & 0x00FFFFFF) ^ crc_tab8[0][(crc ^ *block++) & 0xFF];
+   }
+   return (crc ^ 0xFFFFFFFF);
+}
+
+/* crc32_slice8() -- runs the crc (not inverted at either end) over
+ *			length bytes, eight at a time.
+ */
+static u_int32_t crc32_slice8 (u_int32_t crc, const unsigned char *block, unsigned long length)
+{
+   u_int32_t lo, hi;
+
+   for (; length >= 8; length -= 8, block += 8)
+   {
+      lo = crc ^ (block[0] | (block[1] << 8) | (block[2] << 16) | ((u_int32_t)block[3] << 24));
+      hi = block[4] | (block[5] << 8) | (block[6] << 16) | ((u_int32_t)block[7] << 24);
+      crc = crc_tab8[7][lo & 0xFF] ^ crc_tab8[6][(lo >> 8) & 0xFF] ^
+            crc_tab8[5][(lo >> 16) & 0xFF] ^ crc_tab8[4][lo >> 24] ^
+            crc_tab8[3][hi & 0xFF] ^ crc_tab8[2][(hi >> 8) & 0xFF] ^
+            crc_tab8[1][(hi >> 16) & 0xFF] ^ crc_tab8[0][hi >> 24];
+   }
+
+   for (; length > 0; length--)
+   {
+      crc = (crc >> 8) ^ crc_tab8[0][(crc ^ *block++) & 0xFF];
+   }
+
+   return crc;
+}
+
+/* chksum_crc32_slice8() -- the crc32-checksum of a block with the
+ *				slicing-by-8 kernel.
+ */
+u_int32_t chksum_crc32_slice8 (unsigned char *block, unsigned int length)
+{
+   return crc32_slice8(0xFFFFFFFF, block, length) ^ 0xFFFFFFFF;
+}
+
+#ifdef CRC32_HAVE_CLMUL
+/* crc32_clmul() -- folds length bytes (a multiple of 16, at least 64)
+ *			into the crc with carry-less multiplies, four
+ *			16 byte lanes at a time, then Barrett reduces to
+ *			32 bits. the constants are the bit reflected
+ *			x^n mod P(x) folding constants from Intel's
+ *			"Fast CRC Computation for Generic Polynomials
+ *			Using PCLMULQDQ Instruction".
+ */
+__attribute__((target("pclmul,sse4.1")))
+static u_int32_t crc32_clmul (u_int32_t crc, const unsigned char *block, unsigned long length)
+{
+   static const u_int64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+   static const u_int64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+   static const u_int64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ULL, 0x0000000000ULL };
+   static const u_int64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641ULL, 0x01f7011641ULL };
+   __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+   x1 = _mm_loadu_si128((const __m128i *)(block + 0x00));
+   x2 = _mm_loadu_si128((const __m128i *)(block + 0x10));
+   x3 = _mm_loadu_si128((const __m128i *)(block + 0x20));
+   x4 = _mm_loadu_si128((const __m128i *)(block + 0x30));
+
+   x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+   x0 = _mm_load_si128((const __m128i *)k1k2);
+
+   block += 64;
+   length -= 64;
+
+   /* fold four lanes of 16 bytes at a time */
+   while (length >= 64)
+   {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+      y5 = _mm_loadu_si128((const __m128i *)(block + 0x00));
+      y6 = _mm_loadu_si128((const __m128i *)(block + 0x10));
+      y7 = _mm_loadu_si128((const __m128i *)(block + 0x20));
+      y8 = _mm_loadu_si128((const __m128i *)(block + 0x30));
+
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+      block += 64;
+      length -= 64;
+   }
+
+   /* fold the four lanes into one */
+   x0 = _mm_load_si128((const __m128i *)k3k4);
+
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+   /* then any 16 byte blocks left over */
+   while (length >= 16)
+   {
+      x2 = _mm_loadu_si128((const __m128i *)block);
+
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+      block += 16;
+      length -= 16;
+   }
+
+   /* 128 bits down to 64 */
+   x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+   x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+   x1 = _mm_srli_si128(x1, 8);
+   x1 = _mm_xor_si128(x1, x2);
+
+   x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_and_si128(x1, x3);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   /* Barrett reduction to 32 bits */
+   x0 = _mm_load_si128((const __m128i *)poly);
+
+   x2 = _mm_and_si128(x1, x3);
+   x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+   x2 = _mm_and_si128(x2, x3);
+   x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+/* chksum_crc32_has_clmul() -- returns 1 if this cpu can run the carry-
+ *				less multiply kernel.
+ */
+int chksum_crc32_has_clmul ()
+{
+#ifdef CRC32_HAVE_CLMUL
+   return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+   return 0;
+#endif
+}
+
+/* crc32_update() -- runs the crc (not inverted at either end) over
+ *			length bytes with the carry-less multiply kernel
+ *			for whole 16 byte blocks and slicing-by-8 for the
+ *			tail, or slicing-by-8 throughout where the cpu
+ *			can't.
+ */
+static u_int32_t crc32_update (u_int32_t crc, const unsigned char *block, unsigned long length)
+{
+#ifdef CRC32_HAVE_CLMUL
+   unsigned long bulk = length & ~15UL;
+
+   if ((bulk >= 64) && chksum_crc32_has_clmul())
+   {
+      crc = crc32_clmul(crc, block, bulk);
+      block += bulk;
+      length -= bulk;
+   }
+#endif
+   return crc32_slice8(crc, block, length);
+}
+
+/* chksum_crc32_clmul() -- the crc32-checksum of a block with the carry-
+ *				less multiply kernel (see crc32_update()).
+ */
+u_int32_t chksum_crc32_clmul (unsigned char *block, unsigned int length)
+{
+   return crc32_update(0xFFFFFFFF, block, length) ^ 0xFFFFFFFF;
+}
+
+/* chksum_crc32_init() -- the crc of no data, to start a running
+ *				crc with.
+ */
+u_int32_t chksum_crc32_init ()
+{
+   return 0xFFFFFFFF;
+}
+
+/* chksum_crc32_update() -- folds the next length bytes of the data
+ *				into a running crc, and returns the
+ *				new running crc. the fastest kernel the
+ *				cpu supports is used.
+ */
+u_int32_t chksum_crc32_update (u_int32_t crc, const unsigned char *block, unsigned int length)
+{
+   return crc32_update(crc, block, length);
+}
+
+/* chksum_crc32_final() -- turns a running crc into the crc32-checksum
+ *				of all the data folded into it.
+ */
+u_int32_t chksum_crc32_final (u_int32_t crc)
+{
+   return crc ^ 0xFFFFFFFF;
+}
+
+/* chksum_crc32() -- to a given block, this one calculates the
+ *				crc32-checksum until the length is
+ *				reached. the crc32-checksum will be
+ *				the result.
+ */
+u_int32_t chksum_crc32 (unsigned char *block, unsigned int length)
+{
+   return chksum_crc32_final(chksum_crc32_update(chksum_crc32_init(), block, length));
+}
+#endif
+
+#ifdef CRC32_MAKETAB
+/* main() -- prints crc32tab.h: the byte at a time table for the
+ *		polynom [..] and the slicing-by-8 tables derived from it.
+ *		built and run by "make crc32tab.h".
+ */
+int main ()
+{
+   unsigned long crc, poly;
+   u_int32_t tab[8][256];
+   int i, j;
+
+   poly = CRCPOLYNOMIAL;
+   for (i = 0; i < 256; i++)
+   {
+      crc = i;
+      for (j = 8; j > 0; j--)
+      {
+	 if (crc & 1)
+	 {
+	    crc = (crc >> 1) ^ poly;
+	 }
+	 else
+	 {
+	    crc >>= 1;
+	 }
+      }
+      tab[0][i] = crc;
+   }
+
+   for (i = 0; i < 256; i++)
+   {
+      for (j = 1; j < 8; j++)
+      {
+	 tab[j][i] = (tab[j-1][i] >> 8) ^ tab[0][tab[j-1][i] & 0xFF];
+      }
+   }
+
+   printf("/* crc32tab.h -- generated by \"make crc32tab.h\" from crc32.c, don't edit. */\n\n");
+   printf("static const u_int32_t crc_tab8[8][256] = {\n");
+   for (j = 0; j < 8; j++)
+   {
+      printf("   {\n");
+      for (i = 0; i < 256; i++)
+      {
+	 printf("%s0x%08lxUL%s", (i % 6) ? " " : "      ", (unsigned long)tab[j][i],
+		(i == 255) ? "\n" : ((i % 6) == 5) ? ",\n" : ",");
+      }
+      printf("   }%s\n", (j == 7) ? "" : ",");
+   }
+   printf("};\n");
+
+   return 0;
+}
+#endif
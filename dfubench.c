@@ -0,0 +1,614 @@
+/*
+dfubench.c :
+Compares the two ways of loading a DfuSe file: dfuse_load(), which reads it a
+field at a time and copies every element out, and dfuse_map(), which maps it
+and points into the mapping. A multi-element file is generated, then each
+loader is timed over a number of runs, touching every payload byte the way a
+download would, and the syscalls each makes are counted. The CRC kernels that
+check the file on load are then timed against the original byte at a time loop,
+and the Intel HEX and S-record decoders against an sscanf() per record parser,
+on the same payload written out as hex. A file of 10000 tiny elements is then
+parsed and freed with each loader, for what building the dfuse_file itself
+costs and how many heap calls it takes. Last, each firmware file given (bin,
+ELF, Intel HEX or S-record; dfubench's own executable if there are none) is
+packed with dfulz, for its compression ratio and how fast it packs, and read
+back a download block at a time, as stmdfu does, for how fast it decodes.
+
+	dfubench [elements] [element KB] [runs] [firmware ...]
+
+The syscall counts come from wrapping read, pread, open, close and mmap at link
+time, and the heap calls from wrapping malloc, calloc, realloc and free (see the
+dfubench target in the Makefile).
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "crc32.h"
+#include "dfuse.h"
+#include "dfulz.h"
+#include "dfuinput.h"
+
+static unsigned long dfubench_syscalls;
+static unsigned long dfubench_allocs;
+static unsigned long dfubench_frees;
+
+ssize_t __real_read(int fd, void * buf, size_t count);
+int __real_open(const char * path, int flags, ...);
+int __real_close(int fd);
+void * __real_mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset);
+ssize_t __real_pread(int fd, void * buf, size_t count, off_t offset);
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t n, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+void __real_free(void * ptr);
+
+ssize_t __wrap_read(int fd, void * buf, size_t count)
+{
+	dfubench_syscalls++;
+	return __real_read(fd, buf, count);
+}
+
+int __wrap_open(const char * path, int flags, mode_t mode)
+{
+	dfubench_syscalls++;
+	return __real_open(path, flags, mode);
+}
+
+int __wrap_close(int fd)
+{
+	dfubench_syscalls++;
+	return __real_close(fd);
+}
+
+void * __wrap_mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	dfubench_syscalls++;
+	return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+ssize_t __wrap_pread(int fd, void * buf, size_t count, off_t offset)
+{
+	dfubench_syscalls++;
+	return __real_pread(fd, buf, count, offset);
+}
+
+void * __wrap_malloc(size_t size)
+{
+	dfubench_allocs++;
+	return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t n, size_t size)
+{
+	dfubench_allocs++;
+	return __real_calloc(n, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size)
+{
+	dfubench_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void * ptr)
+{
+	if (NULL != ptr)
+		dfubench_frees++;
+	__real_free(ptr);
+}
+
+/*
+	dfubench_now() returns a monotonic timestamp in seconds.
+*/
+static double dfubench_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+	dfubench_make() writes a dfuse file with nelements elements of size
+	bytes each, one after the other in flash.
+*/
+static int dfubench_make(const char * file, int nelements, uint32_t size)
+{
+	char binname[] = "/tmp/dfubench-XXXXXX";
+	dfuse_file * dfusefile;
+	uint8_t * bin;
+	uint32_t i;
+	int binfile, dfufile;
+	int element;
+
+	binfile = mkstemp(binname);
+	if (binfile < 0)
+		return -1;
+	unlink(binname);
+
+	bin = (uint8_t *)malloc(size);
+	for (i=0; i<size; i++)
+		bin[i] = (i * 7) ^ (i >> 8);
+	write(binfile, bin, size);
+	free(bin);
+
+	dfusefile = dfuse_new();
+	dfuse_addtarget(dfusefile, 0);
+
+	for (i=0; i<nelements; i++)
+	{
+		lseek(binfile, 0, SEEK_SET);
+		element = dfuse_addelement(dfusefile, 0, 0x08000000 + i * size, binfile);
+		dfuse_readbin(dfusefile, binfile, 0, element);
+	}
+	close(binfile);
+
+	dfufile = open(file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (dfufile < 0)
+	{
+		dfuse_struct_cleanup(dfusefile);
+		return -1;
+	}
+
+	dfuse_writeprefix(dfusefile, dfufile);
+	dfuse_writetarprefix(dfusefile, dfufile, 0);
+	for (i=0; i<nelements; i++)
+		dfuse_writeimgelement(dfusefile, dfufile, 0, i);
+	dfuse_writesuffix(dfusefile, dfufile);
+
+	close(dfufile);
+	dfuse_struct_cleanup(dfusefile);
+
+	return 0;
+}
+
+/*
+	dfubench_touch() reads every payload byte, as the download path
+	does, so the mapping's page faults are paid for in the timing.
+*/
+static uint32_t dfubench_touch(dfuse_file * dfusefile)
+{
+	dfuse_image_element * element;
+	uint32_t sum = 0;
+	uint32_t k;
+	int i, j;
+
+	for (i=0; i<dfusefile->prefix->targets; i++)
+	{
+		for (j=0; j<dfusefile->images[i]->tarprefix->num_elements; j++)
+		{
+			element = dfusefile->images[i]->imgelement[j];
+			for (k=0; k<element->element_size; k+=64)
+				sum += element->data[k];
+		}
+	}
+
+	return sum;
+}
+
+/*
+	dfubench_crc() times each crc kernel over the whole file.
+*/
+static void dfubench_crc(const char * file, int runs)
+{
+	u_int32_t (*kernels[3])(unsigned char *, unsigned int) =
+		{chksum_crc32_bytewise, chksum_crc32_slice8, chksum_crc32_clmul};
+	const char * names[3] = {"byte at a time", "slicing-by-8", "clmul"};
+	dfuse_file * dfusefile;
+	u_int32_t crcs[3];
+	double t0, seconds;
+	int i, r;
+
+	dfusefile = dfuse_map(file);
+	if (NULL == dfusefile)
+		return;
+
+	printf("\n%-20s %12s %14s %12s\n", "crc kernel", "ms per file", "", "GB/s");
+
+	for (i=0; i<3; i++)
+	{
+		t0 = dfubench_now();
+		for (r=0; r<runs; r++)
+			crcs[i] = kernels[i](dfusefile->map, dfusefile->maplength);
+		seconds = dfubench_now() - t0;
+
+		printf("%-20s %12.3f %14s %12.2f\n", names[i], seconds * 1000 / runs,
+				((i == 2) && !chksum_crc32_has_clmul()) ? "(no pclmul)" : "",
+				(double)dfusefile->maplength * runs / 1e9 / seconds);
+	}
+
+	if ((crcs[0] != crcs[1]) || (crcs[0] != crcs[2]))
+		printf("crc kernels disagree!\n");
+
+	dfuse_struct_cleanup(dfusefile);
+}
+
+/*
+	dfubench_writehex() writes size bytes of the same pattern as
+	dfubench_make() to file as Intel HEX (srec 0) or S3 records (srec
+	1), 16 bytes to a record, the way objcopy does.
+*/
+static int dfubench_writehex(const char * file, uint32_t size, int srec)
+{
+	FILE * out;
+	uint8_t record[16];
+	uint32_t address = 0x08000000;
+	uint32_t i, k;
+	uint8_t sum;
+
+	out = fopen(file, "w");
+	if (NULL == out)
+		return -1;
+
+	for (i=0; i<size; i+=16, address+=16)
+	{
+		for (k=0; k<16; k++)
+			record[k] = ((i+k) * 7) ^ ((i+k) >> 8);
+
+		if (srec)
+		{
+			sum = 21 + (address >> 24) + (address >> 16) + (address >> 8) + address;
+			fprintf(out, "S315%08X", address);
+			for (k=0; k<16; k++)
+			{
+				fprintf(out, "%02X", record[k]);
+				sum += record[k];
+			}
+			fprintf(out, "%02X\n", (uint8_t)~sum);
+		}
+		else
+		{
+			if (0 == (address & 0xffff))
+			{
+				sum = 2 + 4 + (address >> 24) + (address >> 16);
+				fprintf(out, ":02000004%04X%02X\n", address >> 16, (uint8_t)-sum);
+			}
+			sum = 16 + (address >> 8) + address;
+			fprintf(out, ":10%04X00", address & 0xffff);
+			for (k=0; k<16; k++)
+			{
+				fprintf(out, "%02X", record[k]);
+				sum += record[k];
+			}
+			fprintf(out, "%02X\n", (uint8_t)-sum);
+		}
+	}
+	if (!srec)
+		fprintf(out, ":00000001FF\n");
+
+	fclose(out);
+
+	return 0;
+}
+
+/*
+	dfubench_sscanfhex() is the obvious Intel HEX parser, a line and
+	an sscanf() per record and per byte, as a baseline. It only
+	handles what dfubench_writehex() writes. Returns the number of
+	data bytes.
+*/
+static uint32_t dfubench_sscanfhex(const char * file, uint8_t * out, uint32_t size)
+{
+	FILE * in;
+	char line[600];
+	unsigned int n, address, type, byte, k;
+	uint32_t base = 0;
+	uint32_t total = 0;
+
+	in = fopen(file, "r");
+	if (NULL == in)
+		return 0;
+
+	while (NULL != fgets(line, sizeof(line), in))
+	{
+		if (3 != sscanf(line, ":%2x%4x%2x", &n, &address, &type))
+			break;
+		if (type == 4)
+		{
+			sscanf(&line[9], "%4x", &base);
+			base <<= 16;
+		}
+		else if (type == 0)
+		{
+			for (k=0; k<n; k++)
+			{
+				sscanf(&line[9+2*k], "%2x", &byte);
+				if (base + address + k - 0x08000000 < size)
+					out[base + address + k - 0x08000000] = byte;
+			}
+			total += n;
+		}
+	}
+
+	fclose(in);
+
+	return total;
+}
+
+/*
+	dfubench_hex() times the decoders over size bytes of payload.
+*/
+static void dfubench_hex(uint32_t size, int runs)
+{
+	const char * files[2] = {"/tmp/dfubench.hex", "/tmp/dfubench.srec"};
+	const char * names[3] = {"sscanf() ihex", "dfuinput ihex", "dfuinput srec"};
+	dfuinput_image * image;
+	uint8_t * baseline;
+	struct stat st;
+	double t0, seconds;
+	uint32_t got = 0;
+	int i, r, fd;
+
+	if ((0 != dfubench_writehex(files[0], size, 0)) || (0 != dfubench_writehex(files[1], size, 1)))
+		return;
+
+	baseline = (uint8_t *)malloc(size);
+
+	printf("\n%u KB as hex\n", size / 1024);
+	printf("%-20s %12s %14s %12s\n", "hex parser", "ms per file", "text MB", "MB/s");
+
+	for (i=0; i<3; i++)
+	{
+		stat(files[i ? i-1 : 0], &st);
+
+		t0 = dfubench_now();
+		for (r=0; r<runs; r++)
+		{
+			if (i == 0)
+			{
+				got = dfubench_sscanfhex(files[0], baseline, size);
+				continue;
+			}
+
+			fd = open(files[i-1], O_RDONLY);
+			image = dfuinput_load(fd, files[i-1], 0, 0);
+			close(fd);
+			if (NULL == image)
+				break;
+
+			got = 0;
+			if ((1 == image->nsegments) && !memcmp(image->segments[0].data, baseline, size))
+				got = image->segments[0].size;
+			dfuinput_free(image);
+		}
+		seconds = dfubench_now() - t0;
+
+		printf("%-20s %12.3f %14.1f %12.1f\n", names[i], seconds * 1000 / runs,
+				st.st_size / (1024.0 * 1024), (double)st.st_size * runs / (1024 * 1024) / seconds);
+
+		if (got != size)
+			printf("%s doesn't match the payload!\n", names[i]);
+	}
+
+	free(baseline);
+	unlink(files[0]);
+	unlink(files[1]);
+}
+
+/*
+	dfubench_parse() times building and tearing down the dfuse_file of
+	a file with nelements tiny elements, where it's the structs that
+	cost and not the payload, and counts the heap calls each makes.
+*/
+static void dfubench_parse(int nelements, int runs)
+{
+	char file[] = "/tmp/dfubench-many.dfuse";
+	dfuse_file * (*loaders[3])(const char *) = {dfuse_load, dfuse_map, dfuse_index};
+	const char * names[3] = {"read (dfuse_load)", "mmap (dfuse_map)", "index (dfuse_index)"};
+	dfuse_file * dfusefile;
+	unsigned long allocs, frees;
+	double t0, parsesecs, freesecs;
+	int i, r;
+
+	if (0 != dfubench_make(file, nelements, 64))
+	{
+		printf("couldn't create <%s>\n", file);
+		return;
+	}
+
+	printf("\n%d elements of 64 bytes\n", nelements);
+	printf("%-20s %12s %12s %12s %12s\n", "parser", "parse us", "free us", "allocs", "frees");
+
+	for (i=0; i<3; i++)
+	{
+		parsesecs = 0;
+		freesecs = 0;
+		dfubench_allocs = 0;
+		dfubench_frees = 0;
+
+		for (r=0; r<runs; r++)
+		{
+			t0 = dfubench_now();
+			dfusefile = loaders[i](file);
+			parsesecs += dfubench_now() - t0;
+			if (NULL == dfusefile)
+				break;
+
+			t0 = dfubench_now();
+			dfuse_struct_cleanup(dfusefile);
+			freesecs += dfubench_now() - t0;
+		}
+		allocs = dfubench_allocs;
+		frees = dfubench_frees;
+
+		printf("%-20s %12.1f %12.1f %12lu %12lu\n", names[i], parsesecs * 1e6 / runs, freesecs * 1e6 / runs,
+				allocs / runs, frees / runs);
+	}
+
+	unlink(file);
+}
+
+/*
+	dfubench_lz() packs each segment of a firmware file, then decodes
+	it a 2K download block at a time, and checks it comes back the same.
+*/
+static void dfubench_lz(const char * file, int runs)
+{
+	uint8_t block[2048];
+	dfuinput_image * image;
+	dfulz_reader reader;
+	uint8_t ** packed;
+	uint32_t * packedsize;
+	uint32_t raw = 0;
+	uint32_t stored = 0;
+	uint32_t offset, count;
+	double t0, packsecs, unpacksecs;
+	int i, r, fd;
+	int ok = 1;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("couldn't open <%s>\n", file);
+		return;
+	}
+	image = dfuinput_load(fd, file, 0x08000000, 0);
+	close(fd);
+	if (NULL == image)
+		return;
+
+	packed = (uint8_t **)calloc(image->nsegments ? image->nsegments : 1, sizeof(uint8_t *));
+	packedsize = (uint32_t *)calloc(image->nsegments ? image->nsegments : 1, sizeof(uint32_t));
+
+	t0 = dfubench_now();
+	for (r=0; r<runs; r++)
+	{
+		for (i=0; i<image->nsegments; i++)
+		{
+			free(packed[i]);
+			packed[i] = dfulz_pack(image->segments[i].data, image->segments[i].size, DFULZ_BLOCK_SIZE, &packedsize[i]);
+		}
+	}
+	packsecs = dfubench_now() - t0;
+
+	t0 = dfubench_now();
+	for (r=0; r<runs; r++)
+	{
+		for (i=0; i<image->nsegments; i++)
+		{
+			dfulz_reader_init(&reader, packed[i]);
+			for (offset=0; offset<image->segments[i].size; offset+=count)
+			{
+				count = image->segments[i].size - offset;
+				if (count > sizeof(block))
+					count = sizeof(block);
+
+				if ((0 != dfulz_read(block, count, offset, &reader)) ||
+					((r == 0) && memcmp(block, &image->segments[i].data[offset], count)))
+				{
+					ok = 0;
+				}
+			}
+			dfulz_reader_free(&reader);
+		}
+	}
+	unpacksecs = dfubench_now() - t0;
+
+	for (i=0; i<image->nsegments; i++)
+	{
+		raw += image->segments[i].size;
+		stored += packedsize[i];
+		free(packed[i]);
+	}
+
+	printf("%-28s %10u %10u %8.2f %12.1f %12.1f\n", file, raw, stored, stored ? (double)raw / stored : 0,
+			(double)raw * runs / (1024 * 1024) / packsecs, (double)raw * runs / (1024 * 1024) / unpacksecs);
+
+	if (!ok)
+		printf("%s doesn't come back the same!\n", file);
+
+	free(packed);
+	free(packedsize);
+	dfuinput_free(image);
+}
+
+int main(int argc, char * argv[])
+{
+	char file[] = "/tmp/dfubench.dfuse";
+	dfuse_file * (*loaders[2])(const char *) = {dfuse_load, dfuse_map};
+	const char * names[2] = {"read (dfuse_load)", "mmap (dfuse_map)"};
+	dfuse_file * dfusefile;
+	unsigned long syscalls;
+	uint32_t sums[2] = {0, 0};
+	double t0, seconds;
+	int nelements = 64;
+	uint32_t size = 256 * 1024;
+	int runs = 20;
+	int i, r;
+
+	if (argc > 1)
+		nelements = strtol(argv[1], NULL, 0);
+	if (argc > 2)
+		size = strtoul(argv[2], NULL, 0) * 1024;
+	if (argc > 3)
+		runs = strtol(argv[3], NULL, 0);
+
+	if ((nelements < 1) || (size < 1) || (runs < 1))
+	{
+		printf("usage: dfubench [elements] [element KB] [runs] [firmware ...]\n");
+		return -1;
+	}
+
+	if (0 != dfubench_make(file, nelements, size))
+	{
+		printf("couldn't create <%s>\n", file);
+		return -1;
+	}
+
+	printf("%d elements of %u KB, %d runs\n", nelements, size / 1024, runs);
+	printf("%-20s %12s %14s %12s\n", "loader", "ms per load", "syscalls", "MB/s");
+
+	for (i=0; i<2; i++)
+	{
+		//one untimed run warms the page cache
+		dfusefile = loaders[i](file);
+		if (NULL == dfusefile)
+			return -1;
+		dfuse_struct_cleanup(dfusefile);
+
+		dfubench_syscalls = 0;
+		t0 = dfubench_now();
+		for (r=0; r<runs; r++)
+		{
+			dfusefile = loaders[i](file);
+			sums[i] += dfubench_touch(dfusefile);
+			dfuse_struct_cleanup(dfusefile);
+		}
+		seconds = dfubench_now() - t0;
+		syscalls = dfubench_syscalls;
+
+		printf("%-20s %12.3f %14lu %12.1f\n", names[i], seconds * 1000 / runs, syscalls / runs,
+				(double)nelements * size * runs / (1024 * 1024) / seconds);
+	}
+
+	if (sums[0] != sums[1])
+		printf("loaders disagree on the payload!\n");
+
+	dfubench_crc(file, runs);
+	dfubench_hex((nelements * size > (8 * 1024 * 1024)) ? (8 * 1024 * 1024) : (nelements * size), runs);
+
+	unlink(file);
+
+	dfubench_parse(10000, runs);
+
+	printf("\n%-28s %10s %10s %8s %12s %12s\n", "dfulz", "bytes", "packed", "ratio", "pack MB/s", "decode MB/s");
+	if (argc > 4)
+	{
+		for (i=4; i<argc; i++)
+			dfubench_lz(argv[i], runs);
+	} else
+	{
+		dfubench_lz(argv[0], runs);
+	}
+
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+dfucache.{c,h} :
+Remembers, per board, the hash of every flash sector as stmdfu last left it.
+Boards are told apart by family and usb serial number, and each one's hashes
+live in a file in stmdfu's cache directory. With the hashes on hand an update
+only has to read back a few sectors, to check the board hasn't been changed
+behind stmdfu's back, rather than the whole of the flash it covers. Anything
+that writes or erases flash without keeping the hashes up to date forgets the
+board's cache.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "dfurequests.h"
+#include "dfucommands.h"
+#include "dfuerase.h"
+#include "dfucache.h"
+
+/*
+	dfu_page_cache_name() builds the cache file name for device, with
+	anything that doesn't belong in a file name swapped for _. Returns
+	< 0 if the device has no serial number to tell it apart by.
+*/
+static int32_t dfu_page_cache_name(char * name, int32_t size, dfu_device * device)
+{
+	int32_t n, i;
+
+	if (0 == device->serial[0])
+		return -1;
+
+	n = snprintf(name, size, "pages-%s-%s", device->family, device->serial);
+	for (i=0; (i<n) && (i<size); i++)
+	{
+		if ((name[i] == '/') || (name[i] == '.') || (name[i] == ' '))
+			name[i] = '_';
+	}
+
+	return 0;
+}
+
+/*
+	dfu_page_cache_find() returns the index of the sector at address,
+	or where it would go to keep the list sorted.
+*/
+static uint32_t dfu_page_cache_find(dfu_page_cache * cache, uint32_t address)
+{
+	uint32_t lo = 0;
+	uint32_t hi = cache->npages;
+	uint32_t mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (cache->pages[mid].address < address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+	dfu_page_cache_load() reads a line per sector: address, size and
+	hash, in hex. A file that doesn't start with the magic line, or
+	has a line it can't make sense of, is ignored as a whole.
+*/
+int32_t dfu_page_cache_load(dfu_page_cache * cache, dfu_device * device)
+{
+	char path[512];
+	char line[128];
+	unsigned int address, size;
+	unsigned long long hash;
+	FILE * file;
+
+	memset(cache, 0, sizeof(dfu_page_cache));
+
+	if (0 != dfu_page_cache_name(cache->name, sizeof(cache->name), device))
+		return -1;
+
+	if (0 != dfu_cache_path(path, sizeof(path), cache->name))
+		return -1;
+
+	file = fopen(path, "r");
+	if (NULL == file)
+		return 0;
+
+	if ((NULL == fgets(line, sizeof(line), file)) ||
+		strncmp(line, DFU_PAGE_CACHE_MAGIC, strlen(DFU_PAGE_CACHE_MAGIC)))
+	{
+		fclose(file);
+		return 0;
+	}
+
+	while (NULL != fgets(line, sizeof(line), file))
+	{
+		if (3 != sscanf(line, "%x %x %llx", &address, &size, &hash))
+		{
+			dfu_page_cache_free(cache);
+			break;
+		}
+
+		dfu_page_cache_set(cache, address, size, hash);
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+/*
+	dfu_page_cache_save() writes to a temporary file and renames it
+	over the old one, so an interrupted save leaves the old cache, or
+	none, rather than half of one.
+*/
+int32_t dfu_page_cache_save(dfu_page_cache * cache)
+{
+	char path[512];
+	char tmppath[520];
+	FILE * file;
+	uint32_t i;
+
+	if ((0 == cache->name[0]) || (0 != dfu_cache_path(path, sizeof(path), cache->name)))
+		return -1;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+	file = fopen(tmppath, "w");
+	if (NULL == file)
+		return -1;
+
+	fprintf(file, "%s\n", DFU_PAGE_CACHE_MAGIC);
+	for (i=0; i<cache->npages; i++)
+	{
+		fprintf(file, "%08x %x %016llx\n", cache->pages[i].address, cache->pages[i].size,
+				(unsigned long long)cache->pages[i].hash);
+	}
+
+	if (0 != fclose(file))
+	{
+		unlink(tmppath);
+		return -1;
+	}
+
+	return rename(tmppath, path);
+}
+
+uint64_t * dfu_page_cache_lookup(dfu_page_cache * cache, uint32_t address, uint32_t size)
+{
+	uint32_t i = dfu_page_cache_find(cache, address);
+
+	if ((i < cache->npages) && (cache->pages[i].address == address) && (cache->pages[i].size == size))
+		return &cache->pages[i].hash;
+
+	return NULL;
+}
+
+void dfu_page_cache_set(dfu_page_cache * cache, uint32_t address, uint32_t size, uint64_t hash)
+{
+	uint32_t i = dfu_page_cache_find(cache, address);
+
+	if ((i >= cache->npages) || (cache->pages[i].address != address))
+	{
+		cache->pages = (dfu_page_hash *)realloc(cache->pages, sizeof(dfu_page_hash) * (cache->npages + 1));
+		memmove(&cache->pages[i+1], &cache->pages[i], sizeof(dfu_page_hash) * (cache->npages - i));
+		cache->npages++;
+	}
+
+	cache->pages[i].address = address;
+	cache->pages[i].size = size;
+	cache->pages[i].hash = hash;
+}
+
+void dfu_page_cache_drop(dfu_page_cache * cache, uint32_t address)
+{
+	uint32_t i = dfu_page_cache_find(cache, address);
+
+	if ((i < cache->npages) && (cache->pages[i].address == address))
+	{
+		memmove(&cache->pages[i], &cache->pages[i+1], sizeof(dfu_page_hash) * (cache->npages - i - 1));
+		cache->npages--;
+	}
+}
+
+void dfu_page_cache_clear(dfu_page_cache * cache)
+{
+	char path[512];
+
+	free(cache->pages);
+	cache->pages = NULL;
+	cache->npages = 0;
+
+	if ((0 != cache->name[0]) && (0 == dfu_cache_path(path, sizeof(path), cache->name)))
+		unlink(path);
+}
+
+void dfu_page_cache_forget(dfu_device * device)
+{
+	char path[512];
+	char name[128];
+
+	if ((0 == dfu_page_cache_name(name, sizeof(name), device)) &&
+		(0 == dfu_cache_path(path, sizeof(path), name)))
+	{
+		unlink(path);
+	}
+}
+
+void dfu_page_cache_free(dfu_page_cache * cache)
+{
+	free(cache->pages);
+	cache->pages = NULL;
+	cache->npages = 0;
+}
@@ -0,0 +1,77 @@
+/*
+dfucache.{c,h} :
+Remembers, per board, the hash of every flash sector as stmdfu last left it.
+Boards are told apart by family and usb serial number, and each one's hashes
+live in a file in stmdfu's cache directory. With the hashes on hand an update
+only has to read back a few sectors, to check the board hasn't been changed
+behind stmdfu's back, rather than the whole of the flash it covers. Anything
+that writes or erases flash without keeping the hashes up to date forgets the
+board's cache.
+*/
+
+#ifndef __DFU_CACHE__
+#define __DFU_CACHE__
+
+//first line of a cache file, so an old or foreign file isn't trusted
+#define DFU_PAGE_CACHE_MAGIC "stmdfu page hashes 1"
+
+//sectors read back to check the cache, besides any the update needs anyway
+#define DFU_PAGE_CACHE_SAMPLES 2
+
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+	uint64_t hash;
+} dfu_page_hash;
+
+typedef struct {
+	char name[128];
+	dfu_page_hash * pages;
+	uint32_t npages;
+} dfu_page_cache;
+
+/*
+dfu_page_cache_load() fills cache with the sector hashes saved for
+device. Returns 0 if the device has a serial number to key the cache on
+(an empty cache is fine), < 0 if it can't have one.
+*/
+int32_t dfu_page_cache_load(dfu_page_cache * cache, dfu_device * device);
+
+/*
+dfu_page_cache_save() writes cache back to its file. Returns 0 on
+success.
+*/
+int32_t dfu_page_cache_save(dfu_page_cache * cache);
+
+/*
+dfu_page_cache_lookup() returns the hash of the sector at address, or
+NULL if it isn't known (or was known with a different size).
+*/
+uint64_t * dfu_page_cache_lookup(dfu_page_cache * cache, uint32_t address, uint32_t size);
+
+/*
+dfu_page_cache_set() records hash as what the sector at address holds.
+*/
+void dfu_page_cache_set(dfu_page_cache * cache, uint32_t address, uint32_t size, uint64_t hash);
+
+/*
+dfu_page_cache_drop() forgets the sector at address.
+*/
+void dfu_page_cache_drop(dfu_page_cache * cache, uint32_t address);
+
+/*
+dfu_page_cache_clear() forgets every sector, in memory and on disk.
+*/
+void dfu_page_cache_clear(dfu_page_cache * cache);
+
+/*
+dfu_page_cache_forget() deletes device's cache file, for when its flash
+has been changed without keeping the hashes up to date.
+*/
+void dfu_page_cache_forget(dfu_device * device);
+
+/*
+dfu_page_cache_free() releases the memory cache holds.
+*/
+void dfu_page_cache_free(dfu_page_cache * cache);
+#endif
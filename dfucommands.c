@@ -12,92 +12,380 @@ protocol used in the STM32 Bootloader, AN3156.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <libusb-1.0/libusb.h>
 #include "dfurequests.h"
 #include "dfucommands.h"
+#include "dfuse.h"
 
 /*
-	dfu_read_flash() fills membuf with length bytes from flash memory.
+	dfu_parse_runs() parses the "/address/count*size..." part of a
+	layout string at *layout into map, leaving *layout after it.
+	Returns 0 on success.
 */
-int32_t dfu_read_flash(dfu_device * device, uint8_t * membuf, uint32_t length)
+static int32_t dfu_parse_runs(dfu_memory_map * map, const char ** layout)
 {
-	int32_t read_2048;
-	dfu_status status;
-	int i;
-	int rv;
-	uint8_t finalpage[2048];
-	int finalread;
+	const char * p = *layout;
+	char * end;
+	uint32_t address, count, size;
+	dfu_sector_run * run;
 	
-	read_2048 = ceil(length / 2048.);
+	address = strtoul(p+1, &end, 0);
+	if ((end == p+1) || (*end != '/'))
+		return -1;
+	p = end + 1;
 	
-	//flash reads must be 2k, which is the flash block size on stm32
-	//read all but the final page
-	for (i=0; i<(read_2048-1); i++)
+	for (;;)
 	{
-		#if STMDFU_DEBUG_PRINTFS
-		printf("read_2048: <%d>\n", i);
-		#endif
-		if (0 > dfu_upload(device, i+2, &membuf[i*2048], 2048))
+		count = strtoul(p, &end, 10);
+		if ((end == p) || (*end != '*'))
+			return -1;
+		p = end + 1;
+		
+		size = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+		p = end;
+		
+		//a multiplier (' ', 'B', 'K' or 'M'), then the sector type 'a'-'g'
+		if (*p == 'K')
+			size *= 1024;
+		else if (*p == 'M')
+			size *= 1024 * 1024;
+		if ((*p == 'K') || (*p == 'M') || (*p == 'B') || (*p == ' '))
+			p++;
+		
+		if ((*p < 'a') || (*p > 'g') || (map->nruns == DFU_MAX_SECTOR_RUNS))
+			return -1;
+		
+		run = &map->runs[map->nruns++];
+		run->address = address;
+		run->count = count;
+		run->size = size;
+		run->attributes = *p - 'a' + 1;
+		address += count * size;
+		p++;
+		
+		if (*p != ',')
+			break;
+		p++;
+	}
+	
+	*layout = p;
+	
+	return 0;
+}
+
+/*
+	dfu_parse_layout() fills map from a DfuSe layout string, e.g.
+	"@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg". A string
+	can hold several "/address/sectors" parts.
+*/
+int32_t dfu_parse_layout(dfu_memory_map * map, const char * layout)
+{
+	const char * p = layout;
+	int n;
+	
+	memset(map, 0, sizeof(dfu_memory_map));
+	
+	if ((NULL == layout) || (*p != '@'))
+		return -1;
+	
+	//the name runs up to the first '/', less trailing spaces
+	for (p++; *p && (*p != '/'); p++)
+		;
+	for (n=p-layout-1; (n > 0) && (layout[n] == ' '); n--)
+		;
+	if (n >= sizeof(map->name))
+		n = sizeof(map->name) - 1;
+	memcpy(map->name, &layout[1], n);
+	
+	while (*p == '/')
+	{
+		if (0 != dfu_parse_runs(map, &p))
+		{
+			memset(map, 0, sizeof(dfu_memory_map));
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+	dfu_find_sector() looks up the sector of map that address falls in.
+*/
+int32_t dfu_find_sector(const dfu_memory_map * map, uint32_t address, dfu_sector * sector)
+{
+	const dfu_sector_run * run;
+	uint32_t i, n;
+	
+	for (i=0; i<map->nruns; i++)
+	{
+		run = &map->runs[i];
+		if ((address >= run->address) &&
+			((uint64_t)address < (uint64_t)run->address + (uint64_t)run->count * run->size))
+		{
+			n = (address - run->address) / run->size;
+			sector->address = run->address + n * run->size;
+			sector->size = run->size;
+			sector->attributes = run->attributes;
+			return 0;
+		}
+	}
+	
+	return -1;
+}
+
+/*
+	dfu_list_sectors() lists the sectors of the current alternate
+	setting's layout that overlap [start, end).
+*/
+uint32_t dfu_list_sectors(dfu_device * device, uint32_t start, uint32_t end, dfu_sector * sectors, uint32_t max)
+{
+	dfu_memory_map * map = &device->layout[device->alternate];
+	dfu_sector sector;
+	uint32_t address = start;
+	uint32_t n = 0;
+	
+	while (address < end)
+	{
+		if (0 == map->nruns)
+		{
+			sector.address = address - (address % STM32_PAGE_SIZE);
+			sector.size = STM32_PAGE_SIZE;
+			sector.attributes = DFU_SECTOR_READABLE | DFU_SECTOR_ERASABLE | DFU_SECTOR_WRITEABLE;
+		} else if (0 != dfu_find_sector(map, address, &sector))
 		{
-			printf("read_2048 error\n");
+			break;
 		}
 		
-		if (0 > dfu_get_status(device, &status))
+		if (n < max)
+			sectors[n] = sector;
+		n++;
+		
+		if (sector.address + sector.size <= address)
+			break;
+		address = sector.address + sector.size;
+	}
+	
+	return n;
+}
+
+/*
+	dfu_flash_size() adds up the erasable runs of the current alternate
+	setting's layout.
+*/
+uint32_t dfu_flash_size(dfu_device * device)
+{
+	dfu_memory_map * map = &device->layout[device->alternate];
+	uint64_t size = 0;
+	uint32_t i;
+	
+	for (i=0; i<map->nruns; i++)
+	{
+		if (map->runs[i].attributes & DFU_SECTOR_ERASABLE)
+			size += (uint64_t)map->runs[i].count * map->runs[i].size;
+	}
+	
+	return (size > 0xffffffff) ? 0xffffffff : size;
+}
+
+/*
+	dfu_check_range() checks that length bytes from address lie in
+	sectors with all the given attributes, in any of the device's
+	layouts.
+*/
+int32_t dfu_check_range(dfu_device * device, uint32_t address, uint32_t length, uint8_t attributes)
+{
+	dfu_sector sector;
+	uint64_t cur = address;
+	uint64_t end = (uint64_t)address + (length ? length : 1);
+	int known = 0;
+	int found;
+	int i;
+	
+	for (i=0; i<DFU_MAX_ALTS; i++)
+		known |= (device->layout[i].nruns != 0);
+	
+	if (!known)
+		return 0;
+	
+	while (cur < end)
+	{
+		found = 0;
+		for (i=0; (i<DFU_MAX_ALTS) && !found; i++)
 		{
-			printf("dfu_read_flash: dfu_get_status error\n");
+			found = (0 == dfu_find_sector(&device->layout[i], cur, &sector)) &&
+					((sector.attributes & attributes) == attributes);
 		}
 		
-		if (status.bState == STATE_DFU_ERROR)
+		if (!found)
 		{
-			if (status.bStatus == DFU_STATUS_ERROR_VENDOR)
-			{
-				printf("dfu_read_flash failed: flash read protection enabled\n");
-				return -1;
-			} else
-			{
-				printf("dfu_read_flash failed: reason unknown\n");
-			}
+			printf("address 0x%.8x is out of range for this device\n", (uint32_t)cur);
+			return -1;
 		}
+		
+		cur = (uint64_t)sector.address + sector.size;
 	}
 	
-	//read the final page
-	#if STMDFU_DEBUG_PRINTFS
-	printf("final read_2048: <%d>\n", (read_2048-1));
-	#endif
-	if (0 > dfu_upload(device, i+2, finalpage, 2048))
+	return 0;
+}
+
+/*
+	dfu_set_alternate() selects alternate setting alt of the DFU
+	interface.
+*/
+int32_t dfu_set_alternate(dfu_device * device, int32_t alt)
+{
+	int32_t rv;
+	
+	if ((alt < 0) || (alt >= DFU_MAX_ALTS))
+		return -1;
+	
+	rv = device->transport->set_alt(device, alt);
+	if (0 <= rv)
+		device->alternate = alt;
+	
+	return rv;
+}
+
+/*
+	dfu_read_flash_stream() reads length bytes from flash memory and
+	hands them to callback a block (the device's wTransferSize) at a
+	time.
+	
+	Two upload transfers take turns: the upload of the next block is
+	queued before callback is given the current one, so writing block N
+	out overlaps reading block N+1 over usb. Memory use is those two
+	buffers, however much is read.
+	
+	GETSTATUS is only sent when an upload fails, to find out why.
+*/
+int32_t dfu_read_flash_stream(dfu_device * device, uint32_t length, dfu_stream_cb callback, void * user_data)
+{
+	int32_t nblocks;
+	int32_t blocksize = device->transfer_size;
+	dfu_transfer * upload[DFU_STREAM_BUFFERS];
+	dfu_status status;
+	uint32_t count;
+	int32_t rv = 0;
+	int32_t result = 0;
+	int inflight = 0;
+	int buf = 0;
+	int i;
+	
+	if (!(device->attributes & DFU_ATTR_CAN_UPLOAD))
 	{
-		printf("read_2048 error\n");
+		printf("dfu_read_flash failed: device can't upload\n");
+		return -2;
 	}
 	
-	if (0 > dfu_get_status(device, &status))
+	nblocks = (length + blocksize - 1) / blocksize;
+	
+	if (nblocks > (0xffff - 2))
 	{
-		printf("dfu_read_flash: dfu_get_status error\n");
+		printf("dfu_read_flash failed: too many blocks for one address pointer\n");
+		return -5;
 	}
 	
-	if (status.bState == STATE_DFU_ERROR)
+	if (0 != dfu_check_range(device, device->address, length, DFU_SECTOR_READABLE))
+		return -7;
+	
+	for (i=0; i<DFU_STREAM_BUFFERS; i++)
+		upload[i] = dfu_transfer_alloc(device, blocksize);
+	
+	if ((NULL == upload[0]) || (NULL == upload[1]))
+	{
+		printf("dfu_read_flash: failed to allocate transfers\n");
+		result = -4;
+		nblocks = 0;
+	} else if (nblocks > 0)
+	{
+		count = (length < blocksize) ? length : blocksize;
+		rv = dfu_submit_upload(upload[0], 2, count);
+		inflight = (0 == rv);
+	}
+	
+	for (i=0; i<nblocks; i++)
 	{
-		if (status.bStatus == DFU_STATUS_ERROR_VENDOR)
+		count = length - i*blocksize;
+		if (count > blocksize)
+			count = blocksize;
+		
+		if (inflight)
 		{
-			printf("dfu_read_flash failed: flash read protection enabled\n");
-			return -1;
-		} else
+			rv = dfu_transfer_wait(upload[buf]);
+			inflight = 0;
+		}
+		
+		if (rv != count)
 		{
-			printf("dfu_read_flash failed: reason unknown\n");
+			printf("dfu_read_flash: dfu_upload error\n");
+			
+			if ((0 == dfu_get_status(device, &status)) &&
+				(status.bState == STATE_DFU_ERROR) &&
+				(status.bStatus == DFU_STATUS_ERROR_VENDOR))
+			{
+				printf("dfu_read_flash failed: flash read protection enabled\n");
+				result = -1;
+			} else
+			{
+				printf("dfu_read_flash failed: reason unknown\n");
+				result = -3;
+			}
+			break;
 		}
+		
+		//queue the next block before handing this one over
+		if (i+1 < nblocks)
+		{
+			rv = dfu_submit_upload(upload[buf ^ 1], i+3,
+									(length - (i+1)*blocksize < blocksize) ? (length - (i+1)*blocksize) : blocksize);
+			inflight = (0 == rv);
+		}
+		
+		if (0 != callback(dfu_transfer_data(upload[buf]), count, i*blocksize, user_data))
+		{
+			result = -6;
+			break;
+		}
+		
+		buf ^= 1;
 	}
 	
-	//fill up the user's buffer with bytes from
-	//the final page, ignoring bytes beyond the length
-	//of the user's request
-	finalread = length - ((read_2048-1)*2048);
+	//a transfer still on the bus has to land before it's freed
+	if (inflight)
+		dfu_transfer_wait(upload[buf ^ 1]);
 	
-	for (i=0; i<finalread; i++)
-	{
-		membuf[((read_2048-1)*2048)+i] = finalpage[i];
-	}
+	for (i=0; i<DFU_STREAM_BUFFERS; i++)
+		dfu_transfer_free(upload[i]);
+	
+	return result;
+}
 
-	return 1;
+/*
+	dfu_read_flash_copy() is dfu_read_flash()'s stream callback, it
+	copies each block into place in the caller's buffer.
+*/
+static int dfu_read_flash_copy(const uint8_t * data, uint32_t length, uint32_t offset, void * user_data)
+{
+	memcpy((uint8_t *)user_data + offset, data, length);
+	
+	return 0;
+}
+
+/*
+	dfu_read_flash() fills membuf with length bytes from flash memory.
+	Reads are made in blocks of the device's wTransferSize.
+*/
+int32_t dfu_read_flash(dfu_device * device, uint8_t * membuf, uint32_t length)
+{
+	int32_t rv = dfu_read_flash_stream(device, length, dfu_read_flash_copy, membuf);
+	
+	return (0 == rv) ? 1 : rv;
 }
 
 /*
@@ -154,38 +442,189 @@ int32_t dfu_get(dfu_device * device, uint8_t * data)
 }
 
 /*
-	dfu_write_flash() writes (in 2kB pages) the contents of membuf
-	to flash memory. The write begins at the location pointed to by
-	the address pointer (use dfu_set_address_pointer()).
+	dfu_wait_busy() polls the device until it leaves dfuDNBUSY. With
+	adaptive polling a GETSTATUS can come back before the operation
+	is done, so a single extra poll isn't enough.
 */
-int32_t dfu_write_flash(dfu_device * device, uint8_t * membuf, uint32_t length)
+static int32_t dfu_wait_busy(dfu_device * device, dfu_status * status)
+{
+	int retries = DFU_BUSY_RETRIES;
+	
+	do
+	{
+		if (0 > dfu_get_status(device, status))
+		{
+			return -1;
+		}
+	} while ((status->bState == STATE_DFU_DOWNLOAD_BUSY) && (0 < --retries));
+	
+	return 0;
+}
+
+/*
+	dfu_stage_block() copies block number block (of blocksize bytes) of
+	membuf, or has fill write it, into the data stage of transfer, and
+	returns how many bytes to download, or < 0 if fill failed. A short
+	final block is padded with 0xff only up to the next DFU_WRITE_ALIGN
+	bytes, so small targets like the option bytes aren't overrun.
+*/
+static int dfu_stage_block(dfu_transfer * transfer, uint8_t * membuf, uint32_t length, int block, int blocksize,
+		dfu_fill_cb fill, void * user_data)
 {
-	int write_2048;
-	int i, j;
+	uint8_t * stage = dfu_transfer_data(transfer);
+	uint32_t offset = block * blocksize;
+	uint32_t count = length - offset;
+	uint32_t padded;
+	
+	if (count > blocksize)
+		count = blocksize;
+	
+	padded = (count + DFU_WRITE_ALIGN - 1) & ~(DFU_WRITE_ALIGN - 1);
+	if (padded > blocksize)
+		padded = blocksize;
+	
+	if (NULL != fill)
+	{
+		if (0 != fill(stage, count, offset, user_data))
+			return -1;
+	} else
+	{
+		memcpy(stage, &membuf[offset], count);
+	}
+	memset(&stage[count], 0xff, padded - count);
+	
+	return padded;
+}
+
+/*
+	dfu_next_block() returns the first block, starting at block, that
+	has to be downloaded: the very next one, or in sparse mode the next
+	one that isn't all 0xff. Returns nblocks if there are none left.
+*/
+static int dfu_next_block(uint8_t * membuf, uint32_t length, int block, int nblocks, int blocksize, int sparse)
+{
+	uint32_t offset;
+	uint32_t count;
+	
+	for (; sparse && (block < nblocks); block++)
+	{
+		offset = block * blocksize;
+		count = length - offset;
+		if (count > blocksize)
+			count = blocksize;
+		
+		//padding of the final block is blank anyway
+		if (!dfuse_isblank(&membuf[offset], count))
+			break;
+	}
+	
+	return block;
+}
+
+/*
+	dfu_write_blocks() does the work for dfu_write_flash(),
+	dfu_write_flash_sparse() and dfu_write_flash_stream().
+	
+	Requests go through the asynchronous transfer engine: while the
+	GETSTATUS that starts programming one block is in flight, the next
+	block is staged in the other download buffer, so it's ready to go as
+	soon as the device is.
+	
+	Block numbers (wValue) stay relative to the address pointer, so
+	blocks skipped in sparse mode just leave a gap in the numbering and
+	the address pointer never needs to be set again.
+*/
+static int32_t dfu_write_blocks(dfu_device * device, uint8_t * membuf, uint32_t length, int sparse, uint32_t * skipped,
+		dfu_fill_cb fill, void * user_data)
+{
+	int nblocks;
+	int blocksize = device->transfer_size;
+	int i, next;
+	int buf = 0;
+	int stagedlen[2];
+	int written = 0;
 	dfu_status status;
 	int rv;
-	uint8_t finalpage[2048];
-	int finalwrite;
+	int result = 0;
+	dfu_transfer * staged[2];
+	dfu_transfer * getstatus;
+	
+	if (!(device->attributes & DFU_ATTR_CAN_DNLOAD))
+	{
+		printf("dfu_write_flash failed: device can't download\n");
+		return -5;
+	}
+	
+	//round up the number of writes to the next whole block
+	nblocks = (length + blocksize - 1) / blocksize;
+	
+	if (nblocks > (0xffff - 2))
+	{
+		printf("dfu_write_flash failed: too many blocks for one address pointer\n");
+		return -6;
+	}
 	
-	//round up the number of writes to the next 2kB page
-	write_2048 = ceil(length / 2048.);
+	if (0 != dfu_check_range(device, device->address, length, DFU_SECTOR_WRITEABLE))
+		return -7;
+	
+	device->poll.op = DFU_OP_PROGRAM;
+	
+	staged[0] = dfu_transfer_alloc(device, blocksize);
+	staged[1] = dfu_transfer_alloc(device, blocksize);
+	getstatus = dfu_transfer_alloc(device, 6);
+	
+	i = dfu_next_block(membuf, length, 0, nblocks, blocksize, sparse);
+	
+	if ((NULL == staged[0]) || (NULL == staged[1]) || (NULL == getstatus))
+	{
+		printf("dfu_write_flash: failed to allocate transfers\n");
+		result = -4;
+		i = nblocks;
+	} else if (i < nblocks)
+	{
+		stagedlen[0] = dfu_stage_block(staged[0], membuf, length, i, blocksize, fill, user_data);
+		if (stagedlen[0] < 0)
+		{
+			printf("dfu_write_flash: no data for block %d\n", i);
+			result = -8;
+			i = nblocks;
+		}
+	}
 	
-	//write all but the final page
-	for (i=0; i<(write_2048-1); i++)
+	//the final block is padded with 0xff by dfu_stage_block()
+	while (i < nblocks)
 	{
 		#if STMDFU_DEBUG_PRINTFS
-		printf("write_2048: <%d>\n", i);
+		printf("write block: <%d>\n", i);
 		#endif
-		rv = dfu_download(device, i+2, &membuf[i*2048], 2048);
+		rv = dfu_submit_download(staged[buf], i+2, stagedlen[buf]);
+		
+		if (0 == rv)
+			rv = dfu_transfer_wait(staged[buf]);
 		
 		if (0 > rv)
 		{
 			printf("dfu_write_flash: dfu_download error <%d>\n", rv);
+			result = -9;
+			break;
 		}
 		
-		if (0 > dfu_get_status(device, &status))
+		//this GETSTATUS starts the block programming. stage the next
+		//block while it's on the bus.
+		memset(&status, 0, sizeof(status));
+		rv = dfu_submit_get_status(getstatus);
+		
+		next = dfu_next_block(membuf, length, i+1, nblocks, blocksize, sparse);
+		if (next < nblocks)
+		{
+			stagedlen[buf ^ 1] = dfu_stage_block(staged[buf ^ 1], membuf, length, next, blocksize, fill, user_data);
+		}
+		
+		if ((0 > rv) || (0 > dfu_transfer_status(getstatus, &status)))
 		{
 			printf("dfu_write_flash: dfu_get_status error\n");
+			result = -9;
+			break;
 		}
 		
 		if (status.bState != STATE_DFU_DOWNLOAD_BUSY)
@@ -193,9 +632,11 @@ int32_t dfu_write_flash(dfu_device * device, uint8_t * membuf, uint32_t length)
 			printf("dfu_write_flash: not in STATE_DFU_DOWNLOAD_BUSY after dfu_download\n");
 		}
 		
-		if (0 > dfu_get_status(device, &status))
+		if (0 > dfu_wait_busy(device, &status))
 		{
 			printf("dfu_write_flash: dfu_get_status error 2\n");
+			result = -9;
+			break;
 		}
 		
 		if (status.bState == STATE_DFU_ERROR)
@@ -203,77 +644,72 @@ int32_t dfu_write_flash(dfu_device * device, uint8_t * membuf, uint32_t length)
 			if (status.bStatus == DFU_STATUS_ERROR_TARGET)
 			{
 				printf("dfu_write_flash failed: received address wrong/unsupported\n");
-				return -1;
+				result = -1;
 			} else if (status.bStatus == DFU_STATUS_ERROR_VENDOR)
 			{
 				printf("dfu_write_flash failed: flash read protection enabled\n");
-				return -2;
+				result = -2;
 			} else
 			{
 				printf("dfu_write_flash failed: reason unknown\n");
-				return -3;
+				result = -3;
 			}
+			break;
 		}
+		
+		written++;
+		
+		if ((next < nblocks) && (stagedlen[buf ^ 1] < 0))
+		{
+			printf("dfu_write_flash: no data for block %d\n", next);
+			result = -8;
+			break;
+		}
+		
+		i = next;
+		buf ^= 1;
 	}
 	
-	//write the final page
-	//we fill the final page with whatever good data
-	//is left in membuf, and pad it to 2048 with 0xff
-	finalwrite = length - ((write_2048-1)*2048);
-	
-	for (i=0; i<finalwrite; i++)
-	{
-		finalpage[i] = membuf[((write_2048-1)*2048)+i];
-	}
-	
-	for (i=finalwrite; i<2048; i++)
-	{
-		finalpage[i] = 0xff;
-	}
-	
-	#if STMDFU_DEBUG_PRINTFS
-	printf("final write_2048: <%d>\n", (write_2048-1));
-	#endif
-	rv = dfu_download(device, (write_2048-1)+2, finalpage, 2048);
-	
-	if (0 > rv)
-	{
-		printf("dfu_write_flash: dfu_download error <%d>\n", rv);
-	}
-	
-	if (0 > dfu_get_status(device, &status))
-	{
-		printf("dfu_write_flash: dfu_get_status error\n");
-	}
-	
-	if (status.bState != STATE_DFU_DOWNLOAD_BUSY)
-	{
-		printf("dfu_write_flash: not in STATE_DFU_DOWNLOAD_BUSY after dfu_download\n");
-	}
-	
-	if (0 > dfu_get_status(device, &status))
+	if (NULL != skipped)
 	{
-		printf("dfu_write_flash: dfu_get_status error 2\n");
+		*skipped = (result == 0) ? (nblocks - written) : 0;
 	}
 	
-	if (status.bState == STATE_DFU_ERROR)
-	{
-		if (status.bStatus == DFU_STATUS_ERROR_TARGET)
-		{
-			printf("dfu_write_flash failed: received address wrong/unsupported\n");
-			return -1;
-		} else if (status.bStatus == DFU_STATUS_ERROR_VENDOR)
-		{
-			printf("dfu_write_flash failed: flash read protection enabled\n");
-			return -2;
-		} else
-		{
-			printf("dfu_write_flash failed: reason unknown\n");
-			return -3;
-		}
-	}
+	dfu_transfer_free(staged[0]);
+	dfu_transfer_free(staged[1]);
+	dfu_transfer_free(getstatus);
 	
-	return 0;
+	return result;
+}
+
+/*
+	dfu_write_flash() writes (in blocks of the device's wTransferSize)
+	the contents of membuf to flash memory. The write begins at the
+	location pointed to by the address pointer (use
+	dfu_set_address_pointer()).
+*/
+int32_t dfu_write_flash(dfu_device * device, uint8_t * membuf, uint32_t length)
+{
+	return dfu_write_blocks(device, membuf, length, 0, NULL, NULL, NULL);
+}
+
+/*
+	dfu_write_flash_sparse() is dfu_write_flash() for flash that's
+	already erased: blocks that are all 0xff aren't downloaded at all.
+	If skipped isn't NULL, it's set to the number of blocks left out.
+*/
+int32_t dfu_write_flash_sparse(dfu_device * device, uint8_t * membuf, uint32_t length, uint32_t * skipped)
+{
+	return dfu_write_blocks(device, membuf, length, 1, skipped, NULL, NULL);
+}
+
+/*
+	dfu_write_flash_stream() is dfu_write_flash() with each block asked
+	of fill as it's staged, instead of copied out of one buffer.
+*/
+int32_t dfu_write_flash_stream(dfu_device * device, uint32_t length, dfu_fill_cb fill, void * user_data)
+{
+	return dfu_write_blocks(device, NULL, length, 0, NULL, fill, user_data);
 }
 
 /*
@@ -291,21 +727,30 @@ int32_t dfu_set_address_pointer(dfu_device * device, int32_t address)
 	
 	int8_t * addr = &address;
 	
+	if (0 != dfu_check_range(device, address, 1, 0))
+		return -1;
+	
 	for (i=0; i<4; i++)
 	{
 		command[i+1] = addr[i];
 	}
 	
+	device->poll.op = DFU_OP_SET_ADDRESS;
+	
 	rv = dfu_download(device, 0, command, 5);
 	
+	//a failed transfer leaves status meaningless, and the device's
+	//address pointer wherever it was
 	if (5 != rv)
 	{
 		printf("dfu_set_address_pointer: dfu_download error <%d>\n", rv);
+		return -2;
 	}
 	
 	if (0 > dfu_get_status(device, &status))
 	{
 		printf("dfu_set_address_pointer: dfu_get_status error\n");
+		return -2;
 	}
 	
 	if (status.bState != STATE_DFU_DOWNLOAD_BUSY)
@@ -313,14 +758,16 @@ int32_t dfu_set_address_pointer(dfu_device * device, int32_t address)
 		printf("dfu_set_address_pointer: wrong state after submitting address\n");
 	}
 	
-	if (0 > dfu_get_status(device, &status))
+	if (0 > dfu_wait_busy(device, &status))
 	{
 		printf("dfu_set_address_pointer: dfu_get_status error 2\n");
+		return -2;
 	}
 	
 	if ((status.bState != STATE_DFU_ERROR) && (status.bStatus != DFU_STATUS_ERROR_TARGET))
 	{
 		//success
+		device->address = address;
 		return 0;
 	} else
 	{
@@ -330,8 +777,8 @@ int32_t dfu_set_address_pointer(dfu_device * device, int32_t address)
 }
 
 /*
-	dfu_erase() erases a single page (2kB) of flash memory. The page that
-	address belongs to is the page that is erased.
+	dfu_erase() erases a single page (sector) of flash memory. The page
+	that address belongs to is the page that is erased.
 */
 int32_t dfu_erase(dfu_device * device, int32_t address)
 {
@@ -341,19 +788,34 @@ int32_t dfu_erase(dfu_device * device, int32_t address)
 	
 	int8_t * addr = &address;
 	
+	if (0 != dfu_check_range(device, address, 1, DFU_SECTOR_ERASABLE))
+		return -1;
+	
 	for (i=0; i<4; i++)
 	{
 		command[i+1] = addr[i];
 	}
 	
+	device->poll.op = DFU_OP_ERASE;
+	
+	//a failed transfer says nothing about the flash, so it mustn't
+	//fall through to the status check and pass as erased
 	if (5 != dfu_download(device, 0, command, 5))
 	{
 		printf("dfu_erase: dfu_download error\n");
+		return -4;
 	}
 	
 	if (0 > dfu_get_status(device, &status))
 	{
 		printf("dfu_erase: dfu_get_status error\n");
+		return -4;
+	}
+	
+	if ((status.bState == STATE_DFU_DOWNLOAD_BUSY) && (0 > dfu_wait_busy(device, &status)))
+	{
+		printf("dfu_erase: dfu_get_status error 2\n");
+		return -4;
 	}
 	
 	if (status.bState == STATE_DFU_ERROR)
@@ -388,17 +850,64 @@ int32_t dfu_mass_erase(dfu_device * device)
 	int8_t command[1] = {0x41};
 	dfu_status status;
 	
+	device->poll.op = DFU_OP_MASS_ERASE;
+	
 	if (1 != dfu_download(device, 0, command, 1))
 	{
 		printf("dfu_erase_mass: dfu_download error\n");
+		return -2;
 	}
 	
 	if (0 > dfu_get_status(device, &status))
 	{
 		printf("dfu_erase_mass: dfu_get_status error\n");
+		return -2;
+	}
+	
+	if ((status.bState == STATE_DFU_DOWNLOAD_BUSY) && (0 > dfu_wait_busy(device, &status)))
+	{
+		printf("dfu_erase_mass: dfu_get_status error 2\n");
+		return -2;
+	}
+	
+	if (status.bState == STATE_DFU_ERROR)
+	{
+		printf("dfu_erase_mass failed: <%s>\n", dfu_status_to_string(status.bStatus));
+		return -1;
 	}
+	
+	return 0;
 }
 	
+/*
+	dfu_leave_dfu_mode() points the address pointer at the application,
+	then sends a zero length download. The bootloader jumps to the
+	address on the GETSTATUS that follows, so that GETSTATUS may well
+	fail as the device drops off the bus.
+*/
+int32_t dfu_leave_dfu_mode(dfu_device * device, int32_t address)
+{
+	dfu_status status;
+	int32_t rv;
+	
+	if (0 != dfu_set_address_pointer(device, address))
+	{
+		printf("dfu_leave_dfu_mode: can't jump to 0x%.8x\n", address);
+		return -1;
+	}
+	
+	rv = dfu_download(device, 0, NULL, 0);
+	if (0 != rv)
+	{
+		printf("dfu_leave_dfu_mode: dfu_download error <%d>\n", rv);
+		return -1;
+	}
+	
+	dfu_get_status(device, &status);
+	
+	return 0;
+}
+
 /*
 *  Gets the device into the dfuIDLE state if possible.
 *
@@ -450,7 +959,7 @@ int32_t dfu_make_idle( dfu_device *device, const int initial_abort )
 				
 			case STATE_APP_DETACH:
 			case STATE_DFU_MANIFEST_WAIT_RESET:
-				libusb_reset_device(device->handle);
+				device->transport->reset(device);
 				return 1;
 		}
 		
@@ -16,8 +16,101 @@ protocol used in the STM32 Bootloader, AN3156.
 
 #define OPTION_BYTES_ADDRESS 0x1ffff800
 
+//the erase granularity of the stm32 bootloader's erase command, on
+//parts whose layout string doesn't say otherwise
+#define STM32_PAGE_SIZE 2048
+
+//typical flash timings (ms) used when nothing better has been measured
+#define STM32_PAGE_PROGRAM_MS 54
+#define STM32_MASS_ERASE_MS 40
+
+//a short final block is padded out to this many bytes, the widest
+//programming unit of the stm32 families (a double word)
+#define DFU_WRITE_ALIGN 8
+
+//upload buffers used by dfu_read_flash_stream(): one on the bus, one
+//being consumed
+#define DFU_STREAM_BUFFERS 2
+
+//how many times to poll a device that's still dfuDNBUSY before giving up
+#define DFU_BUSY_RETRIES 64
+
+/*
+dfu_sector is one erasable unit of a device's memory.
+*/
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+	uint8_t attributes;
+} dfu_sector;
+
+/*
+dfu_parse_layout() fills map from a DfuSe layout string (the interface
+string of an alternate setting), e.g.
+"@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg".
+
+returns 0 on success, -1 if the string is malformed (map is left empty)
+*/
+int32_t dfu_parse_layout(dfu_memory_map * map, const char * layout);
+
+/*
+dfu_find_sector() looks up the sector of map that address falls in.
+
+returns 0 on success, -1 if address isn't in map
+*/
+int32_t dfu_find_sector(const dfu_memory_map * map, uint32_t address, dfu_sector * sector);
+
+/*
+dfu_list_sectors() fills sectors with up to max of the sectors of the
+current alternate setting's layout that overlap [start, end), and
+returns how many there are in all. Without a layout, uniform
+STM32_PAGE_SIZE pages are assumed.
+*/
+uint32_t dfu_list_sectors(dfu_device * device, uint32_t start, uint32_t end, dfu_sector * sectors, uint32_t max);
+
+/*
+dfu_flash_size() returns the number of erasable bytes in the current
+alternate setting's layout, or 0 if the layout isn't known.
+*/
+uint32_t dfu_flash_size(dfu_device * device);
+
+/*
+dfu_check_range() checks, before anything goes over usb, that length
+bytes from address lie in sectors with all the given attributes, in
+any of the device's layouts. A device with no known layout passes.
+
+returns 0 if the range is ok, -1 otherwise
+*/
+int32_t dfu_check_range(dfu_device * device, uint32_t address, uint32_t length, uint8_t attributes);
+
+/*
+dfu_set_alternate() selects alternate setting alt of the DFU interface,
+which decides which memory (and layout) later commands work on.
+
+returns 0 on success, < 0 on error
+*/
+int32_t dfu_set_alternate(dfu_device * device, int32_t alt);
+
+/*
+dfu_stream_cb is handed each block of a streamed read: length bytes of
+data, found offset bytes from where the read started. Returning non-zero
+stops the read.
+*/
+typedef int (*dfu_stream_cb)(const uint8_t * data, uint32_t length, uint32_t offset, void * user_data);
+
+/*
+dfu_read_flash_stream() reads length bytes from flash memory, passing
+them to callback a block at a time. The upload of the next block is
+already on the bus while callback runs, and memory use is bounded by
+DFU_STREAM_BUFFERS blocks whatever the length.
+
+returns 0 on success, -1 if read protection is enabled, < 0 otherwise
+*/
+int32_t dfu_read_flash_stream(dfu_device * device, uint32_t length, dfu_stream_cb callback, void * user_data);
+
 /*
 dfu_read_flash() fills membuf with length bytes from flash memory.
+Reads are made in blocks of the device's wTransferSize.
 */
 int32_t dfu_read_flash(dfu_device * device, uint8_t * membuf, uint32_t length);
 
@@ -38,34 +131,71 @@ erase (0x41), read unprotect (0x92))
 int32_t dfu_get(dfu_device * device, uint8_t * data);
 
 /*
-dfu_write_flash() writes (in 2kB pages) the contents of membuf
-to flash memory. The write begins at the location pointed to by
-the address pointer (use dfu_set_address_pointer()).
+dfu_write_flash() writes (in blocks of the device's wTransferSize)
+the contents of membuf to flash memory. The write begins at the
+location pointed to by the address pointer (use
+dfu_set_address_pointer()). The next block is staged while the
+previous block's GETSTATUS is in flight. Returns 0 once every block
+has been programmed, < 0 as soon as one isn't (-9 if a DNLOAD or
+GETSTATUS transfer itself failed).
 */
 int32_t dfu_write_flash(dfu_device * device, uint8_t * membuf, uint32_t length);
 
+/*
+dfu_write_flash_sparse() is dfu_write_flash() for flash that's already
+erased: blocks that are all 0xff aren't downloaded at all. If skipped
+isn't NULL, it's set to the number of blocks left out.
+*/
+int32_t dfu_write_flash_sparse(dfu_device * device, uint8_t * membuf, uint32_t length, uint32_t * skipped);
+
+/*
+dfu_fill_cb is asked for each block of a streamed write: length bytes
+for data, the ones offset bytes from where the write started. Blocks
+are asked for in order. Returning non-zero stops the write.
+*/
+typedef int (*dfu_fill_cb)(uint8_t * data, uint32_t length, uint32_t offset, void * user_data);
+
+/*
+dfu_write_flash_stream() is dfu_write_flash() for data that isn't all in
+memory: fill writes each block straight into its download buffer as it's
+staged, so memory use is two blocks whatever the length.
+*/
+int32_t dfu_write_flash_stream(dfu_device * device, uint32_t length, dfu_fill_cb fill, void * user_data);
+
 /*
 dfu_set_address_pointer() sets the STM32 device's address pointer.
 This is necessary before performing some other DFU commands, such as
 dfu_write_flash. The address being written to is determined relative
-to where the address pointer points.
+to where the address pointer points. Returns 0 on success, -1 if the
+device refused the address, -2 if a transfer failed. The pointer is
+only taken as moved on success.
 */
 int32_t dfu_set_address_pointer(dfu_device * device, int32_t address);
 
 /*
-dfu_erase() erases a single page (2kB) of flash memory. The page that
-address belongs to is the page that is erased.
+dfu_erase() erases a single page (sector) of flash memory. The page
+that address belongs to is the page that is erased. Returns 0 on
+success, -1 to -3 if the device refused the erase, -4 if a transfer
+failed.
 */
 int32_t dfu_erase(dfu_device * device, int32_t address);
 
 /*
-dfu_mass_erase() erases all pages of flash memory
+dfu_mass_erase() erases all pages of flash memory. Returns 0 on
+success, -1 if the device refused the erase, -2 if a transfer failed.
 */
 int32_t dfu_mass_erase(dfu_device * device);
 
+/*
+dfu_leave_dfu_mode() makes the bootloader jump to the application at
+address. The device drops off the bus once it has.
+
+returns 0 on success, < 0 if the bootloader refused
+*/
+int32_t dfu_leave_dfu_mode(dfu_device * device, int32_t address);
+
 /* unimplemented :
 int32_t dfu_read_unprotect(dfu_device * device);
-int32_t dfu_leave_dfu_mode(dfu_device * device);
 */
 
 /*
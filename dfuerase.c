@@ -0,0 +1,243 @@
+/*
+dfuerase.{c,h} :
+Plans how to erase the flash an image is about to be written to. The STM32
+bootloader can erase one page at a time or the whole part at once; which is
+cheaper depends on how many pages need erasing and on how long each kind of
+erase takes on the device family at hand. Those latencies are measured every
+time an erase runs and cached per device family, so plans get better with use.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "dfurequests.h"
+#include "dfucommands.h"
+#include "dfuerase.h"
+
+//--all runs workers for the same family at once, they share one cache file
+static pthread_mutex_t dfu_erase_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	dfu_erase_now_ms() returns a monotonic timestamp in milliseconds.
+*/
+static double dfu_erase_now_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000. + now.tv_nsec / 1e6;
+}
+
+/*
+	dfu_cache_path() builds the path of a file in stmdfu's cache
+	directory, creating the directory if needed.
+*/
+int32_t dfu_cache_path(char * path, int32_t size, const char * name)
+{
+	char dir[256];
+	char * base = getenv("XDG_CACHE_HOME");
+
+	if ((NULL != base) && (0 != *base))
+	{
+		mkdir(base, 0755);
+		snprintf(dir, sizeof(dir), "%s/stmdfu", base);
+	} else
+	{
+		base = getenv("HOME");
+		if (NULL == base)
+			return -1;
+
+		snprintf(dir, sizeof(dir), "%s/.cache", base);
+		mkdir(dir, 0755);
+		snprintf(dir, sizeof(dir), "%s/.cache/stmdfu", base);
+	}
+
+	if ((0 != mkdir(dir, 0755)) && (errno != EEXIST))
+		return -1;
+
+	if (size <= snprintf(path, size, "%s/%s", dir, name))
+		return -1;
+
+	return 0;
+}
+
+/*
+	dfu_erase_model_load() fills model with the cached latencies for
+	family, or with the defaults if the family hasn't been measured yet.
+*/
+void dfu_erase_model_load(dfu_erase_model * model, const char * family)
+{
+	char path[512];
+	char name[64];
+	FILE * cache;
+
+	memset(model, 0, sizeof(dfu_erase_model));
+	strncpy(model->family, family, sizeof(model->family) - 1);
+	model->page_ms = DFU_ERASE_DEFAULT_PAGE_MS;
+	model->mass_ms = DFU_ERASE_DEFAULT_MASS_MS;
+
+	snprintf(name, sizeof(name), "erase-%s", model->family);
+	if (0 != dfu_cache_path(path, sizeof(path), name))
+		return;
+
+	pthread_mutex_lock(&dfu_erase_cache_lock);
+
+	cache = fopen(path, "r");
+	if (NULL != cache)
+	{
+		if (4 != fscanf(cache, "%lf %lf %u %u", &model->page_ms, &model->mass_ms,
+						&model->page_samples, &model->mass_samples))
+		{
+			model->page_ms = DFU_ERASE_DEFAULT_PAGE_MS;
+			model->mass_ms = DFU_ERASE_DEFAULT_MASS_MS;
+			model->page_samples = 0;
+			model->mass_samples = 0;
+		}
+
+		fclose(cache);
+	}
+
+	pthread_mutex_unlock(&dfu_erase_cache_lock);
+}
+
+/*
+	dfu_erase_model_save() writes model back to the cache.
+*/
+void dfu_erase_model_save(dfu_erase_model * model)
+{
+	char path[512];
+	char name[64];
+	FILE * cache;
+
+	snprintf(name, sizeof(name), "erase-%s", model->family);
+	if (0 != dfu_cache_path(path, sizeof(path), name))
+		return;
+
+	pthread_mutex_lock(&dfu_erase_cache_lock);
+
+	cache = fopen(path, "w");
+	if (NULL != cache)
+	{
+		fprintf(cache, "%f %f %u %u\n", model->page_ms, model->mass_ms,
+				model->page_samples, model->mass_samples);
+
+		fclose(cache);
+	}
+
+	pthread_mutex_unlock(&dfu_erase_cache_lock);
+}
+
+/*
+	dfu_erase_learn() folds a measurement into a cached latency. The
+	first measurement replaces the default outright.
+*/
+static void dfu_erase_learn(double * latency, uint32_t * samples, double measured)
+{
+	if (0 == *samples)
+		*latency = measured;
+	else
+		*latency += DFU_ERASE_MODEL_WEIGHT * (measured - *latency);
+
+	(*samples)++;
+}
+
+/*
+	dfu_erase_plan_make() picks the cheapest way to erase the sectors
+	flagged in need[]. The default latencies make a mass erase look
+	cheaper than two pages, so the estimates only get a say once the
+	image is close to filling the flash.
+*/
+dfu_erase_plan dfu_erase_plan_make(dfu_erase_model * model, const dfu_sector * sectors, uint32_t nsectors,
+									const uint8_t * need, int allow_mass, uint32_t flash_size)
+{
+	dfu_erase_plan plan;
+	double pages;
+	uint32_t i;
+
+	plan.nsectors = 0;
+	plan.bytes = 0;
+	plan.actual_ms = 0;
+
+	for (i=0; i<nsectors; i++)
+	{
+		if (need[i])
+		{
+			plan.nsectors++;
+			plan.bytes += sectors[i].size;
+		}
+	}
+	pages = (double)plan.bytes / STM32_PAGE_SIZE;
+
+	if (0 == plan.nsectors)
+	{
+		plan.method = DFU_ERASE_NONE;
+		plan.estimate_ms = 0;
+	} else if (allow_mass && (flash_size > 0) &&
+			   (plan.bytes >= DFU_ERASE_MASS_COVERAGE * flash_size) &&
+			   (model->mass_ms < pages * model->page_ms))
+	{
+		plan.method = DFU_ERASE_MASS;
+		plan.estimate_ms = model->mass_ms;
+	} else
+	{
+		plan.method = DFU_ERASE_PAGES;
+		plan.estimate_ms = pages * model->page_ms;
+	}
+
+	return plan;
+}
+
+/*
+	dfu_erase_plan_run() carries out plan, measuring how long it takes.
+*/
+int32_t dfu_erase_plan_run(dfu_device * device, dfu_erase_model * model, dfu_erase_plan * plan,
+							const dfu_sector * sectors, uint32_t nsectors, const uint8_t * need)
+{
+	uint32_t i;
+	uint32_t erased = 0;
+	int32_t rv = 0;
+	double t0 = dfu_erase_now_ms();
+
+	if (plan->method == DFU_ERASE_MASS)
+	{
+		rv = dfu_mass_erase(device);
+		plan->actual_ms = dfu_erase_now_ms() - t0;
+		
+		if (0 == rv)
+			dfu_erase_learn(&model->mass_ms, &model->mass_samples, plan->actual_ms);
+	} else if (plan->method == DFU_ERASE_PAGES)
+	{
+		for (i=0; (i<nsectors) && (0 == rv); i++)
+		{
+			if (need[i])
+			{
+				rv = dfu_erase(device, sectors[i].address);
+				erased += sectors[i].size;
+			}
+		}
+		plan->actual_ms = dfu_erase_now_ms() - t0;
+		
+		if ((0 == rv) && erased)
+			dfu_erase_learn(&model->page_ms, &model->page_samples,
+							plan->actual_ms * STM32_PAGE_SIZE / erased);
+	}
+
+	return rv;
+}
+
+/*
+	dfu_erase_plan_print() prints a plan's estimated and actual erase time.
+*/
+void dfu_erase_plan_print(dfu_erase_plan * plan)
+{
+	static const char * methods[] = {"none", "sector erase", "mass erase"};
+
+	printf("erase plan: %s for %u sectors (%u KB), estimated %.0f ms, actual %.0f ms\n",
+			methods[plan->method], plan->nsectors, plan->bytes / 1024, plan->estimate_ms, plan->actual_ms);
+}
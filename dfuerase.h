@@ -0,0 +1,87 @@
+/*
+dfuerase.{c,h} :
+Plans how to erase the flash an image is about to be written to. The STM32
+bootloader can erase one page at a time or the whole part at once; which is
+cheaper depends on how many pages need erasing and on how long each kind of
+erase takes on the device family at hand. Those latencies are measured every
+time an erase runs and cached per device family, so plans get better with use.
+*/
+
+#ifndef __DFU_ERASE__
+#define __DFU_ERASE__
+
+//typical STM32F1 figures (ms), used until a family has been measured.
+//sector erase time is modelled per STM32_PAGE_SIZE erased, so one model
+//covers 2K pages and 16K-128K sectors alike
+#define DFU_ERASE_DEFAULT_PAGE_MS 25
+#define DFU_ERASE_DEFAULT_MASS_MS 40
+
+//a mass erase is only considered when the sectors that need erasing
+//cover at least this much of the flash, it takes everything else with it
+#define DFU_ERASE_MASS_COVERAGE 0.9
+
+//weight of a new measurement in the cached model
+#define DFU_ERASE_MODEL_WEIGHT 0.25
+
+#define DFU_ERASE_NONE 0
+#define DFU_ERASE_PAGES 1
+#define DFU_ERASE_MASS 2
+
+typedef struct {
+	char family[32];
+	double page_ms;
+	double mass_ms;
+	uint32_t page_samples;
+	uint32_t mass_samples;
+} dfu_erase_model;
+
+typedef struct {
+	int method;
+	uint32_t nsectors;
+	uint32_t bytes;
+	double estimate_ms;
+	double actual_ms;
+} dfu_erase_plan;
+
+/*
+dfu_cache_path() builds the path of a file in stmdfu's cache directory
+($XDG_CACHE_HOME/stmdfu or ~/.cache/stmdfu), creating the directory if
+needed. Returns 0 on success.
+*/
+int32_t dfu_cache_path(char * path, int32_t size, const char * name);
+
+/*
+dfu_erase_model_load() fills model with the cached latencies for family,
+or with the defaults above if the family hasn't been measured yet.
+*/
+void dfu_erase_model_load(dfu_erase_model * model, const char * family);
+
+/*
+dfu_erase_model_save() writes model back to the cache.
+*/
+void dfu_erase_model_save(dfu_erase_model * model);
+
+/*
+dfu_erase_plan_make() picks the cheapest way to erase the sectors flagged
+in need[]: nothing, a sequence of sector erases or (if allow_mass is set,
+i.e. it's ok to lose the rest of flash) a mass erase. A mass erase is
+only ever picked when the sectors cover DFU_ERASE_MASS_COVERAGE of the
+flash_size bytes of flash, whatever the estimates say; with flash_size 0
+(layout unknown) it never is.
+*/
+dfu_erase_plan dfu_erase_plan_make(dfu_erase_model * model, const dfu_sector * sectors, uint32_t nsectors,
+									const uint8_t * need, int allow_mass, uint32_t flash_size);
+
+/*
+dfu_erase_plan_run() carries out plan over the sectors flagged in need[].
+The time taken is stored in plan->actual_ms and folded into model.
+Returns 0 on success.
+*/
+int32_t dfu_erase_plan_run(dfu_device * device, dfu_erase_model * model, dfu_erase_plan * plan,
+							const dfu_sector * sectors, uint32_t nsectors, const uint8_t * need);
+
+/*
+dfu_erase_plan_print() prints a plan's estimated and actual erase time.
+*/
+void dfu_erase_plan_print(dfu_erase_plan * plan);
+#endif
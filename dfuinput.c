@@ -0,0 +1,785 @@
+/*
+dfuinput.{c,h} :
+Reads the firmware images bintodfu takes in, and turns each one into the
+segments of memory it fills: an address and the bytes that go there. A flat
+.bin is one segment at the address it's given. An ELF file is one segment per
+loadable segment with file contents, at its physical (load) address, with
+segments that follow on from each other merged, so nothing between them has
+to be padded out. Intel HEX and Motorola S-record files are decoded in one pass
+over the text, records that follow on from each other going into the same run,
+and each run becoming a segment.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/types.h>
+
+#include "dfuse.h"
+#include "dfulz.h"
+#include "dfuinput.h"
+
+/*
+dfuinput_hex[] maps an ascii hex digit to its value with 0x10 set, and
+anything else to 0, so a whole record's digits can be checked at once by
+AND-ing their entries together and testing 0x10 at the end.
+*/
+static const uint8_t dfuinput_hex[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+	['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+	['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+};
+
+/*
+dfuinput_run is the contiguous data the hex records have built up so
+far, waiting for a record that doesn't follow on from it.
+*/
+typedef struct {
+	uint8_t * data;
+	uint32_t address;
+	uint32_t size;
+	uint32_t capacity;
+} dfuinput_run;
+
+/*
+	dfuinput_named() is whether name ends in suffix, in any case.
+*/
+static int dfuinput_named(const char * name, const char * suffix)
+{
+	size_t n = strlen(name);
+	size_t m = strlen(suffix);
+
+	return (n >= m) && !strcasecmp(&name[n - m], suffix);
+}
+
+/*
+	dfuinput_load() takes an @address or a .bin name at its word, since
+	a flat binary can start with anything, ':' and "S1" included. Any
+	other file has its format worked out from its contents rather than
+	its name, so an ELF without a .elf on the end still gets its own
+	addresses. A text format that's only guessed at falls back to a
+	binary if its first line doesn't parse; one named .hex or .srec is
+	malformed instead.
+*/
+dfuinput_image * dfuinput_load(int binfile, const char * name, uint32_t address, int hasaddress)
+{
+	dfuinput_image * image = (dfuinput_image *)calloc(1, sizeof(dfuinput_image));
+	int rv = 0;
+
+	image->file = dfuse_mapbin(binfile, &image->filesize, &image->mapped);
+	if (NULL == image->file)
+	{
+		printf("Could not read %s\n", name);
+		free(image);
+		return NULL;
+	}
+
+	image->format = DFUINPUT_FORMAT_BIN;
+	if (!hasaddress && !dfuinput_named(name, ".bin"))
+	{
+		if ((image->filesize >= SELFMAG) && !memcmp(image->file, ELFMAG, SELFMAG))
+		{
+			image->format = DFUINPUT_FORMAT_ELF;
+			rv = dfuinput_loadelf(image, name);
+		}
+		else if ((image->filesize > 0) && (image->file[0] == ':'))
+		{
+			image->format = DFUINPUT_FORMAT_IHEX;
+			rv = dfuinput_loadihex(image, name);
+			if ((rv == -2) && dfuinput_named(name, ".hex"))
+				printf("%s: bad record on line 1, not an Intel HEX file\n", name);
+		}
+		else if ((image->filesize > 1) && (image->file[0] == 'S') &&
+			(image->file[1] >= '0') && (image->file[1] <= '9'))
+		{
+			image->format = DFUINPUT_FORMAT_SREC;
+			rv = dfuinput_loadsrec(image, name);
+			if ((rv == -2) && dfuinput_named(name, ".srec"))
+				printf("%s: bad record on line 1, not an S-record file\n", name);
+		}
+
+		if ((rv == -2) && !dfuinput_named(name, ".hex") && !dfuinput_named(name, ".srec"))
+		{
+			image->format = DFUINPUT_FORMAT_BIN;
+			rv = 0;
+		}
+
+		if (0 != rv)
+		{
+			dfuinput_free(image);
+			return NULL;
+		}
+	}
+
+	if (image->format == DFUINPUT_FORMAT_BIN)
+		dfuinput_addsegment(image, address, image->file, image->filesize);
+
+	if (0 != dfuinput_merge(image, name))
+	{
+		dfuinput_free(image);
+		return NULL;
+	}
+
+	return image;
+}
+
+/*
+	dfuinput_loadelf() reads the program headers, 32 or 64 bit, and
+	takes every PT_LOAD segment with file contents at its p_paddr,
+	which is where it lives in flash (p_vaddr is where it runs, so
+	differs for .data). The p_memsz past p_filesz is .bss, zeroed at
+	startup, so isn't written. Every offset is checked against the
+	file before it's used.
+*/
+int dfuinput_loadelf(dfuinput_image * image, const char * name)
+{
+	uint8_t * file = image->file;
+	uint64_t phoff, offset, filesz, paddr;
+	uint32_t phentsize, phnum, type;
+	int elf64, i;
+	Elf32_Ehdr ehdr32;
+	Elf64_Ehdr ehdr64;
+	Elf32_Phdr phdr32;
+	Elf64_Phdr phdr64;
+
+	if ((image->filesize < EI_NIDENT) || (file[EI_DATA] != ELFDATA2LSB))
+	{
+		printf("%s: only little endian ELF files are supported\n", name);
+		return -1;
+	}
+
+	elf64 = (file[EI_CLASS] == ELFCLASS64);
+	if (!elf64 && (file[EI_CLASS] != ELFCLASS32))
+	{
+		printf("%s: unknown ELF class %d\n", name, file[EI_CLASS]);
+		return -1;
+	}
+
+	if (elf64)
+	{
+		if (image->filesize < sizeof(ehdr64))
+			goto truncated;
+		memcpy(&ehdr64, file, sizeof(ehdr64));
+		phoff = ehdr64.e_phoff;
+		phentsize = ehdr64.e_phentsize;
+		phnum = ehdr64.e_phnum;
+		if (phentsize < sizeof(phdr64))
+			goto truncated;
+	}
+	else
+	{
+		if (image->filesize < sizeof(ehdr32))
+			goto truncated;
+		memcpy(&ehdr32, file, sizeof(ehdr32));
+		phoff = ehdr32.e_phoff;
+		phentsize = ehdr32.e_phentsize;
+		phnum = ehdr32.e_phnum;
+		if (phentsize < sizeof(phdr32))
+			goto truncated;
+	}
+
+	if (phoff + (uint64_t)phentsize * phnum > image->filesize)
+		goto truncated;
+
+	for (i=0; i<phnum; i++)
+	{
+		//program headers needn't be aligned in the file
+		if (elf64)
+		{
+			memcpy(&phdr64, &file[phoff + (uint64_t)i * phentsize], sizeof(phdr64));
+			type = phdr64.p_type;
+			offset = phdr64.p_offset;
+			filesz = phdr64.p_filesz;
+			paddr = phdr64.p_paddr;
+		}
+		else
+		{
+			memcpy(&phdr32, &file[phoff + (uint64_t)i * phentsize], sizeof(phdr32));
+			type = phdr32.p_type;
+			offset = phdr32.p_offset;
+			filesz = phdr32.p_filesz;
+			paddr = phdr32.p_paddr;
+		}
+
+		if ((type != PT_LOAD) || (filesz == 0))
+			continue;
+
+		if ((offset + filesz > image->filesize) || (paddr + filesz > 0x100000000ULL))
+		{
+			printf("%s: program header %d is out of bounds\n", name, i);
+			return -1;
+		}
+
+		dfuinput_addsegment(image, paddr, &file[offset], filesz);
+	}
+
+	if (image->nsegments == 0)
+	{
+		printf("%s: no loadable segments\n", name);
+		return -1;
+	}
+
+	return 0;
+
+truncated:
+	printf("%s: truncated ELF file\n", name);
+	return -1;
+}
+
+/*
+	dfuinput_decode() turns the 2*n hex digits at text into n bytes.
+	Returns 0 if any of them wasn't a hex digit.
+*/
+static int dfuinput_decode(const uint8_t * text, uint8_t * bytes, uint32_t n)
+{
+	uint8_t valid = 0x10;
+	uint8_t hi, lo;
+	uint32_t i;
+
+	for (i=0; i<n; i++)
+	{
+		hi = dfuinput_hex[text[2*i]];
+		lo = dfuinput_hex[text[2*i+1]];
+		valid &= hi & lo;
+		bytes[i] = (hi << 4) | (lo & 0x0f);
+	}
+
+	return valid;
+}
+
+/*
+	dfuinput_finishrun() hands a run over to the image as a segment.
+*/
+static void dfuinput_finishrun(dfuinput_image * image, dfuinput_run * run)
+{
+	if (NULL == run->data)
+		return;
+
+	image->buffers = (uint8_t **)realloc(image->buffers, sizeof(uint8_t *) * (image->nbuffers+1));
+	image->buffers[image->nbuffers++] = run->data;
+	dfuinput_addsegment(image, run->address, run->data, run->size);
+
+	run->data = NULL;
+	run->size = 0;
+	run->capacity = 0;
+}
+
+/*
+	dfuinput_append() adds a record's data to the run if it follows on
+	from it, or starts a new run if it doesn't. The run's buffer
+	doubles when it fills, so a big image is a handful of reallocs
+	rather than one per record.
+*/
+static void dfuinput_append(dfuinput_image * image, dfuinput_run * run, uint32_t address, const uint8_t * data, uint32_t n)
+{
+	if ((NULL != run->data) && (address != run->address + run->size))
+		dfuinput_finishrun(image, run);
+
+	if (NULL == run->data)
+	{
+		run->capacity = DFUINPUT_RUN_CHUNK;
+		run->data = (uint8_t *)malloc(run->capacity);
+		run->address = address;
+	}
+
+	while (run->size + n > run->capacity)
+	{
+		run->capacity *= 2;
+		run->data = (uint8_t *)realloc(run->data, run->capacity);
+	}
+
+	memcpy(&run->data[run->size], data, n);
+	run->size += n;
+}
+
+/*
+	dfuinput_nextline() skips the line endings (and any blank lines)
+	after a record, and returns the offset of the next one.
+*/
+static uint32_t dfuinput_nextline(const uint8_t * text, uint32_t offset, uint32_t length)
+{
+	while ((offset < length) && ((text[offset] == '\r') || (text[offset] == '\n') ||
+		(text[offset] == ' ') || (text[offset] == '\t')))
+	{
+		offset++;
+	}
+
+	return offset;
+}
+
+/*
+	dfuinput_loadihex() handles data (00), end of file (01), extended
+	segment (02) and extended linear (04) address records. Start
+	address records (03, 05) only matter to a debugger, and are
+	skipped. The record is decoded whole, then its bytes, checksum
+	included, must sum to 0.
+*/
+int dfuinput_loadihex(dfuinput_image * image, const char * name)
+{
+	const uint8_t * text = image->file;
+	uint32_t length = image->filesize;
+	uint32_t offset = 0;
+	uint32_t base = 0;
+	uint32_t line = 1;
+	uint32_t n, i;
+	uint8_t record[5 + 255];
+	uint8_t sum;
+	dfuinput_run run = {NULL, 0, 0, 0};
+
+	while ((offset = dfuinput_nextline(text, offset, length)) < length)
+	{
+		//:LLAAAATT, the data, then CC
+		if ((text[offset] != ':') || (offset + 11 > length) ||
+			!dfuinput_decode(&text[offset+1], record, 1) ||
+			(offset + 11 + 2*record[0] > length) ||
+			!dfuinput_decode(&text[offset+1], record, 5 + record[0]))
+		{
+			dfuinput_finishrun(image, &run);
+			if (line == 1)
+				return -2;
+			printf("%s: bad record on line %u\n", name, line);
+			return -1;
+		}
+
+		n = record[0];
+		for (i=0, sum=0; i<5+n; i++)
+			sum += record[i];
+		if (sum != 0)
+		{
+			dfuinput_finishrun(image, &run);
+			if (line == 1)
+				return -2;
+			printf("%s: checksum error on line %u\n", name, line);
+			return -1;
+		}
+
+		switch (record[3])
+		{
+			case 0x00:
+				dfuinput_append(image, &run, base + ((record[1] << 8) | record[2]), &record[4], n);
+				break;
+
+			case 0x02:
+				base = ((record[4] << 8) | record[5]) << 4;
+				break;
+
+			case 0x04:
+				base = ((record[4] << 8) | record[5]) << 16;
+				break;
+		}
+
+		offset += 11 + 2*n;
+		line++;
+
+		if (record[3] == 0x01)
+			break;
+	}
+
+	dfuinput_finishrun(image, &run);
+
+	return 0;
+}
+
+/*
+	dfuinput_loadsrec() handles S1, S2 and S3 data records, with 2, 3
+	and 4 byte addresses. The header (S0), record count (S5, S6) and
+	start address (S7, S8, S9) records are checked and skipped. The
+	count covers the address, data and checksum, and the bytes it
+	covers sum to 0xff with the count.
+*/
+int dfuinput_loadsrec(dfuinput_image * image, const char * name)
+{
+	static const uint8_t addrlen[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+	const uint8_t * text = image->file;
+	uint32_t length = image->filesize;
+	uint32_t offset = 0;
+	uint32_t line = 1;
+	uint32_t address;
+	uint32_t n, i;
+	uint8_t record[1 + 255];
+	uint8_t sum;
+	int type;
+	dfuinput_run run = {NULL, 0, 0, 0};
+
+	while ((offset = dfuinput_nextline(text, offset, length)) < length)
+	{
+		//Stnn, then nn bytes of address, data and checksum
+		if ((offset + 4 > length) || (text[offset] != 'S') ||
+			(text[offset+1] < '0') || (text[offset+1] > '9') || (text[offset+1] == '4') ||
+			!dfuinput_decode(&text[offset+2], record, 1) ||
+			(offset + 4 + 2*record[0] > length) ||
+			!dfuinput_decode(&text[offset+2], record, 1 + record[0]))
+		{
+			dfuinput_finishrun(image, &run);
+			if (line == 1)
+				return -2;
+			printf("%s: bad record on line %u\n", name, line);
+			return -1;
+		}
+
+		type = text[offset+1] - '0';
+		n = record[0];
+		for (i=0, sum=0; i<1+n; i++)
+			sum += record[i];
+		if ((sum != 0xff) || (n < addrlen[type] + 1))
+		{
+			dfuinput_finishrun(image, &run);
+			if (line == 1)
+				return -2;
+			printf("%s: checksum error on line %u\n", name, line);
+			return -1;
+		}
+
+		if ((type >= 1) && (type <= 3))
+		{
+			for (i=0, address=0; i<addrlen[type]; i++)
+				address = (address << 8) | record[1+i];
+			dfuinput_append(image, &run, address, &record[1+addrlen[type]], n - addrlen[type] - 1);
+		}
+
+		offset += 4 + 2*n;
+		line++;
+	}
+
+	dfuinput_finishrun(image, &run);
+
+	return 0;
+}
+
+/*
+	dfuinput_dfuse() copies the segments into the dfuse file's arena, so
+	it owns its element data, and can be cleaned up the usual way once
+	the image has gone.
+*/
+dfuse_file * dfuinput_dfuse(dfuinput_image * image)
+{
+	dfuse_file * dfusefile = dfuse_new();
+	uint8_t * data;
+	int i;
+
+	dfuse_addtarget(dfusefile, 0);
+
+	for (i=0; i<image->nsegments; i++)
+	{
+		data = (uint8_t *)dfuse_alloc(dfusefile, image->segments[i].size);
+		if (NULL == data)
+		{
+			printf("out of memory for the segment at 0x%08x\n", image->segments[i].address);
+			dfuse_struct_cleanup(dfusefile);
+			return NULL;
+		}
+		memcpy(data, image->segments[i].data, image->segments[i].size);
+		dfuse_addelement_data(dfusefile, 0, image->segments[i].address, data, image->segments[i].size);
+	}
+
+	return dfusefile;
+}
+
+void dfuinput_addsegment(dfuinput_image * image, uint32_t address, uint8_t * data, uint32_t size)
+{
+	int i = image->nsegments;
+
+	image->segments = (dfuinput_segment *)realloc(image->segments, sizeof(dfuinput_segment) * (i+1));
+	image->segments[i].address = address;
+	image->segments[i].size = size;
+	image->segments[i].data = data;
+	image->nsegments++;
+}
+
+/*
+	dfuinput_compare() orders segments by address, for qsort().
+*/
+static int dfuinput_compare(const void * a, const void * b)
+{
+	const dfuinput_segment * sa = (const dfuinput_segment *)a;
+	const dfuinput_segment * sb = (const dfuinput_segment *)b;
+
+	if (sa->address < sb->address)
+		return -1;
+	return (sa->address > sb->address);
+}
+
+/*
+	dfuinput_merge() leaves a run of segments where it is when their
+	data already follows on in memory (as a linker usually lays them
+	out in the file), and only copies the run into a new buffer when
+	it doesn't.
+*/
+int dfuinput_merge(dfuinput_image * image, const char * name)
+{
+	dfuinput_segment * segments = image->segments;
+	uint8_t * buffer;
+	uint32_t size, end;
+	int inplace;
+	int i, j, k, n = 0;
+
+	qsort(segments, image->nsegments, sizeof(dfuinput_segment), dfuinput_compare);
+
+	for (i=0; i<image->nsegments; i=j)
+	{
+		size = segments[i].size;
+		inplace = 1;
+
+		for (j=i+1; j<image->nsegments; j++)
+		{
+			end = segments[i].address + size;
+			if (segments[j].address < end)
+			{
+				printf("%s: segments at 0x%08x and 0x%08x overlap\n", name,
+						segments[j-1].address, segments[j].address);
+				return -1;
+			}
+			if (segments[j].address != end)
+				break;
+
+			if (segments[j].data != segments[i].data + size)
+				inplace = 0;
+			size += segments[j].size;
+		}
+
+		if (!inplace)
+		{
+			buffer = (uint8_t *)malloc(size);
+			for (k=i, end=0; k<j; end+=segments[k].size, k++)
+				memcpy(&buffer[end], segments[k].data, segments[k].size);
+
+			image->buffers = (uint8_t **)realloc(image->buffers, sizeof(uint8_t *) * (image->nbuffers+1));
+			image->buffers[image->nbuffers++] = buffer;
+			segments[i].data = buffer;
+		}
+
+		segments[n].address = segments[i].address;
+		segments[n].data = segments[i].data;
+		segments[n].size = size;
+		n++;
+	}
+
+	image->nsegments = n;
+
+	return 0;
+}
+
+/*
+	dfuinput_split() walks each segment a page at a time with
+	dfuse_isblank(). Partial pages at either end of a segment are
+	always kept, since the rest of the page might not be blank on the
+	device. A blank run shorter than gap stays in, so a few blank pages
+	don't cost an element header and an address pointer session each.
+*/
+uint32_t dfuinput_split(dfuinput_image * image, uint32_t gap, uint32_t page)
+{
+	dfuinput_segment * old = image->segments;
+	int nold = image->nsegments;
+	uint64_t start, end, block, blank, kept;
+	uint32_t dropped = 0;
+	int inblank;
+	int i;
+
+	if ((0 == gap) || (0 == page))
+		return 0;
+
+	//round gap up to whole pages
+	gap = ((gap + page - 1) / page) * page;
+
+	image->segments = NULL;
+	image->nsegments = 0;
+
+	for (i=0; i<nold; i++)
+	{
+		start = old[i].address;
+		end = start + old[i].size;
+
+		//kept is where the data not yet handed over starts, blank is
+		//where the current run of blank pages starts
+		kept = start;
+		blank = 0;
+		inblank = 0;
+
+		//one past the last whole page is a non-blank page, so a blank
+		//run that goes right up to the end is dropped too
+		for (block=((start + page - 1) / page) * page; block <= end; block+=page)
+		{
+			if ((block + page <= end) && dfuse_isblank(&old[i].data[block - start], page))
+			{
+				if (!inblank)
+					blank = block;
+				inblank = 1;
+				continue;
+			}
+
+			if (inblank && (block - blank >= gap))
+			{
+				if (blank > kept)
+					dfuinput_addsegment(image, kept, &old[i].data[kept - start], blank - kept);
+				dropped += block - blank;
+				kept = block;
+			}
+			inblank = 0;
+
+			if (block + page > end)
+				break;
+		}
+
+		if (end > kept)
+			dfuinput_addsegment(image, kept, &old[i].data[kept - start], end - kept);
+	}
+
+	free(old);
+
+	return dropped;
+}
+
+/*
+	dfuinput_basebytes() returns base's bytes for [lo, hi), or NULL if
+	no one segment of base has them all.
+*/
+static uint8_t * dfuinput_basebytes(dfuinput_image * base, uint64_t lo, uint64_t hi)
+{
+	int i;
+
+	for (i=0; i<base->nsegments; i++)
+	{
+		if ((base->segments[i].address <= lo) &&
+			((uint64_t)base->segments[i].address + base->segments[i].size >= hi))
+		{
+			return &base->segments[i].data[lo - base->segments[i].address];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+	dfuinput_delta_run() keeps the changed pages [lo, hi) of whole as a
+	segment, and folds what the base held there (as far as covered goes)
+	into the base hash.
+*/
+static void dfuinput_delta_run(dfuinput_image * image, dfuinput_segment * whole, const uint8_t * basedata,
+								dfuse_delta * delta, uint64_t lo, uint64_t hi)
+{
+	uint64_t covered = (uint64_t)whole->address + delta->covered;
+
+	dfuinput_addsegment(image, lo, &whole->data[lo - whole->address], hi - lo);
+
+	if (lo < covered)
+	{
+		delta->hash = dfuse_pagehash_update(delta->hash, &basedata[lo - whole->address],
+				((hi < covered) ? hi : covered) - lo);
+	}
+}
+
+/*
+	dfuinput_delta() compares a page at a time, and runs of changed
+	pages become segments pointing into the image. Only the base segment
+	the image starts in counts towards the hash, a changed page past its
+	end isn't checked.
+*/
+int dfuinput_delta(dfuinput_image * image, dfuinput_image * base, uint32_t page, dfuse_delta * delta, const char * name)
+{
+	dfuinput_segment whole;
+	uint8_t * old;
+	const uint8_t * basedata = NULL;
+	uint64_t start, end, block, lo, hi, run;
+	int inrun = 0;
+	int i;
+
+	if (image->nsegments != 1)
+	{
+		printf("%s: a delta needs one contiguous image, this has %d segments\n", name, image->nsegments);
+		return -1;
+	}
+
+	if (0 == page)
+		page = DFUINPUT_PAGE_SIZE;
+
+	whole = image->segments[0];
+	start = whole.address;
+	end = start + whole.size;
+
+	delta->address = whole.address;
+	delta->length = whole.size;
+	delta->page = page;
+	delta->covered = 0;
+	delta->hash = DFUSE_PAGEHASH_INIT;
+
+	for (i=0; i<base->nsegments; i++)
+	{
+		if ((base->segments[i].address <= start) &&
+			((uint64_t)base->segments[i].address + base->segments[i].size > start))
+		{
+			basedata = &base->segments[i].data[start - base->segments[i].address];
+			hi = (uint64_t)base->segments[i].address + base->segments[i].size;
+			delta->covered = ((hi < end) ? hi : end) - start;
+			break;
+		}
+	}
+
+	free(image->segments);
+	image->segments = NULL;
+	image->nsegments = 0;
+
+	run = start;
+	for (block=(start / page) * page; block < end; block+=page)
+	{
+		lo = (block > start) ? block : start;
+		hi = (block + page < end) ? (block + page) : end;
+
+		old = dfuinput_basebytes(base, lo, hi);
+		if ((NULL != old) && !memcmp(old, &whole.data[lo - start], hi - lo))
+		{
+			if (inrun)
+				dfuinput_delta_run(image, &whole, basedata, delta, run, lo);
+			inrun = 0;
+			continue;
+		}
+
+		if (!inrun)
+			run = lo;
+		inrun = 1;
+	}
+
+	if (inrun)
+		dfuinput_delta_run(image, &whole, basedata, delta, run, end);
+
+	return 0;
+}
+
+uint32_t dfuinput_pack(dfuinput_image * image)
+{
+	uint8_t * packed;
+	uint32_t total = 0;
+	int i;
+
+	for (i=0; i<image->nsegments; i++)
+	{
+		packed = dfulz_pack(image->segments[i].data, image->segments[i].size, DFULZ_BLOCK_SIZE,
+				&image->segments[i].size);
+		image->segments[i].data = packed;
+		total += image->segments[i].size;
+
+		image->buffers = (uint8_t **)realloc(image->buffers, sizeof(uint8_t *) * (image->nbuffers+1));
+		image->buffers[image->nbuffers++] = packed;
+	}
+
+	return total;
+}
+
+void dfuinput_free(dfuinput_image * image)
+{
+	int i;
+
+	for (i=0; i<image->nbuffers; i++)
+		free(image->buffers[i]);
+	free(image->buffers);
+	free(image->segments);
+
+	if (NULL != image->file)
+		dfuse_unmapbin(image->file, image->filesize, image->mapped);
+
+	free(image);
+}
@@ -0,0 +1,131 @@
+/*
+dfuinput.{c,h} :
+Reads the firmware images bintodfu takes in, and turns each one into the
+segments of memory it fills: an address and the bytes that go there. A flat
+.bin is one segment at the address it's given. An ELF file is one segment per
+loadable segment with file contents, at its physical (load) address, with
+segments that follow on from each other merged, so nothing between them has
+to be padded out. Intel HEX and Motorola S-record files are decoded in one pass
+over the text, records that follow on from each other going into the same run,
+and each run becoming a segment.
+
+Needs dfuse.h included first.
+*/
+
+#ifndef __DFU_INPUT__
+#define __DFU_INPUT__
+
+//what dfuinput_load() found a file to be
+#define DFUINPUT_FORMAT_BIN 0
+#define DFUINPUT_FORMAT_ELF 1
+#define DFUINPUT_FORMAT_IHEX 2
+#define DFUINPUT_FORMAT_SREC 3
+
+//first buffer size for a run of hex records, it doubles as it fills
+#define DFUINPUT_RUN_CHUNK (64 * 1024)
+
+//flash page size gaps are aligned to, unless told otherwise
+#define DFUINPUT_PAGE_SIZE 2048
+
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+	uint8_t * data;
+} dfuinput_segment;
+
+/*
+dfuinput_image is one input file, its segments, and whatever memory they
+point into, which stays put until dfuinput_free().
+*/
+typedef struct {
+	uint8_t * file;
+	uint32_t filesize;
+	int mapped;
+	int format;
+
+	dfuinput_segment * segments;
+	int nsegments;
+
+	//buffers segments were copied into when they had to be joined up
+	uint8_t ** buffers;
+	int nbuffers;
+} dfuinput_image;
+
+/*
+dfuinput_load() reads binfile whole (see dfuse_mapbin()) and splits it
+into segments by its format. hasaddress (an address was given) or a
+name ending .bin makes it a flat binary at address, whatever it looks
+like. Otherwise ELF, Intel HEX and S-record files are recognised by
+their first bytes and carry their own addresses, and anything else is a
+binary at address. name is also used in messages. Returns NULL if the
+file can't be read or is malformed.
+*/
+dfuinput_image * dfuinput_load(int binfile, const char * name, uint32_t address, int hasaddress);
+
+/*
+dfuinput_loadelf() finds the segments of an ELF image that's already in
+memory. Returns 0 on success, < 0 if it's malformed.
+*/
+int dfuinput_loadelf(dfuinput_image * image, const char * name);
+
+/*
+dfuinput_loadihex() and dfuinput_loadsrec() decode the records of an
+Intel HEX or Motorola S-record file that's already in memory, checking
+each record's checksum. Returns 0 on success, -1 at the first bad
+record, or -2, without a message, if that's the first line, so the
+file may not be one at all.
+*/
+int dfuinput_loadihex(dfuinput_image * image, const char * name);
+int dfuinput_loadsrec(dfuinput_image * image, const char * name);
+
+/*
+dfuinput_dfuse() builds a dfuse file with a single target, for
+alternate setting 0, holding a copy of each of the image's segments.
+Returns NULL if they can't be copied.
+*/
+dfuse_file * dfuinput_dfuse(dfuinput_image * image);
+
+/*
+dfuinput_addsegment() appends a segment for size bytes at data, to be
+written at address.
+*/
+void dfuinput_addsegment(dfuinput_image * image, uint32_t address, uint8_t * data, uint32_t size);
+
+/*
+dfuinput_merge() sorts the segments by address and joins those that
+follow on from each other into one. Returns 0 on success, < 0 if two
+segments overlap.
+*/
+int dfuinput_merge(dfuinput_image * image, const char * name);
+
+/*
+dfuinput_split() drops every run of at least gap bytes of 0xff, in whole
+pages of page bytes (aligned to the address, not the start of the
+segment), splitting the segments around them. Nothing is copied. Returns
+the number of bytes dropped.
+*/
+uint32_t dfuinput_split(dfuinput_image * image, uint32_t gap, uint32_t page);
+
+/*
+dfuinput_delta() turns image into a delta against base: only the pages
+(of page bytes, aligned to the address) that differ from base, or that
+base doesn't have, are kept as segments, and delta says what the base
+held in them (see dfuse_delta). image must be a single contiguous
+segment. Returns 0 on success.
+*/
+int dfuinput_delta(dfuinput_image * image, dfuinput_image * base, uint32_t page, dfuse_delta * delta, const char * name);
+
+/*
+dfuinput_pack() replaces each segment's bytes with their packed form
+(see dfulz.h), in blocks of DFULZ_BLOCK_SIZE, for a packed dfuse file.
+Segment sizes are the packed sizes from then on. Returns the total
+packed size.
+*/
+uint32_t dfuinput_pack(dfuinput_image * image);
+
+/*
+dfuinput_free() releases an image and everything its segments point
+into.
+*/
+void dfuinput_free(dfuinput_image * image);
+#endif
@@ -0,0 +1,415 @@
+/*
+dfulz.{c,h} :
+A small LZ codec, and the packed dfuse container built on it. A packed file is
+a dfuse file with DFULZ_SIGNATURE in place of "DfuSe", whose elements hold
+their data packed rather than raw: the flash size, the block size, a table of
+how many bytes each block was stored in, then the blocks. Every block is
+compressed on its own (or stored raw, if that's smaller), so one can be
+decoded without the others, straight into a download buffer, and a packed
+file is flashed without the whole image ever being in memory. Prefix, target
+prefixes, element headers and suffix are as in any dfuse file, and the crc
+covers the file as stored.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "dfuse.h"
+#include "dfulz.h"
+
+/*
+	dfulz_hash() hashes the DFULZ_MIN_MATCH bytes at p.
+*/
+static uint32_t dfulz_hash(const uint8_t * p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return (v * 2654435761U) >> (32 - DFULZ_HASH_BITS);
+}
+
+/*
+	dfulz_putlength() writes the part of a length that didn't fit in
+	its nibble, as bytes of 255 and a remainder.
+*/
+static uint8_t * dfulz_putlength(uint8_t * op, uint32_t length)
+{
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = length;
+
+	return op;
+}
+
+/*
+	dfulz_sequence() writes a sequence of nlit literals from lit and a
+	match of mlen bytes offset back (mlen is 0 for the last, literals
+	only, sequence). Returns where it stopped, or NULL if that would be
+	past end.
+*/
+static uint8_t * dfulz_sequence(uint8_t * op, uint8_t * end, const uint8_t * lit, uint32_t nlit, uint32_t offset, uint32_t mlen)
+{
+	uint8_t * token = op;
+	uint32_t m = mlen ? (mlen - DFULZ_MIN_MATCH) : 0;
+
+	//worst case, checked once up front
+	if ((uint32_t)(end - op) < 1 + nlit / 255 + 1 + nlit + 2 + m / 255 + 1)
+		return NULL;
+
+	*op++ = ((nlit < 15) ? nlit : 15) << 4;
+	if (nlit >= 15)
+		op = dfulz_putlength(op, nlit - 15);
+
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (0 == mlen)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	*token |= (m < 15) ? m : 15;
+	if (m >= 15)
+		op = dfulz_putlength(op, m - 15);
+
+	return op;
+}
+
+/*
+	dfulz_compress() is greedy, with one candidate per hash: the last
+	place the same four bytes hashed to. That's plenty for firmware,
+	whose redundancy is mostly padding and repeated instruction
+	patterns, and keeps compression as fast as a flash can take it.
+*/
+uint32_t dfulz_compress(const uint8_t * src, uint32_t length, uint8_t * dst, uint32_t capacity)
+{
+	uint16_t table[1 << DFULZ_HASH_BITS];
+	uint8_t * op = dst;
+	uint8_t * end = dst + capacity;
+	uint32_t ip = 0;
+	uint32_t anchor = 0;
+	uint32_t candidate, mlen, h;
+
+	if (length > DFULZ_MAX_BLOCK)
+		return 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + DFULZ_MIN_MATCH <= length)
+	{
+		h = dfulz_hash(&src[ip]);
+		candidate = table[h];
+		table[h] = ip;
+
+		if ((candidate >= ip) || memcmp(&src[candidate], &src[ip], DFULZ_MIN_MATCH))
+		{
+			ip++;
+			continue;
+		}
+
+		for (mlen=DFULZ_MIN_MATCH; (ip + mlen < length) && (src[candidate + mlen] == src[ip + mlen]); mlen++)
+			;
+
+		op = dfulz_sequence(op, end, &src[anchor], ip - anchor, ip - candidate, mlen);
+		if (NULL == op)
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = dfulz_sequence(op, end, &src[anchor], length - anchor, 0, 0);
+	if (NULL == op)
+		return 0;
+
+	return op - dst;
+}
+
+/*
+	dfulz_getlength() reads the bytes that extend a length nibble of
+	15. Returns < 0 if src runs out first.
+*/
+static int dfulz_getlength(const uint8_t * src, uint32_t srclen, uint32_t * ip, uint32_t * length)
+{
+	uint8_t b;
+
+	do
+	{
+		if (*ip >= srclen)
+			return -1;
+		b = src[(*ip)++];
+		*length += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/*
+	dfulz_decompress() trusts nothing in src: every length and offset
+	is checked against both buffers before it's used.
+*/
+int dfulz_decompress(const uint8_t * src, uint32_t srclen, uint8_t * dst, uint32_t length)
+{
+	uint32_t ip = 0;
+	uint32_t op = 0;
+	uint32_t nlit, mlen, offset, i;
+	uint8_t token;
+
+	while (ip < srclen)
+	{
+		token = src[ip++];
+
+		nlit = token >> 4;
+		if ((nlit == 15) && (0 != dfulz_getlength(src, srclen, &ip, &nlit)))
+			return -1;
+
+		if ((nlit > srclen - ip) || (nlit > length - op))
+			return -1;
+
+		memcpy(&dst[op], &src[ip], nlit);
+		ip += nlit;
+		op += nlit;
+
+		//the last sequence has no match
+		if (ip == srclen)
+			break;
+
+		if (srclen - ip < 2)
+			return -1;
+		offset = src[ip] | (src[ip+1] << 8);
+		ip += 2;
+
+		mlen = token & 0x0f;
+		if ((mlen == 15) && (0 != dfulz_getlength(src, srclen, &ip, &mlen)))
+			return -1;
+		mlen += DFULZ_MIN_MATCH;
+
+		if ((0 == offset) || (offset > op) || (mlen > length - op))
+			return -1;
+
+		//a match can overlap what it's copying, e.g. a run of 0xff
+		//is one byte and a match at offset 1
+		if (offset >= mlen)
+		{
+			memcpy(&dst[op], &dst[op - offset], mlen);
+		} else
+		{
+			for (i=0; i<mlen; i++)
+				dst[op + i] = dst[op - offset + i];
+		}
+		op += mlen;
+	}
+
+	return (op == length) ? 0 : -1;
+}
+
+uint8_t * dfulz_pack(const uint8_t * data, uint32_t size, uint32_t blocksize, uint32_t * packedsize)
+{
+	uint32_t nblocks = (size + blocksize - 1) / blocksize;
+	uint32_t offset, length, stored, entry, i;
+	uint8_t * packed;
+
+	//worst case is every block stored raw
+	packed = (uint8_t *)malloc(DFULZ_HEADERLEN + 4 * nblocks + size);
+	memcpy(&packed[0], &size, 4);
+	memcpy(&packed[4], &blocksize, 4);
+
+	offset = DFULZ_HEADERLEN + 4 * nblocks;
+	for (i=0; i<nblocks; i++)
+	{
+		length = size - i * blocksize;
+		if (length > blocksize)
+			length = blocksize;
+
+		//only kept if it's smaller than the block itself
+		stored = dfulz_compress(&data[i * blocksize], length, &packed[offset], length - 1);
+		entry = stored;
+		if (0 == stored)
+		{
+			memcpy(&packed[offset], &data[i * blocksize], length);
+			stored = length;
+			entry = length | DFULZ_RAW;
+		}
+
+		memcpy(&packed[DFULZ_HEADERLEN + 4 * i], &entry, 4);
+		offset += stored;
+	}
+
+	*packedsize = offset;
+
+	return (uint8_t *)realloc(packed, offset);
+}
+
+int dfulz_check(const uint8_t * packed, uint32_t packedsize, uint32_t * size)
+{
+	uint32_t blocksize, nblocks, entry, length, i;
+	uint64_t total;
+
+	if (packedsize < DFULZ_HEADERLEN)
+		return -1;
+
+	memcpy(size, &packed[0], 4);
+	memcpy(&blocksize, &packed[4], 4);
+
+	if ((0 == blocksize) || (blocksize > DFULZ_MAX_BLOCK))
+		return -1;
+
+	nblocks = ((uint64_t)*size + blocksize - 1) / blocksize;
+	total = DFULZ_HEADERLEN + 4 * (uint64_t)nblocks;
+	if (total > packedsize)
+		return -1;
+
+	for (i=0; i<nblocks; i++)
+	{
+		memcpy(&entry, &packed[DFULZ_HEADERLEN + 4 * i], 4);
+
+		length = *size - i * blocksize;
+		if (length > blocksize)
+			length = blocksize;
+
+		//a raw block is exactly its size, a compressed one at least a token
+		if ((entry & DFULZ_RAW) ? ((entry & ~DFULZ_RAW) != length) : (0 == entry))
+			return -1;
+
+		total += entry & ~DFULZ_RAW;
+	}
+
+	return (total == packedsize) ? 0 : -1;
+}
+
+void dfulz_reader_init(dfulz_reader * reader, const uint8_t * packed)
+{
+	memset(reader, 0, sizeof(dfulz_reader));
+
+	reader->packed = packed;
+	memcpy(&reader->size, &packed[0], 4);
+	memcpy(&reader->blocksize, &packed[4], 4);
+	reader->nblocks = ((uint64_t)reader->size + reader->blocksize - 1) / reader->blocksize;
+	reader->stored = DFULZ_HEADERLEN + 4 * reader->nblocks;
+}
+
+void dfulz_reader_free(dfulz_reader * reader)
+{
+	free(reader->buffer);
+	reader->buffer = NULL;
+}
+
+/*
+	dfulz_read_block() decodes the reader's next block into dst, and
+	returns its length, or < 0 if it's malformed.
+*/
+static int32_t dfulz_read_block(dfulz_reader * reader, uint8_t * dst)
+{
+	uint32_t entry, stored, length;
+
+	memcpy(&entry, &reader->packed[DFULZ_HEADERLEN + 4 * reader->block], 4);
+	stored = entry & ~DFULZ_RAW;
+
+	length = reader->size - reader->block * reader->blocksize;
+	if (length > reader->blocksize)
+		length = reader->blocksize;
+
+	if (entry & DFULZ_RAW)
+		memcpy(dst, &reader->packed[reader->stored], length);
+	else if (0 != dfulz_decompress(&reader->packed[reader->stored], stored, dst, length))
+		return -1;
+
+	reader->block++;
+	reader->stored += stored;
+
+	return length;
+}
+
+int dfulz_read(uint8_t * data, uint32_t length, uint32_t offset, void * user_data)
+{
+	dfulz_reader * reader = (dfulz_reader *)user_data;
+	uint32_t count;
+	int32_t rv;
+
+	if ((offset != reader->position) || (length > reader->size - offset))
+		return -1;
+
+	while (length > 0)
+	{
+		//what's left of a block decoded for the last read
+		if (reader->nbuffered > 0)
+		{
+			count = reader->buffered + reader->nbuffered - reader->position;
+			if (count > length)
+				count = length;
+
+			memcpy(data, &reader->buffer[reader->position - reader->buffered], count);
+			data += count;
+			length -= count;
+			reader->position += count;
+
+			if (reader->position == reader->buffered + reader->nbuffered)
+				reader->nbuffered = 0;
+			continue;
+		}
+
+		//a whole block goes straight where it's wanted
+		count = reader->size - reader->position;
+		if (count > reader->blocksize)
+			count = reader->blocksize;
+
+		if (length >= count)
+		{
+			rv = dfulz_read_block(reader, data);
+			if (rv < 0)
+				return -1;
+
+			data += rv;
+			length -= rv;
+			reader->position += rv;
+			continue;
+		}
+
+		if (NULL == reader->buffer)
+			reader->buffer = (uint8_t *)malloc(reader->blocksize);
+
+		reader->buffered = reader->position;
+		rv = dfulz_read_block(reader, reader->buffer);
+		if (rv < 0)
+			return -1;
+		reader->nbuffered = rv;
+	}
+
+	return 0;
+}
+
+int dfulz_unpack(dfuse_image_element * element)
+{
+	dfulz_reader reader;
+	int rv;
+
+	if ((NULL == element->packed) || (NULL != element->data))
+		return 0;
+
+	element->data = (uint8_t *)malloc(element->element_size ? element->element_size : 1);
+
+	dfulz_reader_init(&reader, element->packed);
+	rv = dfulz_read(element->data, element->element_size, 0, &reader);
+	dfulz_reader_free(&reader);
+
+	if (0 != rv)
+	{
+		printf("packed element at 0x%.8x is corrupt\n", element->element_address);
+		dfulz_drop(element);
+		return -1;
+	}
+
+	return 0;
+}
+
+void dfulz_drop(dfuse_image_element * element)
+{
+	if (NULL != element->packed)
+	{
+		free(element->data);
+		element->data = NULL;
+	}
+}
@@ -0,0 +1,120 @@
+/*
+dfulz.{c,h} :
+A small LZ codec, and the packed dfuse container built on it. A packed file is
+a dfuse file with DFULZ_SIGNATURE in place of "DfuSe", whose elements hold
+their data packed rather than raw: the flash size, the block size, a table of
+how many bytes each block was stored in, then the blocks. Every block is
+compressed on its own (or stored raw, if that's smaller), so one can be
+decoded without the others, straight into a download buffer, and a packed
+file is flashed without the whole image ever being in memory. Prefix, target
+prefixes, element headers and suffix are as in any dfuse file, and the crc
+covers the file as stored.
+
+Blocks are LZ4-like sequences: a token byte, whose high nibble is the number
+of literals and low nibble the match length less DFULZ_MIN_MATCH (15 in
+either means more length bytes follow, each added on, until one isn't 255),
+the literals, then a 2 byte little endian offset back into what's been
+decoded. The last sequence of a block is literals only.
+
+Needs dfuse.h included first.
+*/
+
+#ifndef __DFU_LZ__
+#define __DFU_LZ__
+
+//signature of a packed dfuse file, in place of "DfuSe"
+#define DFULZ_SIGNATURE "DfuSz"
+
+//bytes of flash per block, a page, which is also what a download
+//block usually is
+#define DFULZ_BLOCK_SIZE 2048
+
+//offsets are 16 bits, so matches can't reach further back than this
+#define DFULZ_MAX_BLOCK 65536
+
+//a block table entry with this set is stored raw, not compressed
+#define DFULZ_RAW 0x80000000
+
+#define DFULZ_MIN_MATCH 4
+#define DFULZ_HASH_BITS 12
+
+//flash size and block size, before the block table
+#define DFULZ_HEADERLEN 8
+
+/*
+dfulz_reader decodes a packed element a block at a time, in order.
+*/
+typedef struct {
+	const uint8_t * packed;
+	uint32_t size;
+	uint32_t blocksize;
+	uint32_t nblocks;
+
+	//the next block to decode, and where its stored bytes start
+	uint32_t block;
+	uint32_t stored;
+
+	//the next offset dfulz_read() will be asked for
+	uint32_t position;
+
+	//a block decoded for a read that only wanted part of it
+	uint8_t * buffer;
+	uint32_t buffered;
+	uint32_t nbuffered;
+} dfulz_reader;
+
+/*
+dfulz_compress() compresses length bytes of src (at most DFULZ_MAX_BLOCK)
+into dst. Returns the compressed length, or 0 if it won't fit in
+capacity bytes.
+*/
+uint32_t dfulz_compress(const uint8_t * src, uint32_t length, uint8_t * dst, uint32_t capacity);
+
+/*
+dfulz_decompress() decodes srclen bytes of src, which have to come out to
+exactly length bytes at dst. Returns 0 on success, < 0 if src is
+malformed.
+*/
+int dfulz_decompress(const uint8_t * src, uint32_t srclen, uint8_t * dst, uint32_t length);
+
+/*
+dfulz_pack() packs size bytes of data in blocks of blocksize bytes. Returns
+a newly allocated buffer, and its length in packedsize.
+*/
+uint8_t * dfulz_pack(const uint8_t * data, uint32_t size, uint32_t blocksize, uint32_t * packedsize);
+
+/*
+dfulz_check() checks that packedsize bytes at packed are a well formed
+packed element, without decoding any blocks, and sets size to its flash
+size. Returns 0 if it is.
+*/
+int dfulz_check(const uint8_t * packed, uint32_t packedsize, uint32_t * size);
+
+/*
+dfulz_reader_init() starts reader at the beginning of a packed element that
+has passed dfulz_check(). dfulz_reader_free() releases it.
+*/
+void dfulz_reader_init(dfulz_reader * reader, const uint8_t * packed);
+void dfulz_reader_free(dfulz_reader * reader);
+
+/*
+dfulz_read() fills data with the length bytes of the element at offset.
+Reads have to follow on from each other, offset being where the last one
+stopped. Whole blocks are decoded straight into data. It's a dfu_fill_cb,
+with the reader as user_data. Returns 0 on success.
+*/
+int dfulz_read(uint8_t * data, uint32_t length, uint32_t offset, void * user_data);
+
+/*
+dfulz_unpack() decodes a packed element of a file read by dfuse_map() into
+its data, which is left to dfuse_struct_cleanup() or dfulz_drop(). Raw
+elements are left alone. Returns 0 on success.
+*/
+int dfulz_unpack(dfuse_image_element * element);
+
+/*
+dfulz_drop() frees what dfulz_unpack() decoded, once it's no longer
+needed.
+*/
+void dfulz_drop(dfuse_image_element * element);
+#endif
@@ -33,6 +33,8 @@ Class Specification for Device Firmware Upgrade.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -45,6 +47,276 @@ Class Specification for Device Firmware Upgrade.
 #endif
 #include <sys/types.h>
 
+static pthread_t dfu_event_thread;
+static pthread_mutex_t dfu_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static int32_t dfu_event_users = 0;
+static volatile int dfu_event_run = 0;
+
+/*
+ *  Returns a monotonic timestamp in microseconds.
+ */
+static uint64_t dfu_now_us( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ *  libusb transport: class requests on the claimed DFU interface of a real
+ *  device.
+ */
+static int32_t dfu_libusb_control_out( dfu_device *device, uint8_t request, uint16_t wvalue,
+                                       uint8_t *data, uint16_t length )
+{
+    return libusb_control_transfer( device->handle,
+          /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+          /* bRequest      */ request,
+          /* wValue        */ wvalue,
+          /* wIndex        */ device->interface,
+          /* Data          */ data,
+          /* wLength       */ length,
+                              DFU_TIMEOUT );
+}
+
+static int32_t dfu_libusb_control_in( dfu_device *device, uint8_t request, uint16_t wvalue,
+                                      uint8_t *data, uint16_t length )
+{
+    return libusb_control_transfer( device->handle,
+          /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+          /* bRequest      */ request,
+          /* wValue        */ wvalue,
+          /* wIndex        */ device->interface,
+          /* Data          */ data,
+          /* wLength       */ length,
+                              DFU_TIMEOUT );
+}
+
+static int32_t dfu_libusb_reset( dfu_device *device )
+{
+    return libusb_reset_device( device->handle );
+}
+
+static int32_t dfu_libusb_claim( dfu_device *device )
+{
+    int32_t err = libusb_claim_interface( device->handle, device->interface );
+
+    if( LIBUSB_ERROR_BUSY == err ) {
+        printf("STM32 DFU device: interface already claimed\n");
+    } else if( err ) {
+        printf("STM32 DFU device: interface can't be claimed\n");
+    }
+
+    return err;
+}
+
+static int32_t dfu_libusb_set_alt( dfu_device *device, int32_t alternate )
+{
+    return libusb_set_interface_alt_setting( device->handle, device->interface, alternate );
+}
+
+static void dfu_libusb_release( dfu_device *device )
+{
+    libusb_release_interface( device->handle, device->interface );
+    libusb_close( device->handle );
+    device->handle = NULL;
+}
+
+const dfu_transport dfu_libusb_transport = {
+    "libusb",
+    dfu_libusb_control_out,
+    dfu_libusb_control_in,
+    dfu_libusb_reset,
+    dfu_libusb_claim,
+    dfu_libusb_set_alt,
+    dfu_libusb_release
+};
+
+/*
+ *  Synchronous control transfer on device's interface through its
+ *  transport, accounting the time spent on the bus in the device's poll
+ *  statistics. windex and timeout are supplied by the transport.
+ */
+static int32_t dfu_control_transfer( dfu_device *device, uint8_t request_type,
+                                     uint8_t request, uint16_t wvalue,
+                                     uint16_t windex, char *data,
+                                     uint16_t length, unsigned int timeout )
+{
+    uint64_t start = dfu_now_us();
+    int32_t result;
+
+    if( request_type & LIBUSB_ENDPOINT_IN ) {
+        result = device->transport->control_in( device, request, wvalue,
+                                                (uint8_t *) data, length );
+    } else {
+        result = device->transport->control_out( device, request, wvalue,
+                                                 (uint8_t *) data, length );
+    }
+
+    device->poll.transfer_us += dfu_now_us() - start;
+    device->poll.transfers++;
+
+    return result;
+}
+
+/*
+ *  Fills status from the 6 byte DFU_GETSTATUS response in buffer.
+ */
+static void dfu_decode_status( const char *buffer, dfu_status *status )
+{
+    status->bStatus = buffer[0];
+    status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
+                            ((0xff & buffer[2]) << 8)  |
+                            (0xff & buffer[1]);
+
+    status->bState  = buffer[4];
+    status->iString = buffer[5];
+
+	#if STMDFU_DEBUG_PRINTFS
+	printf("Status:<%d:%s>\tWait:<%d>\tState:<%d:%s>\tidx:<%d>\n",
+			status->bStatus, dfu_status_to_string(status->bStatus),
+			status->bwPollTimeout,
+			status->bState, dfu_state_to_string(status->bState),
+			status->iString
+			);
+	#endif
+}
+
+/*
+ *  Sleeps for us microseconds and records the sleep against the state the
+ *  device reported.
+ */
+static void dfu_poll_sleep( dfu_device *device, const dfu_status *status, uint32_t us )
+{
+	struct timespec req;
+	int bucket = 0;
+	
+	req.tv_sec = us / 1000000;
+	req.tv_nsec = (us % 1000000) * 1000;
+	if (0 > nanosleep(&req, NULL))
+	{
+		printf("dfu_get_status: nanosleep failed");
+	}
+	
+	device->poll.sleep_us += us;
+	
+	//bucket n holds sleeps shorter than 2^n ms, the last one everything longer
+	while ((bucket < (DFU_POLL_BUCKETS - 1)) && ((us / 1000) >= (1u << bucket)))
+	{
+		bucket++;
+	}
+	
+	if (status->bState <= STATE_DFU_ERROR)
+	{
+		device->poll.hist[status->bState][bucket]++;
+	}
+}
+
+/*
+ *  Waits out the bwPollTimeout the device asked for before it will
+ *  accept the next request.
+ *
+ *  In adaptive mode the wait for a dfuDNBUSY status is cut short to the
+ *  latency learned for the operation in flight (device->poll.op). Every
+ *  early poll that finds the operation done shortens the next one a
+ *  little; an early poll that finds the device still dfuDNBUSY backs the
+ *  estimate off and falls back to the advertised bwPollTimeout.
+ */
+static void dfu_poll_wait( dfu_device *device, const dfu_status *status )
+{
+	dfu_poll * poll = &device->poll;
+	dfu_poll_entry * entry = &poll->ops[poll->op];
+	uint32_t advertised_us = status->bwPollTimeout * 1000;
+	uint32_t us = advertised_us;
+	int busy = (status->bState == STATE_DFU_DOWNLOAD_BUSY);
+	
+	if (poll->pending)
+	{
+		poll->pending = 0;
+		
+		if (busy)
+		{
+			entry->surprises++;
+			entry->learned_us = poll->pending_us + poll->pending_us / 4;
+			if (entry->learned_us > entry->advertised_ms * 1000)
+			{
+				entry->learned_us = entry->advertised_ms * 1000;
+			}
+			dfu_poll_sleep(device, status, advertised_us);
+			return;
+		}
+		
+		entry->samples++;
+		entry->learned_us = poll->pending_us - poll->pending_us / 8;
+		if (entry->learned_us < DFU_POLL_MIN_US)
+		{
+			entry->learned_us = DFU_POLL_MIN_US;
+		}
+	}
+	
+	if (busy)
+	{
+		entry->advertised_ms = status->bwPollTimeout;
+		
+		if (poll->adaptive)
+		{
+			if ((entry->learned_us != 0) && (entry->learned_us < advertised_us))
+			{
+				us = entry->learned_us;
+			}
+			poll->pending = 1;
+			poll->pending_us = us;
+		}
+	}
+	
+	if (us != 0)
+	{
+		dfu_poll_sleep(device, status, us);
+	}
+}
+
+/*
+ *  Parses the DFU functional descriptor out of the "extra" descriptor bytes
+ *  libusb attaches to an interface.
+ *
+ *  returns 0 if a functional descriptor was found, 1 if defaults were used
+ */
+int32_t dfu_parse_functional( dfu_device *device, const unsigned char *extra, int32_t length )
+{
+    int32_t i = 0;
+
+    device->attributes = DFU_ATTR_CAN_DNLOAD | DFU_ATTR_CAN_UPLOAD;
+    device->transfer_size = DFU_DEFAULT_TRANSFER_SIZE;
+    device->detach_timeout = DFU_DETACH_TIMEOUT;
+
+    /* extra is a run of descriptors, each starting with bLength, bDescriptorType */
+    while( (NULL != extra) && (i + 2 <= length) && (0 != extra[i]) ) {
+        if( (DFU_FUNCTIONAL_DESCRIPTOR == extra[i+1]) &&
+            (DFU_FUNCTIONAL_LENGTH <= extra[i]) &&
+            (i + DFU_FUNCTIONAL_LENGTH <= length) ) {
+            device->attributes = extra[i+2];
+            device->detach_timeout = extra[i+3] | (extra[i+4] << 8);
+            device->transfer_size = extra[i+5] | (extra[i+6] << 8);
+
+            if( 0 == device->transfer_size ) {
+                device->transfer_size = DFU_DEFAULT_TRANSFER_SIZE;
+            }
+
+			#if STMDFU_DEBUG_PRINTFS
+			printf("functional descriptor: attributes <%x> wTransferSize <%d> bcdDFU <%x>\n",
+					device->attributes, device->transfer_size,
+					extra[i+7] | (extra[i+8] << 8));
+			#endif
+            return 0;
+        }
+        i += extra[i];
+    }
+
+    return 1;
+}
+
 /*
  *  DFU_DETACH Request (DFU Spec 1.1, Section 5.1)
  *
@@ -58,11 +330,11 @@ int32_t dfu_detach( dfu_device *device, const int32_t timeout )
 {
     int32_t result;
 
-    if( (NULL == device) || (NULL == device->handle) || (timeout < 0) ) {
+    if( (NULL == device) || (NULL == device->transport) || (timeout < 0) ) {
         return -1;
     }
 
-    result = libusb_control_transfer( device->handle,
+    result = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_DETACH,
           /* wValue        */ timeout,
@@ -89,7 +361,7 @@ int32_t dfu_download(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t
     int32_t result;
 
     /* Sanity checks */
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
@@ -101,7 +373,7 @@ int32_t dfu_download(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t
         return -3;
     }
 
-    result = libusb_control_transfer( device->handle,
+    result = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_DNLOAD,
           /* wValue        */ wvalue,
@@ -128,7 +400,7 @@ int32_t dfu_upload(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t le
     int32_t result;
 
     /* Sanity checks */
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
@@ -136,7 +408,7 @@ int32_t dfu_upload(dfu_device *device, int32_t wvalue, uint8_t* data, int32_t le
         return -2;
     }
 
-    result = libusb_control_transfer( device->handle,
+    result = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_UPLOAD,
           /* wValue        */ wvalue,
@@ -160,9 +432,8 @@ int32_t dfu_get_status( dfu_device *device, dfu_status *status )
 {
     char buffer[6];
     int32_t result;
-	struct timespec req;
 	
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
@@ -177,7 +448,7 @@ int32_t dfu_get_status( dfu_device *device, dfu_status *status )
 	status->bState        = -1;
 	status->iString       = -1;
 
-    result = libusb_control_transfer( device->handle,
+    result = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATUS,
           /* wValue        */ 0,
@@ -187,38 +458,15 @@ int32_t dfu_get_status( dfu_device *device, dfu_status *status )
                               DFU_TIMEOUT );
 
     if( 6 == result ) {
-        status->bStatus = buffer[0];
-        status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
-                                ((0xff & buffer[2]) << 8)  |
-                                (0xff & buffer[1]);
-
-        status->bState  = buffer[4];
-        status->iString = buffer[5];
-		
-		#if STMDFU_DEBUG_PRINTFS
-		printf("Status:<%d:%s>\tWait:<%d>\tState:<%d:%s>\tidx:<%d>\n",
-				status->bStatus, dfu_status_to_string(status->bStatus),
-				status->bwPollTimeout,
-				status->bState, dfu_state_to_string(status->bState),
-				status->iString
-				);
-		#endif
-		
-		if (status->bwPollTimeout != 0)
-		{
-			req.tv_sec = 0;
-			req.tv_nsec = status->bwPollTimeout * 1000000;
-			if (0 > nanosleep(&req, NULL))
-			{
-				printf("dfu_get_status: nanosleep failed");
-			}
-		}
-				
+        dfu_decode_status( buffer, status );
+        dfu_poll_wait( device, status );
     } else {
-        if( 0 < result ) {
-            /* There was an error, we didn't get the entire message. */
-            return -2;
+        if( 0 > result ) {
+            /* The transfer itself failed; status was never filled in. */
+            return result;
         }
+        /* There was an error, we didn't get the entire message. */
+        return -2;
     }
 
     return 0;
@@ -235,11 +483,11 @@ int32_t dfu_clear_status( dfu_device *device )
 {
     int32_t result;
 
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
-    result = libusb_control_transfer( device->handle,
+    result = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_CLRSTATUS,
           /* wValue        */ 0,
@@ -263,11 +511,11 @@ int32_t dfu_get_state( dfu_device *device )
     int32_t result;
     char buffer[1];
 
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
-    result = libusb_control_transfer( device->handle,
+    result = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATE,
           /* wValue        */ 0,
@@ -296,11 +544,11 @@ int32_t dfu_abort( dfu_device *device )
 {
     int32_t result;
 
-    if( (NULL == device) || (NULL == device->handle) ) {
+    if( (NULL == device) || (NULL == device->transport) ) {
         return -1;
     }
 
-    result = libusb_control_transfer( device->handle,
+    result = dfu_control_transfer( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_ABORT,
           /* wValue        */ 0,
@@ -426,4 +674,390 @@ char* dfu_status_to_string( const int32_t status )
     }
 
     return message;
-}
\ No newline at end of file
+}
+
+/*
+ *  Event handling thread. Completion callbacks for every submitted
+ *  transfer run here.
+ */
+static void* dfu_event_loop( void *arg )
+{
+    struct timeval tv;
+
+    while( dfu_event_run ) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        libusb_handle_events_timeout_completed( NULL, &tv, NULL );
+    }
+
+    return NULL;
+}
+
+/*
+ *  Starts the event handling thread that completes asynchronous requests.
+ *  The thread is shared by every dfu_device; each call must be paired with
+ *  dfu_async_stop().
+ *
+ *  returns 0 or < 0 on error
+ */
+int32_t dfu_async_start( void )
+{
+    int32_t result = 0;
+
+    pthread_mutex_lock( &dfu_event_lock );
+
+    if( 0 == dfu_event_users ) {
+        dfu_event_run = 1;
+        if( 0 != pthread_create(&dfu_event_thread, NULL, dfu_event_loop, NULL) ) {
+            dfu_event_run = 0;
+            result = -1;
+        }
+    }
+
+    if( 0 == result ) {
+        dfu_event_users++;
+    }
+
+    pthread_mutex_unlock( &dfu_event_lock );
+
+    return result;
+}
+
+/*
+ *  Drops a reference to the event handling thread, joining it when the
+ *  last user is gone.
+ */
+void dfu_async_stop( void )
+{
+    pthread_mutex_lock( &dfu_event_lock );
+
+    if( (0 < dfu_event_users) && (0 == --dfu_event_users) ) {
+        dfu_event_run = 0;
+        pthread_join( dfu_event_thread, NULL );
+    }
+
+    pthread_mutex_unlock( &dfu_event_lock );
+}
+
+/*
+ *  libusb completion callback, translates the libusb transfer status into
+ *  the same result a synchronous libusb_control_transfer would return.
+ */
+static void dfu_transfer_complete( struct libusb_transfer *usb )
+{
+    dfu_transfer *transfer = (dfu_transfer *) usb->user_data;
+    int32_t result;
+
+    switch( usb->status ) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            result = usb->actual_length;
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            result = LIBUSB_ERROR_TIMEOUT;
+            break;
+        case LIBUSB_TRANSFER_STALL:
+            result = LIBUSB_ERROR_PIPE;
+            break;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            result = LIBUSB_ERROR_NO_DEVICE;
+            break;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            result = LIBUSB_ERROR_OVERFLOW;
+            break;
+        default:
+            result = LIBUSB_ERROR_IO;
+            break;
+    }
+
+    transfer->result = result;
+
+    if( NULL != transfer->callback ) {
+        transfer->callback( transfer );
+    }
+
+    pthread_mutex_lock( &transfer->lock );
+    transfer->done = 1;
+    pthread_cond_signal( &transfer->cond );
+    pthread_mutex_unlock( &transfer->lock );
+}
+
+/*
+ *  Fills in the setup packet and queues transfer.
+ */
+static int32_t dfu_submit( dfu_transfer *transfer, uint8_t request_type,
+                           uint8_t request, int32_t wvalue, int32_t length )
+{
+    int32_t result;
+
+    if( (NULL == transfer) || (NULL == transfer->device) ||
+        (NULL == transfer->device->transport) ) {
+        return -1;
+    }
+
+    if( (length < 0) || (length > transfer->max_length) ) {
+        return -2;
+    }
+
+    /* transports other than libusb complete the request right away */
+    if( &dfu_libusb_transport != transfer->device->transport ) {
+        transfer->submitted_us = dfu_now_us();
+        transfer->done = 0;
+        transfer->result = dfu_control_transfer( transfer->device, request_type,
+                                                 request, wvalue, 0,
+                                                 (char *) dfu_transfer_data(transfer),
+                                                 length, DFU_TIMEOUT );
+        /* dfu_control_transfer already accounted for the time */
+        transfer->submitted_us = 0;
+        if( NULL != transfer->callback ) {
+            transfer->callback( transfer );
+        }
+        transfer->done = 1;
+        return (transfer->result < 0) ? transfer->result : 0;
+    }
+
+    libusb_fill_control_setup( transfer->buffer, request_type, request,
+                               wvalue, transfer->device->interface, length );
+    libusb_fill_control_transfer( transfer->usb, transfer->device->handle,
+                                  transfer->buffer, dfu_transfer_complete,
+                                  transfer, DFU_TIMEOUT );
+
+    transfer->result = 0;
+    transfer->done = 0;
+    transfer->submitted_us = dfu_now_us();
+
+    result = libusb_submit_transfer( transfer->usb );
+    if( 0 != result ) {
+        transfer->result = result;
+        transfer->done = 1;
+    }
+
+    return result;
+}
+
+/*
+ *  Allocates an asynchronous request for device with room for max_length
+ *  bytes of data stage.
+ *
+ *  returns the transfer or NULL on error
+ */
+dfu_transfer* dfu_transfer_alloc( dfu_device *device, const int32_t max_length )
+{
+    dfu_transfer *transfer;
+
+    if( (NULL == device) || (max_length < 0) ) {
+        return NULL;
+    }
+
+    transfer = (dfu_transfer *) calloc( 1, sizeof(dfu_transfer) );
+    if( NULL == transfer ) {
+        return NULL;
+    }
+
+    transfer->usb = libusb_alloc_transfer( 0 );
+    transfer->buffer = (uint8_t *) malloc( LIBUSB_CONTROL_SETUP_SIZE + max_length );
+    if( (NULL == transfer->usb) || (NULL == transfer->buffer) ) {
+        libusb_free_transfer( transfer->usb );
+        free( transfer->buffer );
+        free( transfer );
+        return NULL;
+    }
+
+    transfer->device = device;
+    transfer->max_length = max_length;
+    transfer->done = 1;
+    pthread_mutex_init( &transfer->lock, NULL );
+    pthread_cond_init( &transfer->cond, NULL );
+
+    return transfer;
+}
+
+/*
+ *  Frees a transfer. The transfer must not be in flight.
+ */
+void dfu_transfer_free( dfu_transfer *transfer )
+{
+    if( NULL == transfer ) {
+        return;
+    }
+
+    pthread_cond_destroy( &transfer->cond );
+    pthread_mutex_destroy( &transfer->lock );
+    libusb_free_transfer( transfer->usb );
+    free( transfer->buffer );
+    free( transfer );
+}
+
+/*
+ *  Returns the data stage of transfer.
+ */
+uint8_t* dfu_transfer_data( dfu_transfer *transfer )
+{
+    return transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+}
+
+/*
+ *  Asynchronous DFU_DNLOAD (DFU Spec 1.1, Section 6.1.1). The payload must
+ *  already be staged in dfu_transfer_data().
+ *
+ *  returns 0 or < 0 on error
+ */
+int32_t dfu_submit_download( dfu_transfer *transfer, int32_t wvalue, int32_t length )
+{
+    return dfu_submit( transfer,
+          LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+          DFU_DNLOAD, wvalue, length );
+}
+
+/*
+ *  Asynchronous DFU_UPLOAD (DFU Spec 1.1, Section 6.2)
+ *
+ *  returns 0 or < 0 on error
+ */
+int32_t dfu_submit_upload( dfu_transfer *transfer, int32_t wvalue, int32_t length )
+{
+    if( 0 == length ) {
+        return -2;
+    }
+
+    return dfu_submit( transfer,
+          LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+          DFU_UPLOAD, wvalue, length );
+}
+
+/*
+ *  Asynchronous DFU_GETSTATUS (DFU Spec 1.1, Section 6.1.2). Use
+ *  dfu_transfer_status() to decode the result.
+ *
+ *  returns 0 or < 0 on error
+ */
+int32_t dfu_submit_get_status( dfu_transfer *transfer )
+{
+    return dfu_submit( transfer,
+          LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+          DFU_GETSTATUS, 0, 6 );
+}
+
+/*
+ *  Charges a completed transfer's time on the bus to its device, once.
+ */
+static void dfu_transfer_account( dfu_transfer *transfer )
+{
+    if( 0 != transfer->submitted_us ) {
+        transfer->device->poll.transfer_us += dfu_now_us() - transfer->submitted_us;
+        transfer->device->poll.transfers++;
+        transfer->submitted_us = 0;
+    }
+}
+
+/*
+ *  Blocks until transfer completes. If the event handling thread is not
+ *  running, events are handled on the calling thread instead.
+ *
+ *  returns the number of bytes transferred or < 0 on error
+ */
+int32_t dfu_transfer_wait( dfu_transfer *transfer )
+{
+    struct timeval tv;
+
+    if( NULL == transfer ) {
+        return -1;
+    }
+
+    if( !dfu_event_run ) {
+        while( !transfer->done ) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 100000;
+            libusb_handle_events_timeout_completed( NULL, &tv, &transfer->done );
+        }
+        dfu_transfer_account( transfer );
+        return transfer->result;
+    }
+
+    pthread_mutex_lock( &transfer->lock );
+    while( !transfer->done ) {
+        pthread_cond_wait( &transfer->cond, &transfer->lock );
+    }
+    pthread_mutex_unlock( &transfer->lock );
+
+    dfu_transfer_account( transfer );
+
+    return transfer->result;
+}
+
+/*
+ *  Decodes a completed DFU_GETSTATUS transfer into status, waiting out the
+ *  bwPollTimeout exactly like dfu_get_status().
+ *
+ *  return the 0 if successful or < 0 on an error
+ */
+int32_t dfu_transfer_status( dfu_transfer *transfer, dfu_status *status )
+{
+    int32_t result = dfu_transfer_wait( transfer );
+
+    if( 6 != result ) {
+        return (result < 0) ? result : -2;
+    }
+
+    dfu_decode_status( (char *) dfu_transfer_data(transfer), status );
+    dfu_poll_wait( transfer->device, status );
+
+    return 0;
+}
+
+/*
+ *  Prints the learned poll latency table and the per-state histogram of
+ *  time spent sleeping on bwPollTimeout, next to the time spent in
+ *  control transfers.
+ */
+void dfu_poll_report( dfu_device *device )
+{
+	static const char * opnames[DFU_NUM_OPS] = {"other", "program", "erase", "set-address", "mass-erase"};
+	dfu_poll * poll = &device->poll;
+	int i, j;
+	
+	printf("poll mode: %s\n", poll->adaptive ? "adaptive" : "advertised");
+	printf("transfers: %u in %llu us, sleeping: %llu us\n",
+			poll->transfers,
+			(unsigned long long) poll->transfer_us,
+			(unsigned long long) poll->sleep_us);
+	
+	printf("%-12s %10s %10s %8s %9s\n", "operation", "advert ms", "learned us", "early", "surprise");
+	for (i=0; i<DFU_NUM_OPS; i++)
+	{
+		printf("%-12s %10u %10u %8u %9u\n",
+				opnames[i],
+				poll->ops[i].advertised_ms,
+				poll->ops[i].learned_us,
+				poll->ops[i].samples,
+				poll->ops[i].surprises);
+	}
+	
+	printf("sleeps by state (ms): ");
+	for (j=0; j<DFU_POLL_BUCKETS; j++)
+	{
+		if (j == (DFU_POLL_BUCKETS - 1))
+			printf("  >=%-3u", 1u << (j-1));
+		else
+			printf("  <%-4u", 1u << j);
+	}
+	printf("\n");
+	
+	for (i=0; i<=STATE_DFU_ERROR; i++)
+	{
+		for (j=0; j<DFU_POLL_BUCKETS; j++)
+		{
+			if (poll->hist[i][j])
+				break;
+		}
+		
+		if (j == DFU_POLL_BUCKETS)
+			continue;
+		
+		printf("%-20s", dfu_state_to_string(i));
+		for (j=0; j<DFU_POLL_BUCKETS; j++)
+		{
+			printf(" %6u", poll->hist[i][j]);
+		}
+		printf("\n");
+	}
+}
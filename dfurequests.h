@@ -35,6 +35,8 @@ Class Specification for Device Firmware Upgrade.
 #ifndef __DFU_H__
 #define __DFU_H__
 
+#include <pthread.h>
+
 /* Wait for 10 seconds before a timeout since erasing/flashing can take some time. */
 #define DFU_TIMEOUT 2500
 
@@ -47,6 +49,19 @@ Class Specification for Device Firmware Upgrade.
 #define DFU_ITF_SUBCLASS 0x01
 #define DFU_ITF_PROTOCOL 0x02
 
+//DFU functional descriptor (DFU Spec 1.1, Section 4.1.3)
+#define DFU_FUNCTIONAL_DESCRIPTOR 0x21
+#define DFU_FUNCTIONAL_LENGTH 9
+
+//bmAttributes bits of the functional descriptor
+#define DFU_ATTR_CAN_DNLOAD 0x01
+#define DFU_ATTR_CAN_UPLOAD 0x02
+#define DFU_ATTR_MANIFESTATION_TOLERANT 0x04
+#define DFU_ATTR_WILL_DETACH 0x08
+
+//used when a device doesn't have a functional descriptor
+#define DFU_DEFAULT_TRANSFER_SIZE 2048
+
 /* DFU commands */
 #define DFU_DETACH      0
 #define DFU_DNLOAD      1
@@ -104,10 +119,154 @@ typedef struct {
     uint8_t iString;
 } dfu_status;
 
+/* Operations a dfuDNBUSY poll can be waiting on, see dfu_poll */
+#define DFU_OP_OTHER        0
+#define DFU_OP_PROGRAM      1
+#define DFU_OP_ERASE        2
+#define DFU_OP_SET_ADDRESS  3
+#define DFU_OP_MASS_ERASE   4
+#define DFU_NUM_OPS         5
+
+/* Histogram buckets for poll sleeps: <1ms, <2ms, ... <64ms, >=64ms */
+#define DFU_POLL_BUCKETS 8
+
+/* Adaptive polling never shortens a dfuDNBUSY wait below this (us) */
+#define DFU_POLL_MIN_US 500
+
 typedef struct {
+	uint32_t learned_us;
+	uint32_t advertised_ms;
+	uint32_t samples;
+	uint32_t surprises;
+} dfu_poll_entry;
+
+/*
+*  Poll bookkeeping for a device. op is set by the dfu command layer
+*  before each DNLOAD so a dfuDNBUSY wait can be charged to (and learned
+*  for) the operation the device is performing.
+*/
+typedef struct {
+	int adaptive;
+	int op;
+	int pending;
+	uint32_t pending_us;
+	uint64_t sleep_us;
+	uint64_t transfer_us;
+	uint32_t transfers;
+	dfu_poll_entry ops[DFU_NUM_OPS];
+	uint32_t hist[STATE_DFU_ERROR + 1][DFU_POLL_BUCKETS];
+} dfu_poll;
+
+/* Sector attributes from a DfuSe layout string, 'a' to 'g' */
+#define DFU_SECTOR_READABLE   0x01
+#define DFU_SECTOR_ERASABLE   0x02
+#define DFU_SECTOR_WRITEABLE  0x04
+
+/* Limits on what a device's memory layouts can describe */
+#define DFU_MAX_ALTS        4
+#define DFU_MAX_SECTOR_RUNS 16
+
+/*
+*  A run of count equally sized sectors starting at address, as in the
+*  "04*016Kg" of a DfuSe layout string.
+*/
+typedef struct {
+	uint32_t address;
+	uint32_t count;
+	uint32_t size;
+	uint8_t attributes;
+} dfu_sector_run;
+
+/*
+*  The memory an alternate setting gives access to, parsed from its
+*  interface string, e.g.
+*  "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg".
+*  A map with no runs means the layout is unknown.
+*/
+typedef struct {
+	char name[32];
+	uint32_t nruns;
+	dfu_sector_run runs[DFU_MAX_SECTOR_RUNS];
+} dfu_memory_map;
+
+typedef struct dfu_device dfu_device;
+
+/*
+*  A transport carries DFU requests to a device. control_out and control_in
+*  perform a class request on the device's DFU interface and return the
+*  number of bytes transferred or a libusb error code (< 0), exactly like
+*  libusb_control_transfer. dfu_libusb_transport talks to real hardware,
+*  dfusim_transport (dfusim.h) to a software bootloader.
+*/
+typedef struct {
+	const char *name;
+	int32_t (*control_out)( dfu_device *device, uint8_t request, uint16_t wvalue,
+							uint8_t *data, uint16_t length );
+	int32_t (*control_in)( dfu_device *device, uint8_t request, uint16_t wvalue,
+						   uint8_t *data, uint16_t length );
+	int32_t (*reset)( dfu_device *device );
+	int32_t (*claim)( dfu_device *device );
+	int32_t (*set_alt)( dfu_device *device, int32_t alternate );
+	void (*release)( dfu_device *device );
+} dfu_transport;
+
+struct dfu_device {
+	const dfu_transport *transport;
+	void *transport_data;
 	struct libusb_device_handle *handle;
 	int32_t interface;
-} dfu_device;
+	uint8_t attributes;
+	uint16_t transfer_size;
+	uint16_t detach_timeout;
+	char family[32];		//vid-pid-bcdDevice, keys per family caches
+	char location[32];		//bus-port path, names the device in reports
+	char serial[64];		//usb serial number, tells boards of a family apart
+	int32_t alternate;
+	uint32_t address;		//last address pointer set
+	dfu_memory_map layout[DFU_MAX_ALTS];
+	dfu_poll poll;
+};
+
+extern const dfu_transport dfu_libusb_transport;
+
+typedef struct dfu_transfer dfu_transfer;
+
+/*
+*  Completion callback for an asynchronous DFU request. It runs on the
+*  event handling thread, so it must not block.
+*/
+typedef void (*dfu_transfer_cb)( dfu_transfer *transfer );
+
+/*
+*  An asynchronous DFU request. The buffer holds the 8 byte setup packet
+*  followed by up to max_length bytes of data stage, so a DNLOAD payload can
+*  be staged in place (see dfu_transfer_data()) while another request is
+*  still in flight.
+*/
+struct dfu_transfer {
+    dfu_device *device;
+    struct libusb_transfer *usb;
+    uint8_t *buffer;
+    int32_t max_length;
+    int32_t result;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    dfu_transfer_cb callback;
+    void *user_data;
+    uint64_t submitted_us;
+};
+
+/*
+*  Parses the DFU functional descriptor out of the "extra" descriptor bytes
+*  libusb attaches to an interface, filling in device's attributes,
+*  transfer_size and detach_timeout. If there's no functional descriptor,
+*  the device is assumed to upload and download DFU_DEFAULT_TRANSFER_SIZE
+*  byte blocks.
+*
+*  returns 0 if a functional descriptor was found, 1 if defaults were used
+*/
+int32_t dfu_parse_functional( dfu_device *device, const unsigned char *extra, int32_t length );
 
 /*
 *  DFU_DETACH Request (DFU Spec 1.1, Section 5.1)
@@ -198,4 +357,72 @@ char* dfu_status_to_string( const int32_t status );
 *  returns the status name or "unknown status"
 */
 char* dfu_state_to_string( const int32_t state );
+
+/*
+*  Prints the learned per-operation poll latencies and the per-state
+*  histogram of time spent sleeping versus transferring.
+*/
+void dfu_poll_report( dfu_device *device );
+
+/*
+*  Starts the event handling thread that completes asynchronous requests.
+*  The thread is shared by every dfu_device; each call must be paired with
+*  dfu_async_stop().
+*
+*  returns 0 or < 0 on error
+*/
+int32_t dfu_async_start( void );
+
+/*
+*  Drops a reference to the event handling thread, joining it when the
+*  last user is gone.
+*/
+void dfu_async_stop( void );
+
+/*
+*  Allocates an asynchronous request for device with room for max_length
+*  bytes of data stage.
+*
+*  returns the transfer or NULL on error
+*/
+dfu_transfer* dfu_transfer_alloc( dfu_device *device, const int32_t max_length );
+
+/*
+*  Frees a transfer. The transfer must not be in flight.
+*/
+void dfu_transfer_free( dfu_transfer *transfer );
+
+/*
+*  Returns the data stage of transfer. DNLOAD payloads are staged here
+*  before dfu_submit_download(), UPLOAD data is found here after
+*  dfu_transfer_wait().
+*/
+uint8_t* dfu_transfer_data( dfu_transfer *transfer );
+
+/*
+*  Asynchronous DFU_DNLOAD, DFU_UPLOAD and DFU_GETSTATUS requests. Each
+*  returns as soon as the request is queued; dfu_transfer_wait() collects
+*  the result. The transfer's callback (if any) is invoked on completion.
+*
+*  returns 0 or < 0 on error
+*/
+int32_t dfu_submit_download( dfu_transfer *transfer, int32_t wvalue, int32_t length );
+int32_t dfu_submit_upload( dfu_transfer *transfer, int32_t wvalue, int32_t length );
+int32_t dfu_submit_get_status( dfu_transfer *transfer );
+
+/*
+*  Blocks until transfer completes. If the event handling thread is not
+*  running, events are handled on the calling thread instead.
+*
+*  returns the number of bytes transferred or < 0 on error
+*/
+int32_t dfu_transfer_wait( dfu_transfer *transfer );
+
+/*
+*  Decodes a completed DFU_GETSTATUS transfer into status, waiting out the
+*  bwPollTimeout exactly like dfu_get_status().
+*
+*  return the 0 if successful or < 0 on an error
+*/
+int32_t dfu_transfer_status( dfu_transfer *transfer, dfu_status *status );
 #endif
@@ -10,45 +10,106 @@ Specification, UM0391.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #include "dfuse.h"
+#include "dfulz.h"
 #include "crc32.h"
 
+//glibc only defines IOV_MAX for _XOPEN_SOURCE, 1024 is what it is on linux
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /*
-	dfuse_init() allocates memory for the various dfuse structs
-	that make up the dfuse file, and populates fields that are
-	independent of the firmware image.
+	dfuse_chunk_new() allocates a chunk with room for size bytes. calloc
+	hands big chunks over as fresh zeroed pages, so dfuse_alloc() never
+	has to clear anything.
 */
-dfuse_file * dfuse_init(int binfile)
+static dfuse_chunk * dfuse_chunk_new(uint32_t size)
 {
-	int i, j;
-	int num_images = 1;
-	int num_imgelements = 1;	
-	char * stmjunk = "abababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababab";
-	struct stat stat;
+	dfuse_chunk * chunk;
 	
-	//allocate memory
-	dfuse_file * dfusefile = (dfuse_file *)malloc(sizeof(dfuse_file));
-	dfusefile->prefix = (dfuse_prefix *)malloc(sizeof(dfuse_prefix));
-	dfusefile->images = (dfuse_image **)malloc(sizeof(dfuse_image *) * num_images);
-	for (i=0; i<num_images; i++)
-	{
-		dfusefile->images[i] = (dfuse_image *)malloc(sizeof(dfuse_image));
-		dfusefile->images[i]->tarprefix = (dfuse_target_prefix *)malloc(sizeof(dfuse_target_prefix));
-		dfusefile->images[i]->imgelement = (dfuse_image_element **)malloc(sizeof(dfuse_image_element *) * num_imgelements);
-		//num_imgelements should really be dfusefile->images[i]->tarprefix->num_elements
-		for (j=0; j<num_imgelements; j++)
+	if (size > SIZE_MAX - sizeof(dfuse_chunk))
+		return NULL;
+	
+	chunk = (dfuse_chunk *)calloc(1, sizeof(dfuse_chunk) + size);
+	if (NULL != chunk)
+		chunk->size = size;
+	
+	return chunk;
+}
+
+/*
+	dfuse_alloc() bumps through the chunk at the head of the arena,
+	starting one twice its size when it runs out. Anything bigger than
+	half a chunk gets a chunk of its own behind the head, so a large
+	element doesn't strand what's left of the one being used. A size
+	that would wrap when it's rounded up is refused.
+*/
+void * dfuse_alloc(dfuse_file * dfusefile, uint32_t size)
+{
+	dfuse_chunk * head = dfusefile->arena;
+	dfuse_chunk * chunk;
+	uint32_t grow;
+	
+	//keep everything 16 byte aligned, like malloc()
+	if (size > UINT32_MAX - 15)
+		return NULL;
+	size = (size + 15) & ~15;
+	
+	if (size > head->size - head->used)
+	{
+		if (size > head->size / 2)
 		{
-			dfusefile->images[i]->imgelement[j] = (dfuse_image_element *)malloc(sizeof(dfuse_image_element));
-			//space for actual image element data will probably be easier to allocate later (or just write to file)
-			//dfusefile->images[i]->imgelement[j]->data = (int32_t *)malloc(sizeof(int32_t) * imgelement size);
+			chunk = dfuse_chunk_new(size);
+			if (NULL == chunk)
+				return NULL;
+			chunk->used = size;
+			chunk->next = head->next;
+			head->next = chunk;
+			return chunk + 1;
 		}
+		
+		grow = (head->size < DFUSE_ARENA_MAX) ? head->size * 2 : head->size;
+		chunk = dfuse_chunk_new(grow);
+		if (NULL == chunk)
+			return NULL;
+		chunk->next = head;
+		dfusefile->arena = head = chunk;
 	}
-	dfusefile->suffix = (dfuse_suffix *)malloc(sizeof(dfuse_suffix));
+	
+	head->used += size;
+	return (uint8_t *)(head + 1) + head->used - size;
+}
+
+/*
+	dfuse_new() allocates an empty dfuse file, with no targets, and
+	populates the prefix and suffix fields that are independent of the
+	firmware images. The file is the first thing in its own arena.
+*/
+dfuse_file * dfuse_new()
+{
+	//allocate memory
+	dfuse_chunk * arena = dfuse_chunk_new(DFUSE_ARENA_CHUNK);
+	dfuse_file * dfusefile = (dfuse_file *)(arena + 1);
+	
+	arena->used = (sizeof(dfuse_file) + 15) & ~15;
+	dfusefile->arena = arena;
+	dfusefile->prefix = (dfuse_prefix *)dfuse_alloc(dfusefile, sizeof(dfuse_prefix));
+	dfusefile->images = NULL;
+	dfusefile->suffix = (dfuse_suffix *)dfuse_alloc(dfusefile, sizeof(dfuse_suffix));
+	dfusefile->map = NULL;
+	dfusefile->maplength = 0;
+	dfusefile->fd = -1;
+	dfusefile->crc = chksum_crc32_init();
 	
 	//set predetermined prefix values
 	dfusefile->prefix->signature[0] = 'D';
@@ -57,6 +118,12 @@ dfuse_file * dfuse_init(int binfile)
 	dfusefile->prefix->signature[3] = 'S';
 	dfusefile->prefix->signature[4] = 'e';
 	dfusefile->prefix->version = 0x01;
+	dfusefile->prefix->targets = 0;
+	
+	//From looking at dfuse file generated by STM's dfuse packager,
+	//the image size does not include the standard DFU suffix
+	// 	dfusefile->prefix->dfu_image_size = STMDFU_PREFIXLEN + STMDFU_SUFFIXLEN;
+	dfusefile->prefix->dfu_image_size = STMDFU_PREFIXLEN;
 	
 	//set predetermined suffix values
 	dfusefile->suffix->device_low = 0xff;
@@ -72,73 +139,846 @@ dfuse_file * dfuse_init(int binfile)
 	dfusefile->suffix->dfu_signature[2] = 'D';
 	dfusefile->suffix->suffix_length = 16;
 	
-	//set predetermined values for target prefixes for each image
-	for (i=0; i<num_images; i++)
+	return dfusefile;
+}
+
+/*
+	dfuse_grow() makes room for one more entry in an array of count
+	entries of size bytes out of the arena. Its capacity doubles at each
+	power of two, and the old copy is left behind with the rest of the
+	arena, so appending n entries costs log n copies. Returns NULL if
+	the doubled array won't fit in 32 bits.
+*/
+static void * dfuse_grow(dfuse_file * dfusefile, void * array, uint32_t size, uint32_t count)
+{
+	uint64_t bytes = (uint64_t)size * (count ? (uint64_t)count * 2 : 1);
+	void * grown;
+	
+	if ((count > 0) && (count & (count - 1)))
+		return array;
+	
+	if (bytes > UINT32_MAX)
+		return NULL;
+	
+	grown = dfuse_alloc(dfusefile, (uint32_t)bytes);
+	if ((NULL != grown) && (count > 0))
+		memcpy(grown, array, size * count);
+	
+	return grown;
+}
+
+/*
+	dfuse_addtarget() appends an empty target for alternate setting
+	alternate, and returns its index.
+*/
+int dfuse_addtarget(dfuse_file * dfusefile, uint8_t alternate)
+{
+	char * stmjunk = "abababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababababab";
+	int i = dfusefile->prefix->targets;
+	
+	dfusefile->images = (dfuse_image **)dfuse_grow(dfusefile, dfusefile->images, sizeof(dfuse_image *), i);
+	dfusefile->images[i] = (dfuse_image *)dfuse_alloc(dfusefile, sizeof(dfuse_image));
+	dfusefile->images[i]->tarprefix = (dfuse_target_prefix *)dfuse_alloc(dfusefile, sizeof(dfuse_target_prefix));
+	dfusefile->images[i]->imgelement = NULL;
+	
+	dfusefile->images[i]->tarprefix->signature[0] = 'T';
+	dfusefile->images[i]->tarprefix->signature[1] = 'a';
+	dfusefile->images[i]->tarprefix->signature[2] = 'r';
+	dfusefile->images[i]->tarprefix->signature[3] = 'g';
+	dfusefile->images[i]->tarprefix->signature[4] = 'e';
+	dfusefile->images[i]->tarprefix->signature[5] = 't';
+	dfusefile->images[i]->tarprefix->alternate_setting = alternate;
+	dfusefile->images[i]->tarprefix->target_named = 1;
+	// 		strcpy(dfusefile->images[i]->tarprefix->target_name, "stm-arp-target-name");
+	strcpy(dfusefile->images[i]->tarprefix->target_name, stmjunk);
+	dfusefile->images[i]->tarprefix->target_size = 0;
+	dfusefile->images[i]->tarprefix->num_elements = 0;
+	
+	dfusefile->prefix->targets++;
+	dfusefile->prefix->dfu_image_size += STMDFU_TARPREFIXLEN;
+	
+	return i;
+}
+
+/*
+	dfuse_droptarget() only has to free what dfulz_unpack() decoded, the
+	target itself is left in the arena.
+*/
+void dfuse_droptarget(dfuse_file * dfusefile, int target)
+{
+	dfuse_image * image = dfusefile->images[target];
+	int j;
+	
+	for (j=0; j<image->tarprefix->num_elements; j++)
+		dfulz_drop(image->imgelement[j]);
+	
+	memmove(&dfusefile->images[target], &dfusefile->images[target+1],
+			sizeof(dfuse_image *) * (dfusefile->prefix->targets - target - 1));
+	dfusefile->prefix->targets--;
+}
+
+/*
+	dfuse_addelement() appends an element at address to target, sized
+	to hold the binary image in binfile, and returns its index. The
+	image itself is read in with dfuse_readbin().
+*/
+int dfuse_addelement(dfuse_file * dfusefile, int target, uint32_t address, int binfile)
+{
+	uint32_t size;
+	struct stat stat;
+	
+	fstat(binfile, &stat);
+	size = stat.st_size;
+	
+	return dfuse_addelement_data(dfusefile, target, address, (uint8_t *)dfuse_alloc(dfusefile, size), size);
+}
+
+/*
+	dfuse_addelement_data() appends an element at address to target
+	whose data is size bytes at data, and returns its index.
+*/
+int dfuse_addelement_data(dfuse_file * dfusefile, int target, uint32_t address, uint8_t * data, uint32_t size)
+{
+	dfuse_image * image = dfusefile->images[target];
+	int j = image->tarprefix->num_elements;
+	
+	image->imgelement = (dfuse_image_element **)dfuse_grow(dfusefile, image->imgelement, sizeof(dfuse_image_element *), j);
+	image->imgelement[j] = (dfuse_image_element *)dfuse_alloc(dfusefile, sizeof(dfuse_image_element));
+	image->imgelement[j]->element_address = address;
+	image->imgelement[j]->element_size = size;
+	image->imgelement[j]->data = data;
+	
+	image->tarprefix->num_elements++;
+	image->tarprefix->target_size += size +
+	sizeof(image->imgelement[j]->element_address) +
+	sizeof(image->imgelement[j]->element_size);
+	
+	dfusefile->prefix->dfu_image_size += size +
+	sizeof(image->imgelement[j]->element_address) +
+	sizeof(image->imgelement[j]->element_size);
+	
+	return j;
+}
+
+/*
+	dfuse_init() allocates memory for the various dfuse structs
+	that make up the dfuse file, and populates fields that are
+	independent of the firmware image. The file has one target
+	with one element, for binfile at the start of flash.
+*/
+dfuse_file * dfuse_init(int binfile)
+{
+	dfuse_file * dfusefile = dfuse_new();
+	
+	dfuse_addtarget(dfusefile, 0);
+	dfuse_addelement(dfusefile, 0, 0x08000000, binfile);
+	
+	return dfusefile;
+}
+
+/*
+	dfuse_newelements() gives image room for count elements, in one
+	zeroed block out of the arena, with its imgelement pointers at
+	them. count comes from the file, so the sizes are worked out in 64
+	bits; returns -1 if they don't fit in the arena's 32.
+*/
+static int dfuse_newelements(dfuse_file * dfusefile, dfuse_image * image, uint32_t count)
+{
+	dfuse_image_element * elements;
+	uint32_t j;
+	
+	if ((uint64_t)sizeof(dfuse_image_element) * count > UINT32_MAX)
+		return -1;
+	
+	elements = (dfuse_image_element *)dfuse_alloc(dfusefile, sizeof(dfuse_image_element) * count);
+	image->imgelement = (dfuse_image_element **)dfuse_alloc(dfusefile, sizeof(dfuse_image_element *) * count);
+	if ((NULL == elements) || (NULL == image->imgelement))
+		return -1;
+	
+	for (j=0; j<count; j++)
+		image->imgelement[j] = &elements[j];
+	
+	return 0;
+}
+
+/*
+	dfuse_load() reads a whole dfuse file into memory, one field at a
+	time, copying each element's data into its own buffer.
+*/
+dfuse_file * dfuse_load(const char * file)
+{
+	int i,j;
+	
+	int dfufile = open(file, O_RDONLY);
+	if (dfufile < 0)
 	{
-		dfusefile->images[i]->tarprefix->signature[0] = 'T';
-		dfusefile->images[i]->tarprefix->signature[1] = 'a';
-		dfusefile->images[i]->tarprefix->signature[2] = 'r';
-		dfusefile->images[i]->tarprefix->signature[3] = 'g';
-		dfusefile->images[i]->tarprefix->signature[4] = 'e';
-		dfusefile->images[i]->tarprefix->signature[5] = 't';
-		dfusefile->images[i]->tarprefix->alternate_setting = 0;
-		dfusefile->images[i]->tarprefix->target_named = 1;
-		// 		strcpy(dfusefile->images[i]->tarprefix->target_name, "stm-arp-target-name");
-		strcpy(dfusefile->images[i]->tarprefix->target_name, stmjunk);
+		printf("error opening <%s>\n", file);
+		return NULL;
 	}
 	
-	//set more values assuming just 1 image and 1 image element
-	dfusefile->prefix->targets = 1;
+	dfuse_file * dfusefile = dfuse_new();
+	
+	dfuse_readprefix(dfusefile, dfufile);
 	
-	for (i=0; i<num_images; i++)
+	dfusefile->images = (dfuse_image **)dfuse_alloc(dfusefile, sizeof(dfuse_image *) * dfusefile->prefix->targets);
+	for (i=0; i<dfusefile->prefix->targets; i++)
 	{
-		dfusefile->images[i]->tarprefix->num_elements = 1;
+		dfusefile->images[i] = (dfuse_image *)dfuse_alloc(dfusefile, sizeof(dfuse_image));
+		dfusefile->images[i]->tarprefix = (dfuse_target_prefix *)dfuse_alloc(dfusefile, sizeof(dfuse_target_prefix));
+		
+		dfuse_readtarprefix(dfusefile, dfufile, i);
+		
+		//nothing here is checked against the file's length, so a bad
+		//count or size can ask for more than the arena can give
+		if (0 != dfuse_newelements(dfusefile, dfusefile->images[i], dfusefile->images[i]->tarprefix->num_elements))
+		{
+			printf("<%s>: target %d has too many elements\n", file, i);
+			dfusefile->images[i]->tarprefix->num_elements = 0;
+			dfusefile->prefix->targets = i + 1;
+			close(dfufile);
+			dfuse_struct_cleanup(dfusefile);
+			return NULL;
+		}
+		
+		for (j=0; j<dfusefile->images[i]->tarprefix->num_elements; j++)
+		{
+			dfuse_readimgelement_meta(dfusefile, dfufile, i, j);
+			dfusefile->images[i]->imgelement[j]->data = (uint8_t *)dfuse_alloc(dfusefile, dfusefile->images[i]->imgelement[j]->element_size);
+			if (NULL == dfusefile->images[i]->imgelement[j]->data)
+			{
+				printf("<%s>: element %d of target %d is too big\n", file, j, i);
+				dfusefile->images[i]->tarprefix->num_elements = j;
+				dfusefile->prefix->targets = i + 1;
+				close(dfufile);
+				dfuse_struct_cleanup(dfusefile);
+				return NULL;
+			}
+			dfuse_readimgelement_data(dfusefile, dfufile, i, j);
+		}
 	}
 	
-	fstat(binfile, &stat);
+	dfuse_readsuffix(dfusefile, dfufile);
 	
-	dfusefile->images[0]->tarprefix->target_size = stat.st_size +
-	sizeof(dfusefile->images[0]->imgelement[0]->element_address) +
-	sizeof(dfusefile->images[0]->imgelement[0]->element_size);
+	close(dfufile);
 	
-	dfusefile->images[0]->imgelement[0]->element_address = 0x08000000;
-	dfusefile->images[0]->imgelement[0]->element_size = stat.st_size;
-	dfusefile->images[0]->imgelement[0]->data = (int8_t *)malloc(sizeof(int8_t) * dfusefile->images[0]->imgelement[0]->element_size);
+	//the crc was taken as the file was read, see dfuse_map() for
+	//the two forms it can take
+	if ((dfusefile->suffix->crc != chksum_crc32_final(dfusefile->crc)) &&
+		(dfusefile->suffix->crc != dfusefile->crc))
+	{
+		printf("<%s>: crc mismatch\n", file);
+		dfuse_struct_cleanup(dfusefile);
+		return NULL;
+	}
 	
-	//From looking at dfuse file generated by STM's dfuse packager,
-	//the image size does not include the standard DFU suffix
-	// 	dfusefile->prefix->dfu_image_size = STMDFU_PREFIXLEN + STMDFU_SUFFIXLEN;
-	dfusefile->prefix->dfu_image_size = STMDFU_PREFIXLEN;
-	dfusefile->prefix->dfu_image_size += STMDFU_TARPREFIXLEN * num_images;
-	for (i=0; i<num_images; i++)
+	return dfusefile;
+}
+
+/*
+	dfuse_pread() reads count bytes at offset in file, however many
+	reads it takes. Returns 0 if it got them all.
+*/
+static int dfuse_pread(int dfufile, void * buf, uint32_t count, uint32_t offset)
+{
+	ssize_t ct;
+	
+	while (count > 0)
+	{
+		ct = pread(dfufile, buf, count, offset);
+		if (ct <= 0)
+			return -1;
+		buf = (uint8_t *)buf + ct;
+		count -= ct;
+		offset += ct;
+	}
+	
+	return 0;
+}
+
+/*
+	dfuse_read_map() and dfuse_read_fd() are dfuse_read_at callbacks,
+	copying a header out of the mapping (memcpy, since the packed
+	fields are unaligned in the file) or reading it from the open file.
+*/
+static int dfuse_read_map(dfuse_file * dfusefile, void * buf, uint32_t count, uint32_t offset)
+{
+	if ((uint64_t)offset + count > dfusefile->maplength)
+		return -1;
+	
+	memcpy(buf, &dfusefile->map[offset], count);
+	return 0;
+}
+
+static int dfuse_read_fd(dfuse_file * dfusefile, void * buf, uint32_t count, uint32_t offset)
+{
+	return dfuse_pread(dfusefile->fd, buf, count, offset);
+}
+
+/*
+	dfuse_walk() reads the prefix, every target prefix and element
+	header, and the suffix of a file of length bytes with read_at,
+	checking every signature and size against the image size and the
+	length of the file as it goes. Each element's size and the offset
+	of its data are filled in, the data itself is left to the caller.
+	Returns 0 if the layout is sound, having printed why if it isn't.
+*/
+static int dfuse_walk(dfuse_file * dfusefile, const char * file, uint32_t length, dfuse_read_at read_at)
+{
+	dfuse_target_prefix * tarprefix;
+	dfuse_image_element * element;
+	uint8_t header[STMDFU_TARPREFIXLEN];
+	uint32_t end, offset, target_end;
+	int ntargets;
+	int i, j, k;
+	
+	if (0 != read_at(dfusefile, header, STMDFU_PREFIXLEN, 0))
+	{
+		printf("error reading <%s>\n", file);
+		return -1;
+	}
+	
+	memcpy(dfusefile->prefix->signature, &header[0], 5);
+	dfusefile->prefix->version = header[5];
+	memcpy(&dfusefile->prefix->dfu_image_size, &header[6], 4);
+	dfusefile->prefix->targets = 0;
+	ntargets = header[10];
+	
+	//the image size doesn't count the suffix, and has to at least
+	//count the prefix, or every end - offset below wraps around
+	end = length - STMDFU_SUFFIXLEN;
+	if ((memcmp(dfusefile->prefix->signature, "DfuSe", 5) && memcmp(dfusefile->prefix->signature, DFULZ_SIGNATURE, 5)) ||
+		(dfusefile->prefix->version != 0x01) ||
+		(dfusefile->prefix->dfu_image_size < STMDFU_PREFIXLEN) ||
+		(dfusefile->prefix->dfu_image_size > end))
+	{
+		printf("<%s>: bad dfuse prefix\n", file);
+		return -1;
+	}
+	end = dfusefile->prefix->dfu_image_size;
+	
+	dfusefile->images = (dfuse_image **)dfuse_alloc(dfusefile, sizeof(dfuse_image *) * ntargets);
+	offset = STMDFU_PREFIXLEN;
+	
+	for (i=0; i<ntargets; i++)
+	{
+		if ((end - offset < STMDFU_TARPREFIXLEN) ||
+			(0 != read_at(dfusefile, header, STMDFU_TARPREFIXLEN, offset)))
+		{
+			printf("<%s>: target %d is truncated\n", file, i);
+			return -1;
+		}
+		
+		dfusefile->images[i] = (dfuse_image *)dfuse_alloc(dfusefile, sizeof(dfuse_image));
+		dfusefile->images[i]->tarprefix = tarprefix = (dfuse_target_prefix *)dfuse_alloc(dfusefile, sizeof(dfuse_target_prefix));
+		
+		memcpy(tarprefix->signature, &header[0], 6);
+		tarprefix->alternate_setting = header[6];
+		memcpy(&tarprefix->target_named, &header[7], 4);
+		memcpy(tarprefix->target_name, &header[11], 255);
+		memcpy(&tarprefix->target_size, &header[266], 4);
+		memcpy(&tarprefix->num_elements, &header[270], 4);
+		offset += STMDFU_TARPREFIXLEN;
+		
+		//counted from here on, so cleanup only sees elements that were read
+		k = tarprefix->num_elements;
+		tarprefix->num_elements = 0;
+		dfusefile->prefix->targets++;
+		
+		if (memcmp(tarprefix->signature, "Target", 6) || (tarprefix->target_size > end - offset) ||
+			(k > tarprefix->target_size / 8))
+		{
+			printf("<%s>: bad target prefix %d\n", file, i);
+			return -1;
+		}
+		target_end = offset + tarprefix->target_size;
+		
+		if (0 != dfuse_newelements(dfusefile, dfusefile->images[i], k))
+		{
+			printf("<%s>: out of memory for target %d\n", file, i);
+			return -1;
+		}
+		for (j=0; j<k; j++)
+		{
+			element = dfusefile->images[i]->imgelement[tarprefix->num_elements++];
+			
+			if ((target_end - offset < 8) || (end - offset < 8) ||
+				(0 != read_at(dfusefile, header, 8, offset)))
+			{
+				break;
+			}
+			
+			memcpy(&element->element_address, &header[0], 4);
+			memcpy(&element->element_size, &header[4], 4);
+			offset += 8;
+			
+			if ((element->element_size > target_end - offset) || (element->element_size > end - offset))
+				break;
+			
+			element->offset = offset;
+			offset += element->element_size;
+		}
+		
+		if (j < k)
+		{
+			printf("<%s>: element %d of target %d is truncated\n", file, j, i);
+			return -1;
+		}
+		
+		if (offset != target_end)
+		{
+			printf("<%s>: target %d size doesn't match its elements\n", file, i);
+			return -1;
+		}
+	}
+	
+	//the suffix is the last 16 bytes of the file
+	if (0 != read_at(dfusefile, header, STMDFU_SUFFIXLEN, length - STMDFU_SUFFIXLEN))
+	{
+		printf("error reading <%s>\n", file);
+		return -1;
+	}
+	
+	memcpy(&dfusefile->suffix->device_low, &header[0], 8);
+	memcpy(dfusefile->suffix->dfu_signature, &header[8], 3);
+	dfusefile->suffix->suffix_length = header[11];
+	memcpy(&dfusefile->suffix->crc, &header[12], 4);
+	
+	if (memcmp(dfusefile->suffix->dfu_signature, "UFD", 3) || (dfusefile->suffix->suffix_length != STMDFU_SUFFIXLEN))
+	{
+		printf("<%s>: bad dfu suffix\n", file);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+	dfuse_map() maps a dfuse file and walks it once (see dfuse_walk()),
+	then checks the suffix crc over the whole mapping. Element data is
+	left where it is in the mapping.
+*/
+dfuse_file * dfuse_map(const char * file)
+{
+	dfuse_file * dfusefile;
+	dfuse_image_element * element;
+	struct stat stat;
+	uint8_t * map;
+	uint32_t length;
+	uint32_t crc;
+	int packed;
+	int i, k;
+	
+	int dfufile = open(file, O_RDONLY);
+	if (dfufile < 0)
+	{
+		printf("error opening <%s>\n", file);
+		return NULL;
+	}
+	
+	if ((0 != fstat(dfufile, &stat)) || !S_ISREG(stat.st_mode) ||
+		(stat.st_size < STMDFU_PREFIXLEN + STMDFU_SUFFIXLEN) || (stat.st_size > 0xffffffff))
+	{
+		printf("<%s> isn't a dfuse file\n", file);
+		close(dfufile);
+		return NULL;
+	}
+	length = stat.st_size;
+	
+	map = (uint8_t *)mmap(NULL, length, PROT_READ, MAP_PRIVATE, dfufile, 0);
+	close(dfufile);
+	if (MAP_FAILED == map)
+	{
+		printf("error mapping <%s>\n", file);
+		return NULL;
+	}
+	
+	dfusefile = dfuse_new();
+	dfusefile->map = map;
+	dfusefile->maplength = length;
+	
+	if (0 != dfuse_walk(dfusefile, file, length, dfuse_read_map))
+	{
+		dfuse_struct_cleanup(dfusefile);
+		return NULL;
+	}
+	
+	//bintodfu has always stored the finished (inverted) crc, the DFU
+	//spec and ST's tools store it without the final inversion
+	crc = chksum_crc32(map, length - 4);
+	if ((dfusefile->suffix->crc != crc) && (dfusefile->suffix->crc != ~crc))
 	{
-		dfusefile->prefix->dfu_image_size += dfusefile->images[i]->tarprefix->target_size;
+		printf("<%s>: crc mismatch, the file says 0x%.8x but its contents give 0x%.8x\n",
+				file, dfusefile->suffix->crc, crc);
+		dfuse_struct_cleanup(dfusefile);
+		return NULL;
+	}
+	
+	//a packed file's elements are stored packed, the sizes that matter
+	//from here on are their flash sizes
+	packed = !memcmp(dfusefile->prefix->signature, DFULZ_SIGNATURE, 5);
+	for (i=0; i<dfusefile->prefix->targets; i++)
+	{
+		for (k=0; k<dfusefile->images[i]->tarprefix->num_elements; k++)
+		{
+			element = dfusefile->images[i]->imgelement[k];
+			if (!packed)
+			{
+				element->data = &map[element->offset];
+				continue;
+			}
+			
+			element->packed = &map[element->offset];
+			element->packed_size = element->element_size;
+			
+			if (0 != dfulz_check(element->packed, element->packed_size, &element->element_size))
+			{
+				printf("<%s>: element %d of target %d isn't packed properly\n", file, k, i);
+				dfuse_struct_cleanup(dfusefile);
+				return NULL;
+			}
+		}
 	}
 	
 	return dfusefile;
 }
 
 /*
-	dfuse_readbin() reads the binary firmware image into memory
+	dfuse_index() makes the same checks as dfuse_map() (see dfuse_walk()),
+	but reads each header with its own pread() and only notes where
+	element data is. A packed element's flash size is the first thing in
+	its data, so that much more is read for each of those.
 */
-void dfuse_readbin(dfuse_file * dfusefile, int binfile)
+dfuse_file * dfuse_index(const char * file)
+{
+	dfuse_file * dfusefile;
+	dfuse_image_element * element;
+	struct stat stat;
+	uint32_t length;
+	int i, k;
+	
+	int dfufile = open(file, O_RDONLY);
+	if (dfufile < 0)
+	{
+		printf("error opening <%s>\n", file);
+		return NULL;
+	}
+	
+	if ((0 != fstat(dfufile, &stat)) || !S_ISREG(stat.st_mode) ||
+		(stat.st_size < STMDFU_PREFIXLEN + STMDFU_SUFFIXLEN) || (stat.st_size > 0xffffffff))
+	{
+		printf("<%s> isn't a dfuse file\n", file);
+		close(dfufile);
+		return NULL;
+	}
+	length = stat.st_size;
+	
+	dfusefile = dfuse_new();
+	dfusefile->fd = dfufile;
+	
+	if (0 != dfuse_walk(dfusefile, file, length, dfuse_read_fd))
+	{
+		dfuse_struct_cleanup(dfusefile);
+		return NULL;
+	}
+	
+	//the rest of a packed element is checked when it's loaded
+	if (!memcmp(dfusefile->prefix->signature, DFULZ_SIGNATURE, 5))
+	{
+		for (i=0; i<dfusefile->prefix->targets; i++)
+		{
+			for (k=0; k<dfusefile->images[i]->tarprefix->num_elements; k++)
+			{
+				element = dfusefile->images[i]->imgelement[k];
+				element->packed_size = element->element_size;
+				if ((element->packed_size < DFULZ_HEADERLEN) ||
+					(0 != dfuse_pread(dfufile, &element->element_size, 4, element->offset)))
+				{
+					printf("<%s>: element %d of target %d is truncated\n", file, k, i);
+					dfuse_struct_cleanup(dfusefile);
+					return NULL;
+				}
+			}
+		}
+	}
+	
+	return dfusefile;
+}
+
+int dfuse_load_element(dfuse_file * dfusefile, dfuse_image_element * element)
+{
+	uint32_t size;
+	
+	if ((dfusefile->fd < 0) || (NULL != element->data) || (NULL != element->packed))
+		return 0;
+	
+	if (!memcmp(dfusefile->prefix->signature, DFULZ_SIGNATURE, 5))
+	{
+		element->packed = (uint8_t *)dfuse_alloc(dfusefile, element->packed_size);
+		if ((NULL == element->packed) ||
+			(0 != dfuse_pread(dfusefile->fd, element->packed, element->packed_size, element->offset)) ||
+			(0 != dfulz_check(element->packed, element->packed_size, &size)) ||
+			(size != element->element_size))
+		{
+			printf("packed element at 0x%.8x can't be read or isn't packed properly\n", element->element_address);
+			element->packed = NULL;
+			return -1;
+		}
+	
+		return 0;
+	}
+	
+	element->data = (uint8_t *)dfuse_alloc(dfusefile, element->element_size ? element->element_size : 1);
+	if ((NULL == element->data) ||
+		(0 != dfuse_pread(dfusefile->fd, element->data, element->element_size, element->offset)))
+	{
+		printf("element at 0x%.8x can't be read\n", element->element_address);
+		element->data = NULL;
+		return -1;
+	}
+	
+	return 0;
+}
+
+int dfuse_load_elements(dfuse_file * dfusefile)
 {
 	int i, j;
 	
-	//read binary into data array
-	i = read(binfile, &dfusefile->images[0]->imgelement[0]->data[0], READBIN_READLEN);
+	for (i=0; i<dfusefile->prefix->targets; i++)
+	{
+		for (j=0; j<dfusefile->images[i]->tarprefix->num_elements; j++)
+		{
+			if (0 != dfuse_load_element(dfusefile, dfusefile->images[i]->imgelement[j]))
+				return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+	dfuse_readbin() reads the binary firmware image into memory, as
+	much at a time as read() will hand over
+*/
+void dfuse_readbin(dfuse_file * dfusefile, int binfile, int target, int element)
+{
+	dfuse_image_element * imgelement = dfusefile->images[target]->imgelement[element];
+	uint32_t got = 0;
+	ssize_t ct;
+	
+	while (got < imgelement->element_size)
+	{
+		ct = read(binfile, &imgelement->data[got], imgelement->element_size - got);
+		if (ct <= 0)
+			break;
+		got += ct;
+	}
+}
+
+/*
+	dfuse_mapbin() maps a regular file whole. Anything else is read
+	into a buffer that doubles in size whenever it fills, starting at
+	MAPBIN_CHUNK, so a pipe costs one read() per chunk the pipe hands
+	over rather than one per few bytes.
+*/
+uint8_t * dfuse_mapbin(int binfile, uint32_t * size, int * mapped)
+{
+	struct stat stat;
+	uint8_t * data;
+	uint8_t * grown;
+	size_t length = 0;
+	size_t capacity = MAPBIN_CHUNK;
+	ssize_t ct;
+	
+	*mapped = 0;
+	
+	if (0 != fstat(binfile, &stat))
+		return NULL;
+	
+	if (S_ISREG(stat.st_mode) && (stat.st_size > 0))
+	{
+		if (stat.st_size > 0xffffffff)
+			return NULL;
+		
+		data = (uint8_t *)mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, binfile, 0);
+		if (MAP_FAILED == data)
+			return NULL;
+		
+		madvise(data, stat.st_size, MADV_SEQUENTIAL);
+		*size = stat.st_size;
+		*mapped = 1;
+		return data;
+	}
+	
+	data = (uint8_t *)malloc(capacity);
+	if (NULL == data)
+		return NULL;
+	
+	while (0 != (ct = read(binfile, &data[length], capacity - length)))
+	{
+		if (ct < 0)
+		{
+			free(data);
+			return NULL;
+		}
+		
+		length += ct;
+		if (length == capacity)
+		{
+			if (capacity > 0xffffffff / 2)
+			{
+				free(data);
+				return NULL;
+			}
+			
+			capacity *= 2;
+			grown = (uint8_t *)realloc(data, capacity);
+			if (NULL == grown)
+			{
+				free(data);
+				return NULL;
+			}
+			data = grown;
+		}
+	}
+	
+	*size = length;
+	return data;
+}
+
+/*
+	dfuse_unmapbin() releases what dfuse_mapbin() returned.
+*/
+void dfuse_unmapbin(uint8_t * data, uint32_t size, int mapped)
+{
+	if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+}
+
+/*
+	dfuse_writefile() lays the headers out in one buffer and points
+	an iovec at each header and each element's data where it already
+	sits, so the whole file goes out in a writev() or two with no
+	copying in between. The crc is run over the iovecs before they're
+	written, so the output is never read back and can be a pipe.
+*/
+int dfuse_writefile(dfuse_file * dfusefile, int dfufile)
+{
+	dfuse_target_prefix * tarprefix;
+	dfuse_image_element * element;
+	struct iovec * iov;
+	uint8_t * headers;
+	uint8_t * h;
+	uint32_t nelements = 0;
+	uint32_t niov = 0;
+	uint32_t i, first;
+	ssize_t ct;
+	int rv = 0;
+	int t, j;
+	
+	for (t=0; t<dfusefile->prefix->targets; t++)
+		nelements += dfusefile->images[t]->tarprefix->num_elements;
 	
-	//when read returns < READBIN_READLEN, we've hit EOF on previous read (or error...)
-	for (j=i; i==READBIN_READLEN; j+=READBIN_READLEN)
+	headers = (uint8_t *)malloc(STMDFU_PREFIXLEN + STMDFU_TARPREFIXLEN * dfusefile->prefix->targets +
+			8 * nelements + STMDFU_SUFFIXLEN);
+	iov = (struct iovec *)malloc(sizeof(struct iovec) * (2 + dfusefile->prefix->targets + 2 * nelements));
+	h = headers;
+	
+	//prefix
+	iov[niov].iov_base = h;
+	memcpy(h, dfusefile->prefix->signature, 5);
+	h[5] = dfusefile->prefix->version;
+	memcpy(&h[6], &dfusefile->prefix->dfu_image_size, 4);
+	h[10] = dfusefile->prefix->targets;
+	h += STMDFU_PREFIXLEN;
+	iov[niov].iov_len = h - (uint8_t *)iov[niov].iov_base;
+	niov++;
+	
+	for (t=0; t<dfusefile->prefix->targets; t++)
 	{
-		i = read(binfile, &dfusefile->images[0]->imgelement[0]->data[j], READBIN_READLEN);
+		tarprefix = dfusefile->images[t]->tarprefix;
+		
+		iov[niov].iov_base = h;
+		memcpy(h, tarprefix->signature, 6);
+		h[6] = tarprefix->alternate_setting;
+		memcpy(&h[7], &tarprefix->target_named, 4);
+		memcpy(&h[11], tarprefix->target_name, 255);
+		memcpy(&h[266], &tarprefix->target_size, 4);
+		memcpy(&h[270], &tarprefix->num_elements, 4);
+		h += STMDFU_TARPREFIXLEN;
+		iov[niov].iov_len = STMDFU_TARPREFIXLEN;
+		niov++;
+		
+		for (j=0; j<tarprefix->num_elements; j++)
+		{
+			element = dfusefile->images[t]->imgelement[j];
+			
+			iov[niov].iov_base = h;
+			memcpy(h, &element->element_address, 4);
+			memcpy(&h[4], &element->element_size, 4);
+			h += 8;
+			iov[niov].iov_len = 8;
+			niov++;
+			
+			iov[niov].iov_base = element->data;
+			iov[niov].iov_len = element->element_size;
+			niov++;
+		}
 	}
+	
+	//suffix, everything but the crc
+	iov[niov].iov_base = h;
+	memcpy(h, &dfusefile->suffix->device_low, 8);
+	memcpy(&h[8], dfusefile->suffix->dfu_signature, 3);
+	h[11] = dfusefile->suffix->suffix_length;
+	iov[niov].iov_len = STMDFU_SUFFIXLEN - 4;
+	niov++;
+	
+	dfusefile->crc = chksum_crc32_init();
+	for (i=0; i<niov; i++)
+		dfusefile->crc = chksum_crc32_update(dfusefile->crc, (const unsigned char *)iov[i].iov_base, iov[i].iov_len);
+	dfusefile->suffix->crc = chksum_crc32_final(dfusefile->crc);
+	
+	memcpy(&h[12], &dfusefile->suffix->crc, 4);
+	iov[niov-1].iov_len = STMDFU_SUFFIXLEN;
+	
+	//writev() takes at most IOV_MAX at a time, and may stop short on
+	//a pipe, so carry on from wherever it got to
+	first = 0;
+	while (first < niov)
+	{
+		ct = writev(dfufile, &iov[first], (niov - first > IOV_MAX) ? IOV_MAX : niov - first);
+		if (ct < 0)
+		{
+			rv = -1;
+			break;
+		}
+		
+		while ((first < niov) && (ct >= iov[first].iov_len))
+		{
+			ct -= iov[first].iov_len;
+			first++;
+		}
+		if (first < niov)
+		{
+			iov[first].iov_base = (uint8_t *)iov[first].iov_base + ct;
+			iov[first].iov_len -= ct;
+		}
+	}
+	
+	free(iov);
+	free(headers);
+	
+	return rv;
 }
 
 int dfuse_writeprefix(dfuse_file * dfusefile, int dfufile)
 {
 	int ct = 0;
 	
+	dfusefile->crc = chksum_crc32_init();
+	
 	ct = DFUWRITE(dfusefile->prefix->signature);
 	ct += DFUWRITE(dfusefile->prefix->version);
 	ct += DFUWRITE(dfusefile->prefix->dfu_image_size);
@@ -154,6 +994,8 @@ int dfuse_readprefix(dfuse_file * dfusefile, int dfufile)
 {
 	int ct = 0;
 	
+	dfusefile->crc = chksum_crc32_init();
+	
 	ct = DFUREAD(dfusefile->prefix->signature);
 	ct += DFUREAD(dfusefile->prefix->version);
 	ct += DFUREAD(dfusefile->prefix->dfu_image_size);
@@ -165,16 +1007,16 @@ int dfuse_readprefix(dfuse_file * dfusefile, int dfufile)
 	return ct;
 }
 
-int dfuse_writetarprefix(dfuse_file * dfusefile, int dfufile)
+int dfuse_writetarprefix(dfuse_file * dfusefile, int dfufile, int target)
 {
 	int ct = 0;
 	
-	ct = DFUWRITE(dfusefile->images[0]->tarprefix->signature);
-	ct += DFUWRITE(dfusefile->images[0]->tarprefix->alternate_setting);
-	ct += DFUWRITE(dfusefile->images[0]->tarprefix->target_named);
-	ct += DFUWRITE(dfusefile->images[0]->tarprefix->target_name);
-	ct += DFUWRITE(dfusefile->images[0]->tarprefix->target_size);
-	ct += DFUWRITE(dfusefile->images[0]->tarprefix->num_elements);
+	ct = DFUWRITE(dfusefile->images[target]->tarprefix->signature);
+	ct += DFUWRITE(dfusefile->images[target]->tarprefix->alternate_setting);
+	ct += DFUWRITE(dfusefile->images[target]->tarprefix->target_named);
+	ct += DFUWRITE(dfusefile->images[target]->tarprefix->target_name);
+	ct += DFUWRITE(dfusefile->images[target]->tarprefix->target_size);
+	ct += DFUWRITE(dfusefile->images[target]->tarprefix->num_elements);
 	
 	if (ct != STMDFU_TARPREFIXLEN)
 		ct = -1;
@@ -182,16 +1024,16 @@ int dfuse_writetarprefix(dfuse_file * dfusefile, int dfufile)
 	return ct;
 }
 
-int dfuse_readtarprefix(dfuse_file * dfusefile, int dfufile)
+int dfuse_readtarprefix(dfuse_file * dfusefile, int dfufile, int target)
 {
 	int ct = 0;
 	
-	ct = DFUREAD(dfusefile->images[0]->tarprefix->signature);
-	ct += DFUREAD(dfusefile->images[0]->tarprefix->alternate_setting);
-	ct += DFUREAD(dfusefile->images[0]->tarprefix->target_named);
-	ct += DFUREAD(dfusefile->images[0]->tarprefix->target_name);
-	ct += DFUREAD(dfusefile->images[0]->tarprefix->target_size);
-	ct += DFUREAD(dfusefile->images[0]->tarprefix->num_elements);
+	ct = DFUREAD(dfusefile->images[target]->tarprefix->signature);
+	ct += DFUREAD(dfusefile->images[target]->tarprefix->alternate_setting);
+	ct += DFUREAD(dfusefile->images[target]->tarprefix->target_named);
+	ct += DFUREAD(dfusefile->images[target]->tarprefix->target_name);
+	ct += DFUREAD(dfusefile->images[target]->tarprefix->target_size);
+	ct += DFUREAD(dfusefile->images[target]->tarprefix->num_elements);
 	
 	if (ct != STMDFU_TARPREFIXLEN)
 		ct = -1;
@@ -199,22 +1041,22 @@ int dfuse_readtarprefix(dfuse_file * dfusefile, int dfufile)
 	return ct;
 }
 
-int dfuse_writeimgelement(dfuse_file * dfusefile, int dfufile)
+int dfuse_writeimgelement(dfuse_file * dfusefile, int dfufile, int target, int element)
 {
 	int j;
 	int ct = 0;
 	
-	ct += DFUWRITE(dfusefile->images[0]->imgelement[0]->element_address);
-	ct += DFUWRITE(dfusefile->images[0]->imgelement[0]->element_size);
-	ct += write(dfufile, dfusefile->images[0]->imgelement[0]->data, dfusefile->images[0]->imgelement[0]->element_size);
-// 	for (j=0; j<dfusefile->images[0]->imgelement[0]->element_size; j++)
+	ct += DFUWRITE(dfusefile->images[target]->imgelement[element]->element_address);
+	ct += DFUWRITE(dfusefile->images[target]->imgelement[element]->element_size);
+	ct += dfuse_write(dfusefile, dfufile, dfusefile->images[target]->imgelement[element]->data, dfusefile->images[target]->imgelement[element]->element_size);
+// 	for (j=0; j<dfusefile->images[target]->imgelement[element]->element_size; j++)
 // 	{
-// 		ct += write(dfufile, &dfusefile->images[0]->imgelement[0]->data[j], 1);
+// 		ct += write(dfufile, &dfusefile->images[target]->imgelement[element]->data[j], 1);
 // 	}
 	
-	if (ct != dfusefile->images[0]->imgelement[0]->element_size + \
-		sizeof(dfusefile->images[0]->imgelement[0]->element_address) + \
-		sizeof(dfusefile->images[0]->imgelement[0]->element_size))
+	if (ct != dfusefile->images[target]->imgelement[element]->element_size + \
+		sizeof(dfusefile->images[target]->imgelement[element]->element_address) + \
+		sizeof(dfusefile->images[target]->imgelement[element]->element_size))
 	{
 		ct = -1;
 	}
@@ -222,15 +1064,15 @@ int dfuse_writeimgelement(dfuse_file * dfusefile, int dfufile)
 	return ct;
 }
 
-int dfuse_readimgelement_meta(dfuse_file * dfusefile, int dfufile)
+int dfuse_readimgelement_meta(dfuse_file * dfusefile, int dfufile, int target, int element)
 {
 	int ct = 0;
 	
-	ct += DFUREAD(dfusefile->images[0]->imgelement[0]->element_address);
-	ct += DFUREAD(dfusefile->images[0]->imgelement[0]->element_size);
+	ct += DFUREAD(dfusefile->images[target]->imgelement[element]->element_address);
+	ct += DFUREAD(dfusefile->images[target]->imgelement[element]->element_size);
 	
-	if (ct != sizeof(dfusefile->images[0]->imgelement[0]->element_address) + \
-		sizeof(dfusefile->images[0]->imgelement[0]->element_size))
+	if (ct != sizeof(dfusefile->images[target]->imgelement[element]->element_address) + \
+		sizeof(dfusefile->images[target]->imgelement[element]->element_size))
 	{
 		ct = -1;
 	}
@@ -238,13 +1080,13 @@ int dfuse_readimgelement_meta(dfuse_file * dfusefile, int dfufile)
 	return ct;
 }
 
-int dfuse_readimgelement_data(dfuse_file * dfusefile, int dfufile)
+int dfuse_readimgelement_data(dfuse_file * dfusefile, int dfufile, int target, int element)
 {
 	int ct = 0;
 	
-	ct += read(dfufile, dfusefile->images[0]->imgelement[0]->data, dfusefile->images[0]->imgelement[0]->element_size);
+	ct += dfuse_read(dfusefile, dfufile, dfusefile->images[target]->imgelement[element]->data, dfusefile->images[target]->imgelement[element]->element_size);
 	
-	if (ct != dfusefile->images[0]->imgelement[0]->element_size)
+	if (ct != dfusefile->images[target]->imgelement[element]->element_size)
 	{
 		ct = -1;
 	}
@@ -267,9 +1109,9 @@ int dfuse_writesuffix(dfuse_file * dfusefile, int dfufile)
 	ct += DFUWRITE(dfusefile->suffix->dfu_signature);
 	ct += DFUWRITE(dfusefile->suffix->suffix_length);
 	
-	calccrc(dfusefile, dfufile);
-	
-	ct += DFUWRITE(dfusefile->suffix->crc);
+	//the crc covers everything but itself
+	dfusefile->suffix->crc = chksum_crc32_final(dfusefile->crc);
+	ct += write(dfufile, &dfusefile->suffix->crc, sizeof(dfusefile->suffix->crc));
 	
 	if (ct != STMDFU_SUFFIXLEN)
 		ct = -1;
@@ -291,7 +1133,7 @@ int dfuse_readsuffix(dfuse_file * dfusefile, int dfufile)
 	ct += DFUREAD(dfusefile->suffix->dfu_high);
 	ct += DFUREAD(dfusefile->suffix->dfu_signature);
 	ct += DFUREAD(dfusefile->suffix->suffix_length);	
-	ct += DFUREAD(dfusefile->suffix->crc);
+	ct += read(dfufile, &dfusefile->suffix->crc, sizeof(dfusefile->suffix->crc));
 	
 	if (ct != STMDFU_SUFFIXLEN)
 		ct = -1;
@@ -300,66 +1142,159 @@ int dfuse_readsuffix(dfuse_file * dfusefile, int dfufile)
 }
 
 /*
-	calccrc() calculates a 32 bit CRC to go in the
-	suffix of the dfuse file
+	dfuse_write() and dfuse_read() fold only the bytes that actually
+	made it into the running crc, a short write or read leaves the crc
+	matching what's in the file.
+*/
+ssize_t dfuse_write(dfuse_file * dfusefile, int dfufile, const void * buf, size_t count)
+{
+	ssize_t ct = write(dfufile, buf, count);
+	
+	if (ct > 0)
+		dfusefile->crc = chksum_crc32_update(dfusefile->crc, (const unsigned char *)buf, ct);
+	
+	return ct;
+}
+
+ssize_t dfuse_read(dfuse_file * dfusefile, int dfufile, void * buf, size_t count)
+{
+	ssize_t ct = read(dfufile, buf, count);
+	
+	if (ct > 0)
+		dfusefile->crc = chksum_crc32_update(dfusefile->crc, (const unsigned char *)buf, ct);
+	
+	return ct;
+}
+
+/*
+	dfuse_isblank() returns 1 if all length bytes of data are 0xff.
+	
+	The bulk of the buffer is checked 64 bytes at a time by AND-ing
+	eight 64 bit words together, which the compiler turns into vector
+	loads and compares; a blank page costs a few dozen instructions.
+*/
+int dfuse_isblank(const uint8_t * data, uint32_t length)
+{
+	uint64_t words[8];
+	uint64_t acc;
+	uint32_t i = 0;
+	int j;
+	
+	for (; i+64 <= length; i+=64)
+	{
+		memcpy(words, &data[i], 64);
+		acc = ~(uint64_t)0;
+		for (j=0; j<8; j++)
+		{
+			acc &= words[j];
+		}
+		if (acc != ~(uint64_t)0)
+			return 0;
+	}
+	
+	for (; i<length; i++)
+	{
+		if (data[i] != 0xff)
+			return 0;
+	}
+	
+	return 1;
+}
+
+/*
+	dfuse_pagehash() returns a 64 bit FNV-1a hash of length bytes of
+	data, used to tell whether a flash page's contents have changed.
 */
-void calccrc(dfuse_file * dfusefile, int dfufile)
-{
-	char * crcbuf;
-	
-	chksum_crc32gentab();
-	
-	// 	int offset1 = 0;
-	// 	int offset2 = STMDFU_PREFIXLEN - 1;
-	// 	int offset3 = STMDFU_PREFIXLEN + STMDFU_TARPREFIXLEN - 1;
-	// 	int offset4 = STMDFU_PREFIXLEN + STMDFU_TARPREFIXLEN + 8 - 1;
-	// 	
-	// 	lseek(dfufile, 0, SEEK_SET);
-	// 	crcbuf = (char *)malloc(sizeof(char)*fptr);
-	// 	if (fptr != read(dfufile, crcbuf, fptr))
-	// 		printf("UHOHHHHH\n");
-	// 	lseek(dfufile, 0, SEEK_END);
-	// 	u_int32_t crc1 = chksum_crc32(&crcbuf[offset1], (fptr-offset1));
-	// 	u_int32_t crc2 = chksum_crc32(&crcbuf[offset2], (fptr-offset2+1));
-	// 	u_int32_t crc3 = chksum_crc32(&crcbuf[offset3], (fptr-offset3+1));
-	// 	u_int32_t crc4 = chksum_crc32(&crcbuf[offset4], (fptr-offset4+1));
-	// 	dfusefile->suffix->crc = 13;
-	// 	free(crcbuf);
-	// 	
-	// 	printf("<%x>%d :: <%x>%d :: <%x>%d :: <%x>%d of %d\n", crc1, offset1, crc2, offset2, crc3, offset3, crc4, offset4, fptr);
-	
-	
-	lseek(dfufile, 0, SEEK_SET);
-	crcbuf = (char *)malloc(sizeof(char)*(dfusefile->prefix->dfu_image_size+12));
-	if ((dfusefile->prefix->dfu_image_size+12) !=read(dfufile, crcbuf, (dfusefile->prefix->dfu_image_size+12)))
-		printf("UHOHHHHHHHH\n");
-	lseek(dfufile, 0, SEEK_END);
-	dfusefile->suffix->crc = chksum_crc32(crcbuf, (dfusefile->prefix->dfu_image_size+12));
-	free(crcbuf);
+uint64_t dfuse_pagehash(const uint8_t * data, uint32_t length)
+{
+	return dfuse_pagehash_update(DFUSE_PAGEHASH_INIT, data, length);
+}
+
+uint64_t dfuse_pagehash_update(uint64_t hash, const uint8_t * data, uint32_t length)
+{
+	uint32_t i;
+	
+	for (i=0; i<length; i++)
+	{
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	
+	return hash;
 }
 
 /*
-	dfuse_struct_cleanup() deallocates the dfuse file
-	structures
+	dfuse_delta_name() and dfuse_delta_parse() use a plain text name,
+	e.g. "stmdfu delta 0x08000000+0x000186a0 page 0x800 base 0x00010000 hash 0123456789abcdef",
+	so it's readable in a hex dump. The rest of the 255 bytes are zeroed.
+*/
+void dfuse_delta_name(dfuse_target_prefix * tarprefix, dfuse_delta * delta)
+{
+	memset(tarprefix->target_name, 0, sizeof(tarprefix->target_name));
+	snprintf(tarprefix->target_name, sizeof(tarprefix->target_name),
+			"%s 0x%08x+0x%08x page 0x%x base 0x%08x hash %016llx", DFUSE_DELTA_TAG,
+			delta->address, delta->length, delta->page, delta->covered, (unsigned long long)delta->hash);
+	tarprefix->target_named = 1;
+}
+
+int dfuse_delta_parse(dfuse_target_prefix * tarprefix, dfuse_delta * delta)
+{
+	char name[sizeof(tarprefix->target_name) + 1];
+	unsigned int address, length, page, covered;
+	unsigned long long hash;
+	
+	if (!tarprefix->target_named)
+		return -1;
+	
+	//the name needn't be terminated in the file
+	memcpy(name, tarprefix->target_name, sizeof(tarprefix->target_name));
+	name[sizeof(tarprefix->target_name)] = 0;
+	
+	if (strncmp(name, DFUSE_DELTA_TAG " ", strlen(DFUSE_DELTA_TAG " ")) ||
+		(5 != sscanf(&name[strlen(DFUSE_DELTA_TAG)], " 0x%x+0x%x page 0x%x base 0x%x hash %llx",
+					&address, &length, &page, &covered, &hash)) || (covered > length))
+	{
+		return -1;
+	}
+	
+	delta->address = address;
+	delta->length = length;
+	delta->page = page;
+	delta->covered = covered;
+	delta->hash = hash;
+	
+	return 0;
+}
+
+/*
+	dfuse_struct_cleanup() frees what dfulz_unpack() decoded, which is
+	dropped element by element, then the arena. The file is in the
+	arena itself, so the chunk list is taken first.
 */
 void dfuse_struct_cleanup(dfuse_file * dfusefile)
 {
+	dfuse_chunk * chunk = dfusefile->arena;
+	dfuse_chunk * next;
 	int i, j;
 	
-	for (i=0; i<dfusefile->prefix->targets; i++)
+	if (!memcmp(dfusefile->prefix->signature, DFULZ_SIGNATURE, 5))
 	{
-		for (j=0; j<dfusefile->images[i]->tarprefix->num_elements; j++)
+		for (i=0; i<dfusefile->prefix->targets; i++)
 		{
-			free(dfusefile->images[i]->imgelement[j]->data);
-			free(dfusefile->images[i]->imgelement[j]);
+			for (j=0; j<dfusefile->images[i]->tarprefix->num_elements; j++)
+				dfulz_drop(dfusefile->images[i]->imgelement[j]);
 		}
-		free(dfusefile->images[i]->tarprefix);
-		free(dfusefile->images[i]->imgelement);
-		free(dfusefile->images[i]);
 	}
 	
-	free(dfusefile->images);
-	free(dfusefile->suffix);
-	free(dfusefile->prefix);
-	free(dfusefile);
-}
\ No newline at end of file
+	if (NULL != dfusefile->map)
+		munmap(dfusefile->map, dfusefile->maplength);
+	
+	if (dfusefile->fd >= 0)
+		close(dfusefile->fd);
+	
+	for (; NULL != chunk; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+}
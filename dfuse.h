@@ -13,15 +13,25 @@ Specification, UM0391.
 #define uint8_t u_int8_t
 #define uint16_t u_int16_t
 #define uint32_t u_int32_t
+#define uint64_t u_int64_t
 
 #define STMDFU_PREFIXLEN 11
 #define STMDFU_SUFFIXLEN 16
 #define STMDFU_TARPREFIXLEN 274
 
-#define READBIN_READLEN 100
+//target name that marks a delta target (see dfuse_delta)
+#define DFUSE_DELTA_TAG "stmdfu delta"
 
-#define DFUWRITE(var) (write(dfufile, &(var), sizeof(var)))
-#define DFUREAD(var) (read(dfufile, &(var), sizeof(var)))
+//first buffer size dfuse_mapbin() reads a pipe into
+#define MAPBIN_CHUNK (1024 * 1024)
+
+//first chunk of a dfuse file's arena, each one after is twice the last,
+//up to DFUSE_ARENA_MAX (see dfuse_alloc())
+#define DFUSE_ARENA_CHUNK (64 * 1024)
+#define DFUSE_ARENA_MAX (16 * 1024 * 1024)
+
+#define DFUWRITE(var) (dfuse_write(dfusefile, dfufile, &(var), sizeof(var)))
+#define DFUREAD(var) (dfuse_read(dfusefile, dfufile, &(var), sizeof(var)))
 
 typedef struct {
 	char signature[5];
@@ -57,6 +67,15 @@ typedef struct {
 	uint32_t element_address;
 	uint32_t element_size;
 	uint8_t * data;
+	
+	//an element of a packed file (see dfulz.h) is stored here, and its
+	//data is NULL until dfulz_unpack()
+	uint8_t * packed;
+	uint32_t packed_size;
+	
+	//where the element's stored bytes start in the file, for
+	//dfuse_load_element()
+	uint32_t offset;
 } dfuse_image_element;
 
 typedef struct {
@@ -64,23 +83,174 @@ typedef struct {
 	dfuse_image_element ** imgelement;
 } dfuse_image;
 
+/*
+dfuse_delta describes a target that only holds the pages of an image
+that changed since a base image. The image covers length bytes from
+address, and the base the first covered bytes from address. hash is the
+dfuse_pagehash() of what the base held in the pages the delta replaces,
+every byte the target's elements cover below address + covered, in
+address order, so checking a device for the base only reads back what
+the delta is about to rewrite. It's carried in the target name, so a
+delta is still an ordinary dfuse file to anything else.
+*/
+typedef struct {
+	uint32_t address;
+	uint32_t length;
+	uint32_t page;
+	uint32_t covered;
+	uint64_t hash;
+} dfuse_delta;
+
+/*
+dfuse_chunk is one block of a dfuse file's arena, its memory follows
+the header. Chunks are handed out front to back and never reused, so
+what's left of one is still zeroed.
+*/
+typedef struct dfuse_chunk {
+	struct dfuse_chunk * next;
+	uint32_t size;
+	uint32_t used;
+} dfuse_chunk;
+
 typedef struct {
 	dfuse_prefix * prefix;
 	dfuse_image ** images;
 	dfuse_suffix * suffix;
+	
+	//a file loaded by dfuse_map() is a view onto this mapping, its
+	//element data points into it rather than being copied out
+	uint8_t * map;
+	uint32_t maplength;
+	
+	//the file's structs, and the element data it reads in, are carved
+	//out of these chunks, the file itself at the start of the last
+	//one, and go in one pass of dfuse_struct_cleanup()
+	dfuse_chunk * arena;
+	
+	//a file indexed by dfuse_index() is kept open, and its elements'
+	//data is only read in by dfuse_load_element()
+	int fd;
+	
+	//running crc of everything written or read so far, the suffix
+	//crc is finished from it instead of reading the file back
+	uint32_t crc;
 } dfuse_file;
 
+/*
+dfuse_read_at reads count bytes of a dfuse file at offset into buf, from
+wherever the file is kept. Returns 0 if it got them all.
+*/
+typedef int (*dfuse_read_at)(dfuse_file * dfusefile, void * buf, uint32_t count, uint32_t offset);
+
+/*
+dfuse_new() allocates an empty dfuse file, with no targets, and
+populates the prefix and suffix fields that are independent of the
+firmware images.
+*/
+dfuse_file * dfuse_new();
+
+/*
+dfuse_alloc() returns size zeroed bytes out of dfusefile's arena, which
+last as long as the file does. Parsing a file of thousands of elements
+costs a few chunk allocations, and freeing it one per chunk. Returns
+NULL if size is too big for the arena or memory runs out.
+*/
+void * dfuse_alloc(dfuse_file * dfusefile, uint32_t size);
+
+/*
+dfuse_addtarget() appends an empty target for alternate setting
+alternate, and returns its index.
+*/
+int dfuse_addtarget(dfuse_file * dfusefile, uint8_t alternate);
+
+/*
+dfuse_addelement() appends an element at address to target, sized
+to hold the binary image in binfile, and returns its index. Target
+and file sizes are kept up to date.
+*/
+int dfuse_addelement(dfuse_file * dfusefile, int target, uint32_t address, int binfile);
+
+/*
+dfuse_addelement_data() appends an element at address to target, for
+size bytes at data, and returns its index. The data isn't copied, it
+must stay put until the file's written, and stays the caller's unless
+it came from dfuse_alloc().
+*/
+int dfuse_addelement_data(dfuse_file * dfusefile, int target, uint32_t address, uint8_t * data, uint32_t size);
+
 /*
 dfuse_init() allocates memory for the various dfuse structs
 that make up the dfuse file, and populates fields that are
-independent of the firmware image.
+independent of the firmware image. The file has one target
+with one element, for binfile at the start of flash.
 */
 dfuse_file * dfuse_init(int binfile);
 
 /*
-dfuse_readbin() reads the binary firmware image into memory
+dfuse_load() reads a whole dfuse file into memory with the
+dfuse_read...() functions below, copying each element's data into its
+own buffer. Returns NULL if the file can't be opened.
 */
-void dfuse_readbin(dfuse_file * dfusefile, int binfile);
+dfuse_file * dfuse_load(const char * file);
+
+/*
+dfuse_map() maps a dfuse file into memory and checks its layout and
+suffix crc in one pass. Element data points into the mapping, nothing
+is copied and only the open, fstat and mmap syscalls are made. The file
+must not change while it's mapped. A packed file (see dfulz.h) is read
+the same way, its elements' packed data pointing into the mapping
+instead. Returns NULL if the file can't be mapped, is malformed or is
+corrupt.
+*/
+dfuse_file * dfuse_map(const char * file);
+
+/*
+dfuse_index() reads only the headers of a dfuse (or packed) file, the
+prefix, target prefixes, element headers and suffix, seeking past the
+element data, and checks they fit the file. Element data is left on
+disk until dfuse_load_element(), so the cost of a large file is only
+the parts of it that are used. The suffix crc covers the whole file, so
+it isn't checked. Returns NULL if the file can't be opened or is
+malformed.
+*/
+dfuse_file * dfuse_index(const char * file);
+
+/*
+dfuse_load_element() reads in the data of an element of an indexed
+file (the packed data, for a packed file). dfuse_load_elements() does
+every element of every target. Return 0 on success.
+*/
+int dfuse_load_element(dfuse_file * dfusefile, dfuse_image_element * element);
+int dfuse_load_elements(dfuse_file * dfusefile);
+
+/*
+dfuse_droptarget() removes target, and its elements, from dfusefile.
+Targets after it move down one.
+*/
+void dfuse_droptarget(dfuse_file * dfusefile, int target);
+
+/*
+dfuse_readbin() reads the binary firmware image for element
+of target into memory
+*/
+void dfuse_readbin(dfuse_file * dfusefile, int binfile, int target, int element);
+
+/*
+dfuse_mapbin() gets the whole of binfile into memory, however it's
+cheapest: regular files are mapped, pipes (stdin) are read in large
+chunks. Returns the data, with its length in size and whether it was
+mapped in mapped, or NULL on failure. dfuse_unmapbin() releases it.
+*/
+uint8_t * dfuse_mapbin(int binfile, uint32_t * size, int * mapped);
+void dfuse_unmapbin(uint8_t * data, uint32_t size, int mapped);
+
+/*
+dfuse_writefile() writes the whole dfuse file in one pass, with the
+suffix crc worked out as it goes. Element data is written straight
+from wherever it is, with vectored writes, and the output is never
+sought or read back, so it can be a pipe. Returns 0 on success.
+*/
+int dfuse_writefile(dfuse_file * dfusefile, int dfufile);
 
 /*
 	the dfuse_write{dfuse_file_part}() functions write the
@@ -93,34 +263,64 @@ void dfuse_readbin(dfuse_file * dfusefile, int binfile);
 	These functions are delicate, they must be used
 	in the order:
 		prefix
-		tarprefix
-		imgelement(_meta)
-		(imgelement_data)
+		for each target:
+			tarprefix
+			for each element of the target:
+				imgelement(_meta)
+				(imgelement_data)
 		suffix
 		
 	otherwise the file will be malformed, or the data read
 	into memory will go in to the wrong fields
 */
 int dfuse_writeprefix(dfuse_file * dfusefile, int dfufile);
-int dfuse_writetarprefix(dfuse_file * dfusefile, int dfufile);
-int dfuse_writeimgelement(dfuse_file * dfusefile, int dfufile);
+int dfuse_writetarprefix(dfuse_file * dfusefile, int dfufile, int target);
+int dfuse_writeimgelement(dfuse_file * dfusefile, int dfufile, int target, int element);
 int dfuse_writesuffix(dfuse_file * dfusefile, int dfufile);
 
 int dfuse_readprefix(dfuse_file * dfusefile, int dfufile);
-int dfuse_readtarprefix(dfuse_file * dfusefile, int dfufile);
-int dfuse_readimgelement_meta(dfuse_file * dfusefile, int dfufile);
-int dfuse_readimgelement_data(dfuse_file * dfusefile, int dfufile);
+int dfuse_readtarprefix(dfuse_file * dfusefile, int dfufile, int target);
+int dfuse_readimgelement_meta(dfuse_file * dfusefile, int dfufile, int target, int element);
+int dfuse_readimgelement_data(dfuse_file * dfusefile, int dfufile, int target, int element);
 int dfuse_readsuffix(dfuse_file * dfusefile, int dfufile);
 
 /*
-calccrc() calculates a 32 bit CRC to go in the
-suffix of the dfuse file
+dfuse_write() and dfuse_read() write and read count bytes, folding
+them into the file's running crc.
+*/
+ssize_t dfuse_write(dfuse_file * dfusefile, int dfufile, const void * buf, size_t count);
+ssize_t dfuse_read(dfuse_file * dfusefile, int dfufile, void * buf, size_t count);
+
+/*
+dfuse_isblank() returns 1 if all length bytes of data are 0xff, i.e. the
+data is what an erased flash page already holds.
+*/
+int dfuse_isblank(const uint8_t * data, uint32_t length);
+
+/*
+dfuse_pagehash() returns a 64 bit FNV-1a hash of length bytes of data,
+used to tell whether a flash page's contents have changed.
+*/
+uint64_t dfuse_pagehash(const uint8_t * data, uint32_t length);
+
+/*
+dfuse_pagehash_update() carries on a dfuse_pagehash() over the next
+length bytes, starting from hash (DFUSE_PAGEHASH_INIT for no data yet).
+*/
+#define DFUSE_PAGEHASH_INIT 0xcbf29ce484222325ULL
+uint64_t dfuse_pagehash_update(uint64_t hash, const uint8_t * data, uint32_t length);
+
+/*
+dfuse_delta_name() writes delta into target's name. dfuse_delta_parse()
+reads it back, returning 0 if target is a delta target.
 */
-void calccrc(dfuse_file * dfusefile, int dfufile);
+void dfuse_delta_name(dfuse_target_prefix * tarprefix, dfuse_delta * delta);
+int dfuse_delta_parse(dfuse_target_prefix * tarprefix, dfuse_delta * delta);
 
 /*
 dfuse_struct_cleanup() deallocates the dfuse file
-structures
+structures, a chunk of its arena at a time, and unmaps the file if
+it was mapped
 */
 void dfuse_struct_cleanup(dfuse_file * dfusefile);
 #endif
\ No newline at end of file
@@ -0,0 +1,802 @@
+/*
+dfusim.{c,h} :
+A software model of the STM32 DFU bootloader that plugs in under dfu_device as
+a transport. It runs the DFU state machine from dfurequests.h and the AN3156
+command set (set address pointer, erase, mass erase, read unprotect, block
+upload/download) against an in-memory flash array and option bytes, with
+configurable latencies for each flash operation. This gives stmdfu a
+hardware-free target for testing and benchmarking flash, dump and erase.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+#include "dfurequests.h"
+#include "dfucommands.h"
+#include "dfusim.h"
+
+/*
+	dfusim_now_us() returns a monotonic timestamp in microseconds.
+*/
+static uint64_t dfusim_now_us()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+	dfusim_default_config() fills config with the defaults from dfusim.h.
+	Latencies are typical STM32F1 figures: 2kB of halfword programming,
+	a page erase and a mass erase.
+*/
+void dfusim_default_config(dfusim_config * config)
+{
+	memset(config, 0, sizeof(dfusim_config));
+
+	config->flash_base = DFUSIM_FLASH_BASE;
+	config->flash_size = DFUSIM_FLASH_SIZE;
+	config->page_size = DFUSIM_PAGE_SIZE;
+	config->transfer_size = DFUSIM_TRANSFER_SIZE;
+
+	config->program_us = 54000;
+	config->erase_us = 20000;
+	config->mass_erase_us = 40000;
+	config->set_address_us = 200;
+
+	config->program_poll_ms = 100;
+	config->erase_poll_ms = 50;
+	config->mass_erase_poll_ms = 100;
+	config->set_address_poll_ms = 5;
+}
+
+/*
+	dfusim_parse_size() parses a number with an optional K or M suffix.
+*/
+static uint32_t dfusim_parse_size(const char * value)
+{
+	char * end;
+	uint32_t size = strtoul(value, &end, 0);
+
+	if ((*end == 'K') || (*end == 'k'))
+		size *= 1024;
+	else if ((*end == 'M') || (*end == 'm'))
+		size *= 1024 * 1024;
+
+	return size;
+}
+
+/*
+	dfusim_parse_config() updates config from a spec string of comma
+	separated key=value pairs.
+*/
+int32_t dfusim_parse_config(dfusim_config * config, const char * spec)
+{
+	char * copy;
+	char * key;
+	char * value;
+	char * save;
+	uint32_t size;
+	int32_t rv = 0;
+
+	if ((NULL == spec) || (0 == *spec))
+		return 0;
+
+	copy = strdup(spec);
+
+	for (key = strtok_r(copy, ",", &save); key != NULL; key = strtok_r(NULL, ",", &save))
+	{
+		value = strchr(key, '=');
+		if (NULL == value)
+		{
+			//a bare word is taken as the backing file
+			value = key;
+			key = "file";
+		} else
+		{
+			*value++ = 0;
+		}
+
+		if (!strcmp(key, "file"))
+		{
+			strncpy(config->file, value, sizeof(config->file) - 1);
+		} else if (!strcmp(key, "base"))
+		{
+			config->flash_base = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "flash"))
+		{
+			config->flash_size = dfusim_parse_size(value);
+		} else if (!strcmp(key, "page"))
+		{
+			config->page_size = dfusim_parse_size(value);
+		} else if (!strcmp(key, "serial"))
+		{
+			strncpy(config->serial, value, sizeof(config->serial) - 1);
+		} else if (!strcmp(key, "sectors"))
+		{
+			strncpy(config->sectors, value, sizeof(config->sectors) - 1);
+		} else if (!strcmp(key, "transfer"))
+		{
+			//wLength is 16 bits, so 64K itself won't go
+			size = dfusim_parse_size(value);
+			if ((size == 0) || (size > 0xffff))
+			{
+				printf("dfusim: transfer size must be 1 to 65535 bytes, not <%s>\n", value);
+				rv = -1;
+			} else
+			{
+				config->transfer_size = size;
+			}
+		} else if (!strcmp(key, "program_us"))
+		{
+			config->program_us = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "erase_us"))
+		{
+			config->erase_us = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "mass_erase_us"))
+		{
+			config->mass_erase_us = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "set_address_us"))
+		{
+			config->set_address_us = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "program_poll_ms"))
+		{
+			config->program_poll_ms = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "erase_poll_ms"))
+		{
+			config->erase_poll_ms = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "mass_erase_poll_ms"))
+		{
+			config->mass_erase_poll_ms = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "set_address_poll_ms"))
+		{
+			config->set_address_poll_ms = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "usb_us"))
+		{
+			config->usb_us = strtoul(value, NULL, 0);
+		} else if (!strcmp(key, "rdp"))
+		{
+			config->read_protect = strtoul(value, NULL, 0) ? 1 : 0;
+		} else
+		{
+			printf("dfusim: unknown key <%s>\n", key);
+			rv = -1;
+		}
+	}
+
+	free(copy);
+
+	return rv;
+}
+
+/*
+	dfusim_set_optbytes() lays out the STM32F1 option bytes (each byte
+	followed by its complement), with RDP reflecting read protection.
+*/
+static void dfusim_set_optbytes(dfusim * sim)
+{
+	int i;
+
+	for (i=0; i<DFUSIM_OPTBYTES_SIZE; i+=2)
+	{
+		sim->optbytes[i] = 0xff;
+		sim->optbytes[i+1] = 0x00;
+	}
+
+	sim->optbytes[0] = sim->config.read_protect ? 0x00 : 0xa5;
+	sim->optbytes[1] = ~sim->optbytes[0];
+}
+
+static int dfusim_in_flash(dfusim * sim, uint32_t address, uint32_t length)
+{
+	return (address >= sim->config.flash_base) &&
+		((uint64_t)(address - sim->config.flash_base) + length <= sim->config.flash_size);
+}
+
+static int dfusim_in_optbytes(uint32_t address, uint32_t length)
+{
+	return (address >= OPTION_BYTES_ADDRESS) &&
+		((uint64_t)(address - OPTION_BYTES_ADDRESS) + length <= DFUSIM_OPTBYTES_SIZE);
+}
+
+/*
+	dfusim_stall() models the device stalling a request it can't handle
+	in its current state.
+*/
+static int32_t dfusim_stall(dfusim * sim)
+{
+	sim->state = STATE_DFU_ERROR;
+	sim->status = DFU_STATUS_ERROR_STALLEDPKT;
+
+	return LIBUSB_ERROR_PIPE;
+}
+
+/*
+	dfusim_execute() carries out the DNLOAD staged in dnbuf. Like the real
+	bootloader, this happens on the GETSTATUS that follows the DNLOAD: the
+	effect is applied immediately, but the device stays dfuDNBUSY for the
+	configured latency and only then reports the outcome.
+*/
+static void dfusim_execute(dfusim * sim)
+{
+	dfusim_config * config = &sim->config;
+	uint8_t * cmd = sim->dnbuf;
+	uint32_t address;
+	uint32_t offset;
+	uint32_t latency = 0;
+	uint32_t poll = 0;
+	uint8_t status = DFU_STATUS_OK;
+	dfu_sector sector;
+	int i;
+
+	if (sim->dnblock == 0)
+	{
+		address = cmd[1] | (cmd[2] << 8) | (cmd[3] << 16) | ((uint32_t)cmd[4] << 24);
+
+		if ((cmd[0] == 0x21) && (sim->dnlength == 5))
+		{
+			latency = config->set_address_us;
+			poll = config->set_address_poll_ms;
+
+			if (dfusim_in_flash(sim, address, 0) || dfusim_in_optbytes(address, 0))
+				sim->address = address;
+			else
+				status = DFU_STATUS_ERROR_TARGET;
+		} else if ((cmd[0] == 0x41) && (sim->dnlength == 1))
+		{
+			latency = config->mass_erase_us;
+			poll = config->mass_erase_poll_ms;
+
+			if (config->read_protect)
+			{
+				status = DFU_STATUS_ERROR_VENDOR;
+			} else
+			{
+				memset(sim->flash, 0xff, config->flash_size);
+				sim->mass_erases++;
+			}
+		} else if ((cmd[0] == 0x41) && (sim->dnlength == 5))
+		{
+			latency = config->erase_us;
+			poll = config->erase_poll_ms;
+
+			if (config->read_protect)
+			{
+				status = DFU_STATUS_ERROR_VENDOR;
+			} else if (!dfusim_in_flash(sim, address, 1))
+			{
+				status = DFU_STATUS_ERROR_TARGET;
+			} else
+			{
+				//a sector takes as long to erase as the pages it spans
+				dfu_find_sector(&sim->map, address, &sector);
+				latency = (uint64_t)config->erase_us * sector.size / config->page_size;
+				offset = sector.address - config->flash_base;
+				memset(&sim->flash[offset], 0xff, sector.size);
+				sim->pages_erased++;
+			}
+		} else if ((cmd[0] == 0x92) && (sim->dnlength == 1))
+		{
+			//read unprotect mass erases the part
+			latency = config->mass_erase_us;
+			poll = config->mass_erase_poll_ms;
+
+			config->read_protect = 0;
+			dfusim_set_optbytes(sim);
+			memset(sim->flash, 0xff, config->flash_size);
+			sim->mass_erases++;
+		} else
+		{
+			status = DFU_STATUS_ERROR_TARGET;
+		}
+	} else
+	{
+		latency = config->program_us;
+		poll = config->program_poll_ms;
+
+		address = sim->address + (sim->dnblock - 2) * config->transfer_size;
+
+		if (sim->alternate == DFUSIM_ALT_OPTBYTES)
+		{
+			//the bootloader erases the option bytes itself before writing them
+			if (!dfusim_in_optbytes(address, sim->dnlength))
+			{
+				status = DFU_STATUS_ERROR_TARGET;
+			} else
+			{
+				memcpy(&sim->optbytes[address - OPTION_BYTES_ADDRESS], cmd, sim->dnlength);
+				config->read_protect = (sim->optbytes[0] != 0xa5);
+				sim->blocks_programmed++;
+			}
+		} else if (config->read_protect)
+		{
+			status = DFU_STATUS_ERROR_VENDOR;
+		} else if (!dfusim_in_flash(sim, address, sim->dnlength))
+		{
+			status = DFU_STATUS_ERROR_TARGET;
+		} else
+		{
+			//programming can only clear bits, anything else needs an erase first
+			offset = address - config->flash_base;
+			for (i=0; i<sim->dnlength; i++)
+			{
+				if ((sim->flash[offset+i] & cmd[i]) != cmd[i])
+				{
+					status = DFU_STATUS_ERROR_PROG;
+					break;
+				}
+			}
+
+			if (status == DFU_STATUS_OK)
+			{
+				memcpy(&sim->flash[offset], cmd, sim->dnlength);
+				sim->blocks_programmed++;
+			}
+		}
+	}
+
+	sim->busy_until = dfusim_now_us() + latency;
+	sim->busy_poll_ms = poll;
+	sim->busy_status = status;
+	sim->state = STATE_DFU_DOWNLOAD_BUSY;
+}
+
+/*
+	dfusim_get_status() answers DFU_GETSTATUS, advancing the state machine
+	for states that move on when polled.
+*/
+static int32_t dfusim_get_status(dfusim * sim, uint8_t * data, uint16_t length)
+{
+	uint32_t poll = 0;
+	uint64_t now;
+	int detach = 0;
+
+	if (length < 6)
+		return dfusim_stall(sim);
+
+	switch (sim->state)
+	{
+		case STATE_DFU_DOWNLOAD_SYNC:
+			dfusim_execute(sim);
+			poll = sim->busy_poll_ms;
+			break;
+
+		case STATE_DFU_DOWNLOAD_BUSY:
+			now = dfusim_now_us();
+			if (now < sim->busy_until)
+			{
+				poll = (sim->busy_until - now + 999) / 1000;
+			} else if (sim->busy_status != DFU_STATUS_OK)
+			{
+				sim->state = STATE_DFU_ERROR;
+				sim->status = sim->busy_status;
+			} else
+			{
+				sim->state = STATE_DFU_DOWNLOAD_IDLE;
+			}
+			break;
+
+		case STATE_DFU_MANIFEST_SYNC:
+			//the bootloader jumps to the application and drops off the bus
+			sim->state = STATE_DFU_MANIFEST;
+			poll = 1;
+			detach = 1;
+			break;
+	}
+
+	data[0] = sim->status;
+	data[1] = poll & 0xff;
+	data[2] = (poll >> 8) & 0xff;
+	data[3] = (poll >> 16) & 0xff;
+	data[4] = sim->state;
+	data[5] = 0;
+
+	sim->detached = detach;
+
+	return 6;
+}
+
+/*
+	dfusim_upload() answers DFU_UPLOAD: the command list for block 0,
+	otherwise memory relative to the address pointer.
+*/
+static int32_t dfusim_upload(dfusim * sim, uint16_t wvalue, uint8_t * data, uint16_t length)
+{
+	static const uint8_t commands[4] = {0x00, 0x21, 0x41, 0x92};
+	uint32_t address;
+
+	if ((sim->state != STATE_DFU_IDLE) && (sim->state != STATE_DFU_UPLOAD_IDLE))
+		return dfusim_stall(sim);
+
+	if (wvalue == 0)
+	{
+		if (length > sizeof(commands))
+			length = sizeof(commands);
+		memcpy(data, commands, length);
+		sim->state = STATE_DFU_UPLOAD_IDLE;
+		return length;
+	}
+
+	if ((wvalue == 1) || (length > sim->config.transfer_size))
+		return dfusim_stall(sim);
+
+	address = sim->address + (wvalue - 2) * sim->config.transfer_size;
+
+	if (dfusim_in_optbytes(address, length))
+	{
+		memcpy(data, &sim->optbytes[address - OPTION_BYTES_ADDRESS], length);
+	} else if (sim->config.read_protect)
+	{
+		sim->state = STATE_DFU_ERROR;
+		sim->status = DFU_STATUS_ERROR_VENDOR;
+		return LIBUSB_ERROR_PIPE;
+	} else if (dfusim_in_flash(sim, address, length))
+	{
+		memcpy(data, &sim->flash[address - sim->config.flash_base], length);
+	} else
+	{
+		sim->state = STATE_DFU_ERROR;
+		sim->status = DFU_STATUS_ERROR_TARGET;
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	sim->state = STATE_DFU_UPLOAD_IDLE;
+
+	return length;
+}
+
+/*
+	dfusim_download() answers DFU_DNLOAD by staging the data until the
+	GETSTATUS that executes it. A zero length DNLOAD leaves DFU mode.
+*/
+static int32_t dfusim_download(dfusim * sim, uint16_t wvalue, uint8_t * data, uint16_t length)
+{
+	if ((sim->state != STATE_DFU_IDLE) && (sim->state != STATE_DFU_DOWNLOAD_IDLE))
+		return dfusim_stall(sim);
+
+	if (length > sim->config.transfer_size)
+		return dfusim_stall(sim);
+
+	if (length == 0)
+	{
+		if (sim->state != STATE_DFU_DOWNLOAD_IDLE)
+			return dfusim_stall(sim);
+
+		sim->state = STATE_DFU_MANIFEST_SYNC;
+		return 0;
+	}
+
+	memcpy(sim->dnbuf, data, length);
+	sim->dnlength = length;
+	sim->dnblock = wvalue;
+	sim->state = STATE_DFU_DOWNLOAD_SYNC;
+
+	return length;
+}
+
+/*
+	dfusim_request() models the time a request spends on the bus.
+*/
+static int32_t dfusim_request(dfusim * sim)
+{
+	struct timespec req;
+
+	sim->requests++;
+
+	if (sim->config.usb_us)
+	{
+		req.tv_sec = sim->config.usb_us / 1000000;
+		req.tv_nsec = (sim->config.usb_us % 1000000) * 1000;
+		nanosleep(&req, NULL);
+	}
+
+	return sim->detached ? LIBUSB_ERROR_NO_DEVICE : 0;
+}
+
+static int32_t dfusim_control_out(dfu_device * device, uint8_t request, uint16_t wvalue,
+								  uint8_t * data, uint16_t length)
+{
+	dfusim * sim = (dfusim *)device->transport_data;
+	int32_t rv = dfusim_request(sim);
+
+	if (rv)
+		return rv;
+
+	switch (request)
+	{
+		case DFU_DNLOAD:
+			return dfusim_download(sim, wvalue, data, length);
+
+		case DFU_CLRSTATUS:
+			if (sim->state != STATE_DFU_ERROR)
+				return dfusim_stall(sim);
+			sim->state = STATE_DFU_IDLE;
+			sim->status = DFU_STATUS_OK;
+			return 0;
+
+		case DFU_ABORT:
+			switch (sim->state)
+			{
+				case STATE_DFU_IDLE:
+				case STATE_DFU_DOWNLOAD_SYNC:
+				case STATE_DFU_DOWNLOAD_IDLE:
+				case STATE_DFU_MANIFEST_SYNC:
+				case STATE_DFU_UPLOAD_IDLE:
+					sim->state = STATE_DFU_IDLE;
+					return 0;
+			}
+			return dfusim_stall(sim);
+
+		case DFU_DETACH:
+			//already in DFU mode
+			return 0;
+	}
+
+	return dfusim_stall(sim);
+}
+
+static int32_t dfusim_control_in(dfu_device * device, uint8_t request, uint16_t wvalue,
+								 uint8_t * data, uint16_t length)
+{
+	dfusim * sim = (dfusim *)device->transport_data;
+	int32_t rv = dfusim_request(sim);
+
+	if (rv)
+		return rv;
+
+	switch (request)
+	{
+		case DFU_GETSTATUS:
+			return dfusim_get_status(sim, data, length);
+
+		case DFU_GETSTATE:
+			if (length < 1)
+				return dfusim_stall(sim);
+			data[0] = sim->state;
+			return 1;
+
+		case DFU_UPLOAD:
+			return dfusim_upload(sim, wvalue, data, length);
+	}
+
+	return dfusim_stall(sim);
+}
+
+/*
+	dfusim_reset() models a USB reset with the boot pins still selecting
+	the system memory bootloader: the device comes back in dfuIDLE.
+*/
+static int32_t dfusim_reset(dfu_device * device)
+{
+	dfusim * sim = (dfusim *)device->transport_data;
+
+	sim->detached = 0;
+	sim->state = STATE_DFU_IDLE;
+	sim->status = DFU_STATUS_OK;
+
+	return 0;
+}
+
+static int32_t dfusim_claim(dfu_device * device)
+{
+	return 0;
+}
+
+static int32_t dfusim_set_alt(dfu_device * device, int32_t alternate)
+{
+	dfusim * sim = (dfusim *)device->transport_data;
+
+	//internal flash and option bytes are modelled, system memory isn't
+	if ((alternate != DFUSIM_ALT_FLASH) && (alternate != DFUSIM_ALT_OPTBYTES))
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	sim->alternate = alternate;
+	sim->state = STATE_DFU_IDLE;
+	sim->status = DFU_STATUS_OK;
+
+	return 0;
+}
+
+/*
+	dfusim_release() writes flash back to the backing file, and the
+	option bytes to <file>.opt, if there is one, and frees the
+	simulated device.
+*/
+static void dfusim_release(dfu_device * device)
+{
+	dfusim * sim = (dfusim *)device->transport_data;
+	FILE * backing;
+	char optfile[sizeof(sim->config.file) + 4];
+
+	if (NULL == sim)
+		return;
+
+	if (sim->config.file[0])
+	{
+		backing = fopen(sim->config.file, "wb");
+		if ((NULL == backing) || (1 != fwrite(sim->flash, sim->config.flash_size, 1, backing)))
+		{
+			printf("dfusim: couldn't save flash to <%s>\n", sim->config.file);
+		}
+		if (NULL != backing)
+			fclose(backing);
+
+		snprintf(optfile, sizeof(optfile), "%s.opt", sim->config.file);
+		backing = fopen(optfile, "wb");
+		if (NULL != backing)
+		{
+			fwrite(sim->optbytes, DFUSIM_OPTBYTES_SIZE, 1, backing);
+			fclose(backing);
+		}
+	}
+
+	free(sim->flash);
+	free(sim->dnbuf);
+	free(sim);
+	device->transport_data = NULL;
+}
+
+const dfu_transport dfusim_transport = {
+	"dfusim",
+	dfusim_control_out,
+	dfusim_control_in,
+	dfusim_reset,
+	dfusim_claim,
+	dfusim_set_alt,
+	dfusim_release
+};
+
+/*
+	dfusim_layout() builds the interface strings of the flash and option
+	byte alternate settings and parses them into the device's memory map,
+	keeping a copy of the flash map for sector erases. With a sector list
+	the flash size is whatever the sectors add up to.
+*/
+static int32_t dfusim_layout(dfusim * sim, dfu_device * device)
+{
+	dfusim_config * config = &sim->config;
+	dfu_sector_run * last;
+	char layout[256];
+	char sectors[sizeof(config->sectors)];
+	char * p;
+
+	if (config->sectors[0])
+	{
+		//runs are + separated in a spec, since , separates keys
+		strcpy(sectors, config->sectors);
+		for (p = sectors; *p; p++)
+		{
+			if (*p == '+')
+				*p = ',';
+		}
+		snprintf(layout, sizeof(layout), "@Internal Flash  /0x%08x/%s", config->flash_base, sectors);
+	} else if (config->page_size % 1024)
+	{
+		snprintf(layout, sizeof(layout), "@Internal Flash  /0x%08x/%03u*%04u g",
+				config->flash_base, config->flash_size / config->page_size, config->page_size);
+	} else
+	{
+		snprintf(layout, sizeof(layout), "@Internal Flash  /0x%08x/%03u*%03uKg",
+				config->flash_base, config->flash_size / config->page_size, config->page_size / 1024);
+	}
+
+	if ((0 != dfu_parse_layout(&sim->map, layout)) || (0 == sim->map.nruns) ||
+		(sim->map.runs[0].address != config->flash_base))
+	{
+		printf("dfusim: bad sector list <%s>\n", config->sectors);
+		return -1;
+	}
+
+	last = &sim->map.runs[sim->map.nruns - 1];
+	config->flash_size = last->address + last->count * last->size - config->flash_base;
+	device->layout[DFUSIM_ALT_FLASH] = sim->map;
+
+	snprintf(layout, sizeof(layout), "@Option Bytes  /0x%08X/01*%03u e", OPTION_BYTES_ADDRESS, DFUSIM_OPTBYTES_SIZE);
+	dfu_parse_layout(&device->layout[DFUSIM_ALT_OPTBYTES], layout);
+
+	return 0;
+}
+
+/*
+	dfusim_open() creates a simulated STM32 DFU device from spec.
+*/
+dfu_device * dfusim_open(const char * spec)
+{
+	dfu_device * device;
+	dfusim * sim;
+	FILE * backing;
+	char optfile[sizeof(sim->config.file) + 4];
+
+	sim = (dfusim *)calloc(1, sizeof(dfusim));
+	dfusim_default_config(&sim->config);
+
+	if (0 > dfusim_parse_config(&sim->config, spec))
+	{
+		free(sim);
+		return NULL;
+	}
+
+	if ((sim->config.transfer_size == 0) || (sim->config.page_size == 0) ||
+		(!sim->config.sectors[0] && (sim->config.flash_size % sim->config.page_size)))
+	{
+		printf("dfusim: flash size must be a whole number of pages\n");
+		free(sim);
+		return NULL;
+	}
+
+	device = (dfu_device *)calloc(1, sizeof(dfu_device));
+	if (0 != dfusim_layout(sim, device))
+	{
+		free(device);
+		free(sim);
+		return NULL;
+	}
+
+	sim->flash = (uint8_t *)malloc(sim->config.flash_size);
+	sim->dnbuf = (uint8_t *)malloc(sim->config.transfer_size);
+	memset(sim->flash, 0xff, sim->config.flash_size);
+
+	if (sim->config.file[0])
+	{
+		backing = fopen(sim->config.file, "rb");
+		if (NULL != backing)
+		{
+			if (0 == fread(sim->flash, 1, sim->config.flash_size, backing))
+			{
+				printf("dfusim: <%s> is empty, starting erased\n", sim->config.file);
+			}
+			fclose(backing);
+		}
+	}
+
+	dfusim_set_optbytes(sim);
+
+	//option bytes live next to the flash image, in <file>.opt
+	if (sim->config.file[0] && !sim->config.read_protect)
+	{
+		snprintf(optfile, sizeof(optfile), "%s.opt", sim->config.file);
+		backing = fopen(optfile, "rb");
+		if (NULL != backing)
+		{
+			if (DFUSIM_OPTBYTES_SIZE == fread(sim->optbytes, 1, DFUSIM_OPTBYTES_SIZE, backing))
+				sim->config.read_protect = (sim->optbytes[0] != 0xa5);
+			else
+				dfusim_set_optbytes(sim);
+			fclose(backing);
+		}
+	}
+
+	sim->state = STATE_DFU_IDLE;
+	sim->status = DFU_STATUS_OK;
+	sim->address = sim->config.flash_base;
+
+	device->transport = &dfusim_transport;
+	device->transport_data = sim;
+	device->interface = 0;
+	strcpy(device->family, "dfusim");
+	strncpy(device->location, sim->config.file[0] ? sim->config.file : "dfusim", sizeof(device->location) - 1);
+	strncpy(device->serial, sim->config.serial[0] ? sim->config.serial : device->location, sizeof(device->serial) - 1);
+
+	//what the STM32 bootloader's functional descriptor advertises
+	device->attributes = DFU_ATTR_CAN_DNLOAD | DFU_ATTR_CAN_UPLOAD | DFU_ATTR_WILL_DETACH;
+	device->transfer_size = sim->config.transfer_size;
+	device->detach_timeout = 255;
+
+	return device;
+}
+
+/*
+	dfusim_report() prints how much work the simulated device has done.
+*/
+void dfusim_report(dfu_device * device)
+{
+	dfusim * sim = (dfusim *)device->transport_data;
+
+	printf("dfusim: %u requests, %u blocks programmed, %u pages erased, %u mass erases\n",
+			sim->requests, sim->blocks_programmed, sim->pages_erased, sim->mass_erases);
+}
@@ -0,0 +1,117 @@
+/*
+dfusim.{c,h} :
+A software model of the STM32 DFU bootloader that plugs in under dfu_device as
+a transport. It runs the DFU state machine from dfurequests.h and the AN3156
+command set (set address pointer, erase, mass erase, read unprotect, block
+upload/download) against an in-memory flash array and option bytes, with
+configurable latencies for each flash operation. This gives stmdfu a
+hardware-free target for testing and benchmarking flash, dump and erase.
+
+A simulated device is described by a spec string of comma separated key=value
+pairs, e.g. "file=board.bin,flash=512K,program_us=20000". Sizes take K and M
+suffixes. See dfusim_parse_config() for the keys. Flash is uniform pages unless
+sectors= gives a DfuSe sector list, with + between runs, e.g. an STM32F4's
+"sectors=04*016Kg+01*064Kg+07*128Kg". The device advertises its layout in the
+interface strings of its alternate settings, as the real bootloader does.
+*/
+
+#ifndef __DFU_SIM__
+#define __DFU_SIM__
+
+//defaults model an STM32F105/107 (connectivity line) bootloader
+#define DFUSIM_FLASH_BASE 0x08000000
+#define DFUSIM_FLASH_SIZE (256 * 1024)
+#define DFUSIM_PAGE_SIZE 2048
+#define DFUSIM_TRANSFER_SIZE 2048
+#define DFUSIM_OPTBYTES_SIZE 16
+
+//alternate settings, as the STM32 bootloader numbers them
+#define DFUSIM_ALT_FLASH 0
+#define DFUSIM_ALT_OPTBYTES 1
+
+typedef struct {
+	char file[256];
+	char serial[64];
+	uint32_t flash_base;
+	uint32_t flash_size;
+	uint32_t page_size;
+	uint16_t transfer_size;
+
+	//DfuSe sector list, flash is uniform pages if empty
+	char sectors[128];
+
+	//how long the device really takes for each operation
+	uint32_t program_us;
+	uint32_t erase_us;
+	uint32_t mass_erase_us;
+	uint32_t set_address_us;
+
+	//the bwPollTimeout the device advertises for each operation
+	uint32_t program_poll_ms;
+	uint32_t erase_poll_ms;
+	uint32_t mass_erase_poll_ms;
+	uint32_t set_address_poll_ms;
+
+	//added to every control transfer, models time on the bus
+	uint32_t usb_us;
+
+	uint8_t read_protect;
+} dfusim_config;
+
+typedef struct {
+	dfusim_config config;
+	dfu_memory_map map;
+	uint8_t * flash;
+	uint8_t optbytes[DFUSIM_OPTBYTES_SIZE];
+
+	uint8_t state;
+	uint8_t status;
+	uint8_t detached;
+	uint8_t alternate;
+	uint32_t address;
+
+	//the DNLOAD waiting for the GETSTATUS that executes it
+	uint8_t * dnbuf;
+	uint16_t dnlength;
+	uint16_t dnblock;
+
+	//the operation in progress and its outcome
+	uint64_t busy_until;
+	uint32_t busy_poll_ms;
+	uint8_t busy_status;
+
+	uint32_t requests;
+	uint32_t blocks_programmed;
+	uint32_t pages_erased;
+	uint32_t mass_erases;
+} dfusim;
+
+extern const dfu_transport dfusim_transport;
+
+/*
+dfusim_default_config() fills config with the defaults above.
+*/
+void dfusim_default_config(dfusim_config * config);
+
+/*
+dfusim_parse_config() updates config from a spec string. Keys are:
+file, serial, base, flash, page, sectors, transfer, program_us, erase_us, mass_erase_us,
+set_address_us, program_poll_ms, erase_poll_ms, mass_erase_poll_ms,
+set_address_poll_ms, usb_us and rdp.
+
+returns 0 on success, -1 on an unknown key
+*/
+int32_t dfusim_parse_config(dfusim_config * config, const char * spec);
+
+/*
+dfusim_open() creates a simulated STM32 DFU device from spec. If the spec
+names a file, flash is loaded from it (and option bytes from <file>.opt)
+and written back on release, so successive stmdfu runs see the same part.
+*/
+dfu_device * dfusim_open(const char * spec);
+
+/*
+dfusim_report() prints how much work the simulated device has done.
+*/
+void dfusim_report(dfu_device * device);
+#endif
@@ -8,10 +8,22 @@ $dfudir = "/home/arp/stm/dfu/stmdfu/";
 		"bintodfu.c",
 		"crc32.c",
 		"crc32.h",
+		"crc32tab.h",
 		"dfucommands.c",
 		"dfucommands.h",
 		"dfurequests.c",
 		"dfurequests.h",
+		"dfuerase.c",
+		"dfuerase.h",
+		"dfuinput.c",
+		"dfuinput.h",
+		"dfubench.c",
+		"dfucache.c",
+		"dfucache.h",
+		"dfulz.c",
+		"dfulz.h",
+		"dfusim.c",
+		"dfusim.h",
 		"dfuse.c",
 		"dfuse.h",
 		"Makefile",
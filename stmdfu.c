@@ -15,317 +15,2408 @@ the operation.
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <math.h>
+#include <time.h>
+#include <signal.h>
 #include "dfurequests.h"
 #include "dfucommands.h"
 #include "dfuse.h"
+#include "dfuinput.h"
+#include "dfulz.h"
+#include "dfusim.h"
+#include "dfuerase.h"
+#include "dfucache.h"
 #include "stmdfu.h"
 
+//command line options, filled in by main()
+static stmdfu_options opts;
+
 int main(int argc, char * argv[])
 {	
-	dfu_device * dfudev = stmdfu_init_dfu();
+	int argi = 1;
+	
+	//options come before the command
+	while ((argi < argc) && (argv[argi][0] == '-'))
+	{
+		if (!strcmp(argv[argi], "--adaptive-poll"))
+		{
+			opts.adaptive = 1;
+		} else if (!strcmp(argv[argi], "--poll-stats"))
+		{
+			opts.pollstats = 1;
+		} else if (!strcmp(argv[argi], "--sparse"))
+		{
+			opts.sparse = 1;
+		} else if (!strcmp(argv[argi], "--erase"))
+		{
+			opts.erase = 1;
+		} else if (!strcmp(argv[argi], "--all"))
+		{
+			opts.all = 1;
+		} else if (!strncmp(argv[argi], "--format=", 9))
+		{
+			if (!strcmp(&argv[argi][9], "raw"))
+				opts.format = STMDFU_FORMAT_RAW;
+			else if (!strcmp(&argv[argi][9], "hex"))
+				opts.format = STMDFU_FORMAT_HEX;
+			else if (!strcmp(&argv[argi][9], "ihex"))
+				opts.format = STMDFU_FORMAT_IHEX;
+			else
+			{
+				printf("unknown format <%s>\n", &argv[argi][9]);
+				stmdfu_usage();
+				return -1;
+			}
+		} else if (!strncmp(argv[argi], "--path", 6) && ((argv[argi][6] == '=') || ((argv[argi][6] == 0) && (argi+1 < argc))))
+		{
+			opts.filter.path = (argv[argi][6] == '=') ? &argv[argi][7] : argv[++argi];
+		} else if (!strncmp(argv[argi], "--serial", 8) && ((argv[argi][8] == '=') || ((argv[argi][8] == 0) && (argi+1 < argc))))
+		{
+			opts.filter.serial = (argv[argi][8] == '=') ? &argv[argi][9] : argv[++argi];
+		} else if (!strncmp(argv[argi], "--target", 8) && ((argv[argi][8] == '=') || ((argv[argi][8] == 0) && (argi+1 < argc))))
+		{
+			opts.targets = (argv[argi][8] == '=') ? &argv[argi][9] : argv[++argi];
+		} else if (!strncmp(argv[argi], "--sim", 5) && ((argv[argi][5] == '=') || (argv[argi][5] == 0)))
+		{
+			opts.simspec = (argv[argi][5] == '=') ? &argv[argi][6] : "";
+		} else
+		{
+			printf("unknown option <%s>\n", argv[argi]);
+			stmdfu_usage();
+			return -1;
+		}
+		argi++;
+	}
+	
+	//from here on argv[1] is the command
+	argv += argi - 1;
+	argc -= argi - 1;
+	
+	if (argc < 2)
+	{
+		stmdfu_usage();
+		return -1;
+	}
+	
+	//the daemon finds its own devices as they're plugged in
+	if (!strcmp(argv[1], "daemon"))
+	{
+		if (argc < 3)
+		{
+			stmdfu_usage();
+			return -1;
+		}
+		
+		return stmdfu_run_daemon(opts.simspec, argv[2], (argc > 3) ? argv[3] : STMDFU_STEPS_DEFAULT);
+	}
+	
+	//before any device is opened, or --all would say it once per device
+	if (!stmdfu_args_ok(argc, argv))
+	{
+		stmdfu_usage();
+		return -1;
+	}
+	
+	//with --all every device runs the command at once, on its own thread
+	if (opts.all)
+	{
+		dfu_device ** devices;
+		int ndevices, i, rv;
+		
+		devices = stmdfu_init_all(opts.simspec, &ndevices);
+		rv = stmdfu_run_all(devices, ndevices, argc, argv);
+		
+		for (i=0; i<ndevices; i++)
+		{
+			if (opts.pollstats)
+			{
+				printf("%s:\n", devices[i]->location);
+				dfu_poll_report(devices[i]);
+				
+				if (devices[i]->transport == &dfusim_transport)
+					dfusim_report(devices[i]);
+			}
+			cleanup(devices[i]);
+		}
+		free(devices);
+		
+		return rv;
+	}
+	
+	dfu_device * dfudev = stmdfu_init_dfu(opts.simspec);
+	
+	int rv = stmdfu_run(dfudev, argc, argv);
+	
+	if (opts.pollstats)
+	{
+		dfu_poll_report(dfudev);
+		
+		if (dfudev->transport == &dfusim_transport)
+			dfusim_report(dfudev);
+	}
+	
+	cleanup(dfudev);
+	
+	//non-zero on failure, for scripts and the stm32flash wrapper
+	return rv;
+}
+
+/*
+stmdfu_run() runs the command in argv[1] on a device that's ready for
+it. Returns 0 on success, < 0 on failure or an unknown command.
+*/
+int stmdfu_run(dfu_device * dfudev, int argc, char * argv[])
+{
+	int rv = -1;
+	
+	if (!stmdfu_args_ok(argc, argv))
+	{
+		stmdfu_usage();
+		return -1;
+	}
 	
 	if (!strcmp(argv[1], "flash"))
 	{
-		stmdfu_write_image(dfudev, argv[2]);
+		rv = stmdfu_write_image(dfudev, argv[2]);
+	}
+	
+	if (!strcmp(argv[1], "update"))
+	{
+		rv = stmdfu_update(dfudev, argv[2]);
+	}
+	
+	if (!strcmp(argv[1], "verify"))
+	{
+		rv = stmdfu_verify(dfudev, argv[2]);
 	}
 	
 	if (!strcmp(argv[1], "dump"))
+	{
+		uint32_t address = strtoul(argv[2], NULL, 0);
+		uint32_t size = strtoul(argv[3], NULL, 0);
+		
+		if (size < 1)
+			size = 1;
+		
+		rv = stmdfu_read_flash(dfudev, address, size, (argc > 4) ? argv[4] : NULL, opts.format);
+	}
+	
+	if (!strcmp(argv[1], "optbytes"))
+	{
+		stmdfu_read_optbytes(dfudev);
+		rv = 0;
+	}
+	
+	if (!strcmp(argv[1], "erase"))
 	{
 		int address = strtol(argv[2], NULL, 0);
-		int size = strtol(argv[3], NULL, 0);
 		
 		if (address < 0)
 			address = 0;
 		
-		if (size < 1)
-			size = 1;
+		rv = stmdfu_erase(dfudev, address);
+	}
+	
+	if (!strcmp(argv[1], "masserase"))
+	{
+		rv = stmdfu_mass_erase(dfudev);
+	}
+	
+	if (!strcmp(argv[1], "leave"))
+	{
+		rv = stmdfu_leave(dfudev);
+	}
+	
+	return rv;
+}
+
+/*
+stmdfu_args_ok() returns 1 if argv[1] is a command stmdfu_run() knows,
+with the arguments it needs, 0 if it isn't.
+*/
+int stmdfu_args_ok(int argc, char * argv[])
+{
+	if (!strcmp(argv[1], "flash") || !strcmp(argv[1], "update") ||
+		!strcmp(argv[1], "verify") || !strcmp(argv[1], "erase"))
+		return argc > 2;
+	
+	if (!strcmp(argv[1], "dump"))
+		return argc > 3;
+	
+	return !strcmp(argv[1], "optbytes") || !strcmp(argv[1], "masserase") ||
+		!strcmp(argv[1], "leave");
+}
+
+/*
+stmdfu_usage() prints the command line help.
+*/
+void stmdfu_usage()
+{
+	printf("usage: stmdfu [options] <command> [arguments]\n"
+			"commands:\n"
+			"\tflash <file.dfuse>\n"
+			"\tupdate <file.dfuse>\trewrite only the pages that changed\n"
+			"\tverify <file.dfuse>\n"
+			"\tdump <address> <size> [file]\tto stdout if no file is given\n"
+			"\toptbytes\n"
+			"\terase <address>\n"
+			"\tmasserase\n"
+			"\tleave\t\tstart the application, leaving dfu mode\n"
+			"\tdaemon <file.dfuse> [steps]\tfor every bootloader plugged in, run\n"
+			"\t\t\tthe comma separated steps: erase, flash, update, verify,\n"
+			"\t\t\tleave (default " STMDFU_STEPS_DEFAULT ")\n"
+			"\tflash, update, verify and daemon also take .elf, .hex and .srec\n"
+			"\tfiles, which carry their own addresses\n"
+			"\tpacked files (bintodfu -z) are decoded as they're downloaded\n"
+			"\ta delta file (bintodfu -d) is only applied to a device that holds\n"
+			"\tits base, flash applies it like update\n"
+			"options:\n"
+			"\t--adaptive-poll\tlearn the real busy time of each operation instead of\n"
+			"\t\t\tsleeping for the full bwPollTimeout\n"
+			"\t--poll-stats\tprint poll latencies and time spent sleeping vs transferring\n"
+			"\t--sparse\tdon't download blocks that are all 0xff (flash must be erased)\n"
+			"\t--erase\t\terase the sectors being flashed first, with a mass erase\n"
+			"\t\t\tinstead only if they cover nearly all of flash and that's\n"
+			"\t\t\testimated to be faster\n"
+			"\t--all\t\trun the command on every connected device at once, and\n"
+			"\t\t\tsummarise the results (not for dump or optbytes)\n"
+			"\t--format=raw|hex|ihex\tdump format, raw to a file and hex to\n"
+			"\t\t\tstdout by default\n"
+			"\t--path <bus-port>\tonly the device at this usb path, e.g. 1-4.2\n"
+			"\t--serial <serial>\tonly the device with this usb serial number\n"
+			"\t--target <n|name>[,...]\tonly these targets of the file, by position\n"
+			"\t\t\tor name, reading nothing else of it (nor its crc)\n"
+			"\t--sim[=spec]\ttalk to a simulated STM32 bootloader instead of usb,\n"
+			"\t\t\te.g. --sim=file=board.bin,flash=512K,program_us=20000\n"
+			"\t\t\tor an F4 layout, --sim=sectors=04*016Kg+01*064Kg+07*128Kg\n"
+			"\t\t\twith --all or daemon, ; separates the specs of several devices\n");
+}
+
+/*
+stmdfu_now() returns a monotonic timestamp in seconds.
+*/
+double stmdfu_now()
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+stmdfu_load_dfuse() maps a whole dfuse file into memory (see
+dfuse_map()). With --target only its headers are read (see
+dfuse_index()), then the data of the targets picked. ELF, Intel HEX and
+S-record files are decoded (see dfuinput.h) into a dfuse file with one
+target, for internal flash. A plain .bin has no addresses to go by, so
+needs bintodfu first. Returns NULL if the file can't be opened or is
+malformed.
+*/
+dfuse_file * stmdfu_load_dfuse(char * file)
+{
+	dfuinput_image * image;
+	dfuse_file * dfusefile;
+	char signature[5];
+	int fd;
+	
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("error opening <%s>\n", file);
+		return NULL;
+	}
+	
+	if ((sizeof(signature) == read(fd, signature, sizeof(signature))) &&
+		(!memcmp(signature, "DfuSe", sizeof(signature)) || !memcmp(signature, DFULZ_SIGNATURE, sizeof(signature))))
+	{
+		close(fd);
+		if (NULL == opts.targets)
+			return dfuse_map(file);
+		
+		//only the targets picked are read in
+		dfusefile = dfuse_index(file);
+		if ((NULL != dfusefile) &&
+			((0 == stmdfu_select_targets(dfusefile)) || (0 != dfuse_load_elements(dfusefile))))
+		{
+			dfuse_struct_cleanup(dfusefile);
+			dfusefile = NULL;
+		}
+		
+		return dfusefile;
+	}
+	
+	lseek(fd, 0, SEEK_SET);
+	image = dfuinput_load(fd, file, 0, 0);
+	close(fd);
+	if (NULL == image)
+		return NULL;
+	
+	if (DFUINPUT_FORMAT_BIN == image->format)
+	{
+		printf("<%s> isn't a dfuse, ELF, Intel HEX or S-record file, "
+				"use bintodfu to say where a .bin goes\n", file);
+		dfuinput_free(image);
+		return NULL;
+	}
+	
+	dfusefile = dfuinput_dfuse(image);
+	dfuinput_free(image);
+	if (NULL == dfusefile)
+		return NULL;
+	
+	if ((NULL != opts.targets) && (0 == stmdfu_select_targets(dfusefile)))
+	{
+		dfuse_struct_cleanup(dfusefile);
+		return NULL;
+	}
+	
+	return dfusefile;
+}
+
+/*
+stmdfu_target_picked() returns 1 if target number index, with prefix
+tarprefix, is in the comma separated list of --target: a number is a
+position in the file, anything else a target name.
+*/
+static int stmdfu_target_picked(int index, dfuse_target_prefix * tarprefix)
+{
+	char name[sizeof(tarprefix->target_name) + 1];
+	const char * spec = opts.targets;
+	const char * comma;
+	char * end;
+	size_t length;
+	
+	//the name needn't be terminated in the file
+	memcpy(name, tarprefix->target_name, sizeof(tarprefix->target_name));
+	name[sizeof(tarprefix->target_name)] = 0;
+	
+	for (; NULL != spec; spec = comma ? comma + 1 : NULL)
+	{
+		comma = strchr(spec, ',');
+		length = comma ? (size_t)(comma - spec) : strlen(spec);
+		
+		if ((length > 0) && (index == strtol(spec, &end, 0)) && (end == spec + length))
+			return 1;
 		
-		stmdfu_read_flash(dfudev, address, size);
+		if (tarprefix->target_named && (length == strlen(name)) && !strncmp(spec, name, length))
+			return 1;
+	}
+	
+	return 0;
+}
+
+int stmdfu_select_targets(dfuse_file * dfusefile)
+{
+	int i, index;
+	
+	for (i=0, index=0; i<dfusefile->prefix->targets; index++)
+	{
+		if (stmdfu_target_picked(index, dfusefile->images[i]->tarprefix))
+			i++;
+		else
+			dfuse_droptarget(dfusefile, i);
+	}
+	
+	if (0 == dfusefile->prefix->targets)
+		printf("no target matches --target %s\n", opts.targets);
+	
+	return dfusefile->prefix->targets;
+}
+
+/*
+stmdfu_segment_cmp() orders segments by alternate setting, then address.
+*/
+static int stmdfu_segment_cmp(const void * a, const void * b)
+{
+	const stmdfu_segment * sa = (const stmdfu_segment *)a;
+	const stmdfu_segment * sb = (const stmdfu_segment *)b;
+	
+	if (sa->alternate != sb->alternate)
+		return (sa->alternate < sb->alternate) ? -1 : 1;
+	
+	if (sa->element->element_address != sb->element->element_address)
+		return (sa->element->element_address < sb->element->element_address) ? -1 : 1;
+	
+	return 0;
+}
+
+/*
+stmdfu_sort_elements() lists every image element of every target in a
+dfuse file, sorted by alternate setting and then address. Returns NULL
+if two elements of the same alternate setting overlap.
+*/
+stmdfu_segment * stmdfu_sort_elements(dfuse_file * dfusefile, uint32_t * nsegments)
+{
+	stmdfu_segment * segments;
+	uint32_t n = 0;
+	int i, j;
+	
+	for (i=0; i<dfusefile->prefix->targets; i++)
+		n += dfusefile->images[i]->tarprefix->num_elements;
+	
+	segments = (stmdfu_segment *)malloc(sizeof(stmdfu_segment) * (n ? n : 1));
+	
+	n = 0;
+	for (i=0; i<dfusefile->prefix->targets; i++)
+	{
+		for (j=0; j<dfusefile->images[i]->tarprefix->num_elements; j++)
+		{
+			segments[n].alternate = dfusefile->images[i]->tarprefix->alternate_setting;
+			segments[n].target = i;
+			segments[n].element = dfusefile->images[i]->imgelement[j];
+			n++;
+		}
+	}
+	
+	qsort(segments, n, sizeof(stmdfu_segment), stmdfu_segment_cmp);
+	
+	for (i=1; i<n; i++)
+	{
+		if ((segments[i].alternate == segments[i-1].alternate) &&
+			(segments[i].element->element_address <
+			 segments[i-1].element->element_address + segments[i-1].element->element_size))
+		{
+			printf("elements at 0x%.8x and 0x%.8x overlap\n",
+					segments[i-1].element->element_address, segments[i].element->element_address);
+			free(segments);
+			return NULL;
+		}
+	}
+	
+	*nsegments = n;
+	
+	return segments;
+}
+
+/*
+stmdfu_select_alt() switches the device to alternate setting alt,
+unless *current already is alt, and leaves it idle. Returns 0 on
+success.
+*/
+int stmdfu_select_alt(dfu_device * dfudev, int * current, int alt)
+{
+	if (*current == alt)
+		return 0;
+	
+	if (0 > dfu_set_alternate(dfudev, alt))
+	{
+		printf("couldn't select alternate setting %d\n", alt);
+		return -1;
+	}
+	
+	*current = alt;
+	dfu_make_idle(dfudev, 0);
+	
+	return 0;
+}
+
+/*
+stmdfu_write_segment() writes length bytes of data to address in one
+address pointer session. With sparse set, blank blocks are skipped.
+Returns 0 on success.
+*/
+int stmdfu_write_segment(dfu_device * dfudev, uint32_t address, uint8_t * data, uint32_t length, int sparse)
+{
+	uint32_t skipped;
+	int32_t rv;
+	
+	//blocks are numbered from wherever the pointer is, so nothing can
+	//be downloaded unless it's been set
+	if (0 != dfu_set_address_pointer(dfudev, address))
+	{
+		printf("couldn't set the address pointer to 0x%.8x, not writing\n", address);
+		dfu_make_idle(dfudev, 0);
+		return -1;
+	}
+	
+	dfu_make_idle(dfudev, 0);
+	
+	//dfu_write_flash() pads a short final block to DFU_WRITE_ALIGN
+	if (sparse)
+	{
+		rv = dfu_write_flash_sparse(dfudev, data, length, &skipped);
+		if (0 == rv)
+		{
+			printf("skipped %u blank blocks\n", skipped);
+		}
+	} else
+	{
+		rv = dfu_write_flash(dfudev, data, length);
+	}
+	
+	return (rv < 0) ? -1 : 0;
+}
+
+/*
+stmdfu_write_packed() writes a packed element (see dfulz.h) in one
+address pointer session, each download block decoded straight into its
+buffer as it's staged. Returns 0 on success.
+*/
+int stmdfu_write_packed(dfu_device * dfudev, dfuse_image_element * element)
+{
+	dfulz_reader reader;
+	int32_t rv;
+	
+	if (0 != dfu_set_address_pointer(dfudev, element->element_address))
+	{
+		printf("couldn't set the address pointer to 0x%.8x, not writing\n", element->element_address);
+		dfu_make_idle(dfudev, 0);
+		return -1;
+	}
+	
+	dfu_make_idle(dfudev, 0);
+	
+	dfulz_reader_init(&reader, element->packed);
+	rv = dfu_write_flash_stream(dfudev, element->element_size, dfulz_read, &reader);
+	dfulz_reader_free(&reader);
+	
+	return (rv < 0) ? -1 : 0;
+}
+
+/*
+stmdfu_write_image() is a wrapper function that flashes every image
+element of a dfuse file to an attached stm32 device via usb dfu. Each
+target goes to its alternate setting, elements are written in address
+order, and elements that follow on from each other are written in one
+address pointer session, except packed elements, which are decoded as
+they're downloaded (see stmdfu_write_packed()). A delta file is handed
+to stmdfu_update(). Returns 0 on success.
+*/
+int stmdfu_write_image(dfu_device * dfudev, char * file)
+{
+	stmdfu_segment * segments;
+	dfuse_delta delta;
+	dfuse_image_element * element;
+	dfu_sector * sectors;
+	uint32_t nsegments, nsectors;
+	uint32_t start, end;
+	uint32_t address, length, offset;
+	uint32_t i, k, p;
+	uint8_t * need;
+	uint8_t * data;
+	int alt = -1;
+	int rv;
+	int failed = 0;
+	
+	dfuse_file * dfusefile = stmdfu_load_dfuse(file);
+	if (NULL == dfusefile)
+		return -1;
+	
+	//a delta's pages are rarely whole sectors, and the rest of each
+	//sector has to survive, which is what an update does
+	for (i=0; i<dfusefile->prefix->targets; i++)
+	{
+		if (0 == dfuse_delta_parse(dfusefile->images[i]->tarprefix, &delta))
+		{
+			dfuse_struct_cleanup(dfusefile);
+			return stmdfu_update(dfudev, file);
+		}
+	}
+	
+	segments = stmdfu_sort_elements(dfusefile, &nsegments);
+	if ((NULL == segments) || (0 == nsegments))
+	{
+		if (NULL != segments)
+			printf("nothing to flash in <%s>\n", file);
+		free(segments);
+		dfuse_struct_cleanup(dfusefile);
+		return -1;
+	}
+	
+	//check every element against the device's layout before anything
+	//is erased or written
+	for (i=0; i<nsegments; i++)
+	{
+		if (0 != dfu_check_range(dfudev, segments[i].element->element_address,
+								segments[i].element->element_size, DFU_SECTOR_WRITEABLE))
+		{
+			printf("not flashing <%s>\n", file);
+			free(segments);
+			dfuse_struct_cleanup(dfusefile);
+			return -1;
+		}
 	}
 	
-	if (!strcmp(argv[1], "optbytes"))
+	//the page cache can't follow a plain flash, the next update reads
+	//everything back and starts it again
+	dfu_page_cache_forget(dfudev);
+	
+	//only internal flash (alternate setting 0) is erased by us, the
+	//bootloader erases option bytes itself when they're written
+	if (opts.erase && (segments[0].alternate == 0))
+	{
+		start = segments[0].element->element_address;
+		end = start;
+		for (i=0; (i<nsegments) && (segments[i].alternate == 0); i++)
+		{
+			end = segments[i].element->element_address + segments[i].element->element_size;
+		}
+		
+		sectors = stmdfu_sectors(dfudev, start, end, &nsectors);
+		
+		//nothing is known about the flash, every sector an element touches is erased
+		need = (uint8_t *)calloc(nsectors ? nsectors : 1, 1);
+		for (i=0; (i<nsegments) && (segments[i].alternate == 0); i++)
+		{
+			element = segments[i].element;
+			for (p=0; p<nsectors; p++)
+			{
+				if ((sectors[p].address < element->element_address + element->element_size) &&
+					(sectors[p].address + sectors[p].size > element->element_address))
+				{
+					need[p] = 1;
+				}
+			}
+		}
+		
+		rv = stmdfu_plan_erase(dfudev, sectors, nsectors, need, 1);
+		free(need);
+		free(sectors);
+		
+		if (rv)
+		{
+			printf("erase failed, not flashing\n");
+			free(segments);
+			dfuse_struct_cleanup(dfusefile);
+			return -1;
+		}
+	}
+	
+	for (i=0; i<nsegments; i=k)
+	{
+		if (stmdfu_select_alt(dfudev, &alt, segments[i].alternate))
+		{
+			failed = 1;
+			break;
+		}
+		
+		address = segments[i].element->element_address;
+		length = segments[i].element->element_size;
+		
+		//a packed element is decoded as it's downloaded, on its own
+		if (NULL != segments[i].element->packed)
+		{
+			k = i+1;
+			if (0 == stmdfu_write_packed(dfudev, segments[i].element))
+			{
+				printf("flashed 0x%.8x-0x%.8x (alt %d, packed)\n", address, address + length, alt);
+			} else
+			{
+				printf("flashing 0x%.8x-0x%.8x (alt %d) failed\n", address, address + length, alt);
+				failed = 1;
+			}
+			continue;
+		}
+		
+		for (k=i+1; (k<nsegments) && (segments[k].alternate == alt) &&
+			 (NULL == segments[k].element->packed) &&
+			 (segments[k].element->element_address == address + length); k++)
+		{
+			length += segments[k].element->element_size;
+		}
+		
+		//contiguous elements are joined into one buffer, one session
+		data = segments[i].element->data;
+		if (k > i+1)
+		{
+			data = (uint8_t *)malloc(length);
+			for (offset=0, p=i; p<k; p++)
+			{
+				memcpy(&data[offset], segments[p].element->data, segments[p].element->element_size);
+				offset += segments[p].element->element_size;
+			}
+		}
+		
+		if (0 == stmdfu_write_segment(dfudev, address, data, length, opts.sparse))
+		{
+			printf("flashed 0x%.8x-0x%.8x (alt %d, %u elements)\n", address, address + length, alt, k-i);
+		} else
+		{
+			printf("flashing 0x%.8x-0x%.8x (alt %d) failed\n", address, address + length, alt);
+			failed = 1;
+		}
+		
+		if (data != segments[i].element->data)
+			free(data);
+	}
+	
+	free(segments);
+	dfuse_struct_cleanup(dfusefile);
+	
+	return failed ? -1 : 0;
+}
+
+/*
+stmdfu_sectors() returns a newly allocated list of the flash sectors
+that overlap [start, end), and their number in nsectors.
+*/
+dfu_sector * stmdfu_sectors(dfu_device * dfudev, uint32_t start, uint32_t end, uint32_t * nsectors)
+{
+	uint32_t n = dfu_list_sectors(dfudev, start, end, NULL, 0);
+	dfu_sector * sectors = (dfu_sector *)malloc(sizeof(dfu_sector) * (n ? n : 1));
+	
+	*nsectors = dfu_list_sectors(dfudev, start, end, sectors, n);
+	
+	return sectors;
+}
+
+/*
+stmdfu_plan_erase() erases the sectors flagged in need[], whichever way
+the device family's cached erase model says is fastest. allow_mass says
+whether a mass erase is acceptable, and even then it's only done for
+sectors that cover nearly all the flash. Returns 0 on success.
+*/
+int stmdfu_plan_erase(dfu_device * dfudev, dfu_sector * sectors, uint32_t nsectors, uint8_t * need, int allow_mass)
+{
+	dfu_erase_model model;
+	dfu_erase_plan plan;
+	int32_t rv;
+	
+	dfu_erase_model_load(&model, dfudev->family);
+	
+	plan = dfu_erase_plan_make(&model, sectors, nsectors, need, allow_mass, dfu_flash_size(dfudev));
+	rv = dfu_erase_plan_run(dfudev, &model, &plan, sectors, nsectors, need);
+	
+	dfu_erase_plan_print(&plan);
+	
+	if (0 == rv)
+		dfu_erase_model_save(&model);
+	
+	return rv;
+}
+
+/*
+stmdfu_readback() reads length bytes from address into a newly
+allocated buffer, leaving the device idle. Returns NULL on failure.
+*/
+uint8_t * stmdfu_readback(dfu_device * dfudev, uint32_t address, uint32_t length)
+{
+	uint8_t * membuf;
+	
+	//reading from wherever the pointer was left would hand back the
+	//wrong bytes as if they were these
+	if (0 != dfu_set_address_pointer(dfudev, address))
+	{
+		dfu_make_idle(dfudev, 0);
+		return NULL;
+	}
+	
+	dfu_make_idle(dfudev, 0);
+	
+	membuf = (uint8_t *)malloc(length);
+	if (NULL == membuf)
+		return NULL;
+	
+	if (0 > dfu_read_flash(dfudev, membuf, length))
+	{
+		free(membuf);
+		membuf = NULL;
+	}
+	
+	dfu_make_idle(dfudev, 0);
+	
+	return membuf;
+}
+
+/*
+stmdfu_update_sample() picks which sectors to read back when the page
+cache knows them all: the first and last, if the element only partly
+covers them (their contents outside the element are needed anyway), and
+DFU_PAGE_CACHE_SAMPLES others at random, to check the cache against.
+*/
+static void stmdfu_update_sample(dfu_sector * sectors, uint32_t nsectors, dfuse_image_element * element, uint8_t * sample)
+{
+	unsigned int seed = time(NULL) ^ getpid() ^ element->element_address;
+	uint32_t p, n;
+	
+	if (sectors[0].address < element->element_address)
+		sample[0] = 1;
+	if (sectors[nsectors-1].address + sectors[nsectors-1].size > element->element_address + element->element_size)
+		sample[nsectors-1] = 1;
+	
+	for (n=0; (n<DFU_PAGE_CACHE_SAMPLES) && (n<nsectors); n++)
+	{
+		p = rand_r(&seed) % nsectors;
+		sample[p] = 1;
+	}
+}
+
+/*
+stmdfu_update_element() rewrites the flash sectors of one image element
+that differ from what's already on the device. The sectors the element
+covers are hashed against the new data, and only the sectors whose
+hashes differ are erased and rewritten. If cache (which may be NULL)
+knows every sector's hash, only a sample are read back to check it, and
+if any has drifted the cache is cleared and every sector is read back.
+held, if not NULL, is what the sectors hold, already read back, and
+nothing is. The cache is updated with what the sectors hold afterwards.
+full is the bytes a full flash would write, which for a delta is the
+whole image rather than the element, so its caller passes 0 and makes
+the estimate itself. Returns 0 on success.
+*/
+int stmdfu_update_element(dfu_device * dfudev, dfuse_image_element * element, dfu_page_cache * cache,
+							uint8_t * held, uint32_t full)
+{
+	dfu_sector * sectors;
+	uint32_t start, end, length;
+	uint32_t nsectors, ndirty = 0, nerased = 0, nwritten = 0, nread = 0;
+	uint32_t written = 0;
+	uint32_t p, q, offset, runlength;
+	uint8_t * wanted;
+	uint8_t * current;
+	uint8_t * sector;
+	uint8_t * blank;
+	uint8_t * dirty;
+	uint8_t * need;
+	uint8_t * read;
+	uint8_t * done;
+	uint64_t * hashes;
+	uint64_t * cached;
+	int known = (NULL != cache) && (NULL == held);
+	double t0, t1, t2, t3;
+	double program_ms, full_ms;
+	
+	if (0 != dfu_check_range(dfudev, element->element_address, element->element_size, DFU_SECTOR_WRITEABLE))
+		return -1;
+	
+	//work in whole erase sectors
+	sectors = stmdfu_sectors(dfudev, element->element_address, element->element_address + element->element_size, &nsectors);
+	start = sectors[0].address;
+	end = sectors[nsectors-1].address + sectors[nsectors-1].size;
+	length = end - start;
+	
+	t0 = stmdfu_now();
+	
+	current = (uint8_t *)malloc(length);
+	read = (uint8_t *)calloc(nsectors, 1);
+	hashes = (uint64_t *)malloc(sizeof(uint64_t) * nsectors);
+	
+	//what each sector holds now: from the cache where it knows, checked
+	//against a sample read back from the device
+	for (p=0; known && (p<nsectors); p++)
+	{
+		cached = dfu_page_cache_lookup(cache, sectors[p].address, sectors[p].size);
+		if (NULL == cached)
+			known = 0;
+		else
+			hashes[p] = *cached;
+	}
+	
+	if (known)
+	{
+		stmdfu_update_sample(sectors, nsectors, element, read);
+		
+		for (p=0; p<nsectors; p++)
+		{
+			if (!read[p])
+				continue;
+			
+			offset = sectors[p].address - start;
+			sector = stmdfu_readback(dfudev, sectors[p].address, sectors[p].size);
+			if (NULL != sector)
+			{
+				memcpy(&current[offset], sector, sectors[p].size);
+				free(sector);
+				nread++;
+			}
+			
+			if ((NULL == sector) || (dfuse_pagehash(&current[offset], sectors[p].size) != hashes[p]))
+			{
+				printf("update: page cache is out of date at 0x%.8x, reading back every sector\n",
+						sectors[p].address);
+				dfu_page_cache_clear(cache);
+				known = 0;
+				break;
+			}
+		}
+	}
+	
+	if (!known)
+	{
+		if (NULL != held)
+		{
+			memcpy(current, held, length);
+		} else
+		{
+			free(current);
+			current = stmdfu_readback(dfudev, start, length);
+			if (NULL == current)
+			{
+				printf("update failed: couldn't read back 0x%.8x-0x%.8x\n", start, end);
+				free(hashes);
+				free(read);
+				free(sectors);
+				return -1;
+			}
+		}
+		
+		memset(read, 1, nsectors);
+		nread = nsectors;
+		for (p=0; p<nsectors; p++)
+			hashes[p] = dfuse_pagehash(&current[sectors[p].address - start], sectors[p].size);
+	}
+	
+	//what the sectors should hold: the image, and whatever is there now
+	//in the parts of the first and last sector the image doesn't cover
+	//(which have always been read back)
+	wanted = (uint8_t *)malloc(length);
+	memcpy(wanted, current, length);
+	memcpy(&wanted[element->element_address - start], element->data, element->element_size);
+	
+	//a dirty sector that's already blank can be written without erasing it
+	blank = NULL;
+	dirty = (uint8_t *)calloc(nsectors, 1);
+	need = (uint8_t *)calloc(nsectors, 1);
+	for (p=0; p<nsectors; p++)
+	{
+		offset = sectors[p].address - start;
+		dirty[p] = (hashes[p] != dfuse_pagehash(&wanted[offset], sectors[p].size));
+		
+		if (dirty[p] && read[p])
+		{
+			need[p] = !dfuse_isblank(&current[offset], sectors[p].size);
+		} else if (dirty[p])
+		{
+			blank = (uint8_t *)realloc(blank, sectors[p].size);
+			memset(blank, 0xff, sectors[p].size);
+			need[p] = (hashes[p] != dfuse_pagehash(blank, sectors[p].size));
+		}
+		
+		ndirty += dirty[p];
+		nerased += need[p];
+	}
+	free(blank);
+	
+	t1 = stmdfu_now();
+	
+	//a mass erase would take the rest of flash with it
+	if (stmdfu_plan_erase(dfudev, sectors, nsectors, need, 0))
+	{
+		printf("update failed: erase failed\n");
+		if (NULL != cache)
+			dfu_page_cache_clear(cache);
+		free(need);
+		free(dirty);
+		free(wanted);
+		free(current);
+		free(hashes);
+		free(read);
+		free(sectors);
+		return -1;
+	}
+	
+	t2 = stmdfu_now();
+	
+	//each run of consecutive dirty sectors is one address pointer session
+	done = (uint8_t *)calloc(nsectors, 1);
+	for (p=0; p<nsectors; p=q)
+	{
+		if (!dirty[p])
+		{
+			q = p+1;
+			continue;
+		}
+		
+		runlength = 0;
+		for (q=p; (q<nsectors) && dirty[q]; q++)
+			runlength += sectors[q].size;
+		
+		//the sectors were just erased, blank blocks can be left out
+		offset = sectors[p].address - start;
+		if (0 == stmdfu_write_segment(dfudev, sectors[p].address, &wanted[offset], runlength, 1))
+		{
+			memset(&done[p], 1, q-p);
+			nwritten += q-p;
+			written += runlength;
+		}
+	}
+	
+	t3 = stmdfu_now();
+	
+	//the cache gets what each sector holds now, a sector that failed to
+	//write holds who knows what
+	for (p=0; (NULL != cache) && (p<nsectors); p++)
+	{
+		offset = sectors[p].address - start;
+		if (!dirty[p])
+			dfu_page_cache_set(cache, sectors[p].address, sectors[p].size, hashes[p]);
+		else if (done[p])
+			dfu_page_cache_set(cache, sectors[p].address, sectors[p].size, dfuse_pagehash(&wanted[offset], sectors[p].size));
+		else
+			dfu_page_cache_drop(cache, sectors[p].address);
+	}
+	
+	//what a mass erase and a full write of every sector would have cost
+	program_ms = written ? ((t3 - t2) * 1000 / written) : ((double)STM32_PAGE_PROGRAM_MS / STM32_PAGE_SIZE);
+	full_ms = STM32_MASS_ERASE_MS + full * program_ms;
+	
+	printf("update 0x%.8x-0x%.8x: %u sectors, %u unchanged, %u erased, %u written\n",
+			start, end, nsectors, nsectors - ndirty, nerased, nwritten);
+	printf("readback %.0f ms (%u of %u sectors%s), erase %.0f ms, write %.0f ms, total %.0f ms\n",
+			(t1 - t0) * 1000, nread, nsectors, known ? ", page cache" : "",
+			(t2 - t1) * 1000, (t3 - t2) * 1000, (t3 - t0) * 1000);
+	if (full)
+		printf("estimated mass erase + full flash %.0f ms, saved %.0f ms\n",
+				full_ms, full_ms - (t3 - t0) * 1000);
+	
+	free(done);
+	free(need);
+	free(dirty);
+	free(wanted);
+	free(current);
+	free(hashes);
+	free(read);
+	free(sectors);
+	
+	return (nwritten == ndirty) ? 0 : -1;
+}
+
+/*
+stmdfu_check_delta() checks every delta target of dfusefile (see
+dfuse_delta) before anything is written: what the pages it replaces hold
+now has to hash to the base the delta was made from, or to the delta
+itself if it's already been applied. Only those pages are read back, in
+internal flash as the whole sectors of each element, which are kept in
+held[] (by segment) for stmdfu_update_element() to start from. Returns 0
+if every delta target matches, or there are none.
+*/
+static int stmdfu_check_delta(dfu_device * dfudev, dfuse_file * dfusefile, stmdfu_segment * segments,
+								uint32_t nsegments, uint8_t ** held)
+{
+	dfuse_delta delta;
+	dfuse_image_element * element;
+	dfu_sector * sectors;
+	uint64_t hash, applied;
+	uint32_t address, covered, lo, hi, start;
+	uint32_t nsectors, s;
+	uint8_t * current;
+	uint32_t k;
+	int keep;
+	int alt = -1;
+	int i;
+	
+	for (i=0; i<dfusefile->prefix->targets; i++)
+	{
+		if (0 != dfuse_delta_parse(dfusefile->images[i]->tarprefix, &delta))
+			continue;
+		
+		if (stmdfu_select_alt(dfudev, &alt, dfusefile->images[i]->tarprefix->alternate_setting))
+			return -1;
+		
+		hash = DFUSE_PAGEHASH_INIT;
+		applied = DFUSE_PAGEHASH_INIT;
+		address = delta.address;
+		covered = delta.address + delta.covered;
+		for (k=0; k<dfusefile->images[i]->tarprefix->num_elements; k++)
+		{
+			element = dfusefile->images[i]->imgelement[k];
+			if ((element->element_address < address) ||
+				(element->element_size > delta.address + delta.length - element->element_address))
+			{
+				printf("delta target %d has an element out of order or out of range\n", i);
+				return -1;
+			}
+			address = element->element_address + element->element_size;
+			
+			//the base says nothing about pages past what it covered
+			lo = element->element_address;
+			hi = (address < covered) ? address : covered;
+			if (lo >= hi)
+				continue;
+			
+			if ((0 != dfu_check_range(dfudev, lo, hi - lo, DFU_SECTOR_READABLE)) ||
+				(0 != dfulz_unpack(element)))
+			{
+				return -1;
+			}
+			
+			for (s=0; (s<nsegments) && (segments[s].element != element); s++);
+			keep = (alt == 0) && (s < nsegments);
+			
+			if (keep)
+			{
+				sectors = stmdfu_sectors(dfudev, lo, address, &nsectors);
+				start = sectors[0].address;
+				current = stmdfu_readback(dfudev, start, sectors[nsectors-1].address + sectors[nsectors-1].size - start);
+				free(sectors);
+				held[s] = current;
+			} else
+			{
+				start = lo;
+				current = stmdfu_readback(dfudev, lo, hi - lo);
+			}
+			
+			if (NULL == current)
+			{
+				dfulz_drop(element);
+				return -1;
+			}
+			
+			hash = dfuse_pagehash_update(hash, &current[lo - start], hi - lo);
+			applied = dfuse_pagehash_update(applied, element->data, hi - lo);
+			
+			if (!keep)
+				free(current);
+			dfulz_drop(element);
+		}
+		
+		if (hash == delta.hash)
+		{
+			printf("delta base 0x%.8x-0x%.8x (alt %d): matches\n", delta.address, covered, alt);
+		} else if (hash == applied)
+		{
+			printf("delta base 0x%.8x-0x%.8x (alt %d): already applied\n", delta.address, covered, alt);
+		} else
+		{
+			printf("device doesn't hold the base this delta was made from (the pages it replaces in 0x%.8x-0x%.8x hash to %016llx, not %016llx)\n",
+					delta.address, covered, (unsigned long long)hash, (unsigned long long)delta.hash);
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+stmdfu_update() is a wrapper function that flashes only what changed
+between a dfuse file and what's already on the device. Internal flash
+elements are updated sector by sector (see stmdfu_update_element()), other
+targets, like option bytes, are read back and rewritten if they differ.
+A delta file is only applied if the device holds its base (see
+stmdfu_check_delta()). Returns 0 on success.
+*/
+int stmdfu_update(dfu_device * dfudev, char * file)
+{
+	stmdfu_segment * segments;
+	dfuse_image_element * element;
+	uint32_t nsegments;
+	uint32_t i;
+	uint8_t * current;
+	uint8_t ** held;
+	dfu_page_cache cache;
+	dfuse_delta delta;
+	uint32_t deltalength = 0;
+	double deltams = 0, t0, full_ms;
+	int isdelta;
+	int hascache;
+	int alt = -1;
+	int failed = 0;
+	
+	dfuse_file * dfusefile = stmdfu_load_dfuse(file);
+	if (NULL == dfusefile)
+		return -1;
+	
+	segments = stmdfu_sort_elements(dfusefile, &nsegments);
+	held = (uint8_t **)calloc(nsegments ? nsegments : 1, sizeof(uint8_t *));
+	if ((NULL == segments) || (0 != stmdfu_check_delta(dfudev, dfusefile, segments, nsegments, held)))
+	{
+		for (i=0; (NULL != segments) && (i<nsegments); i++)
+			free(held[i]);
+		free(held);
+		free(segments);
+		dfuse_struct_cleanup(dfusefile);
+		return -1;
+	}
+	
+	hascache = (0 == dfu_page_cache_load(&cache, dfudev));
+	
+	for (i=0; i<dfusefile->prefix->targets; i++)
+	{
+		if ((0 == dfusefile->images[i]->tarprefix->alternate_setting) &&
+			(0 == dfuse_delta_parse(dfusefile->images[i]->tarprefix, &delta)))
+			deltalength += delta.length;
+	}
+	
+	for (i=0; i<nsegments; i++)
+	{
+		element = segments[i].element;
+		
+		if (stmdfu_select_alt(dfudev, &alt, segments[i].alternate))
+		{
+			failed = 1;
+			break;
+		}
+		
+		//a packed element is only decoded while it's being updated
+		if (0 != dfulz_unpack(element))
+		{
+			failed = 1;
+			continue;
+		}
+		
+		if (alt == 0)
+		{
+			isdelta = (0 == dfuse_delta_parse(dfusefile->images[segments[i].target]->tarprefix, &delta));
+			t0 = stmdfu_now();
+			if (stmdfu_update_element(dfudev, element, hascache ? &cache : NULL, held[i],
+										isdelta ? 0 : element->element_size))
+				failed = 1;
+			dfulz_drop(element);
+			
+			//a delta's elements are a few pages of one image, so what
+			//it saved is against flashing all of that image
+			if (isdelta)
+				deltams += (stmdfu_now() - t0) * 1000;
+			continue;
+		}
+		
+		current = stmdfu_readback(dfudev, element->element_address, element->element_size);
+		if ((NULL != current) && !memcmp(current, element->data, element->element_size))
+		{
+			printf("update 0x%.8x-0x%.8x (alt %d): unchanged\n",
+					element->element_address, element->element_address + element->element_size, alt);
+		} else if (0 == stmdfu_write_segment(dfudev, element->element_address, element->data, element->element_size, 0))
+		{
+			printf("update 0x%.8x-0x%.8x (alt %d): rewritten\n",
+					element->element_address, element->element_address + element->element_size, alt);
+		} else
+		{
+			failed = 1;
+		}
+		free(current);
+		dfulz_drop(element);
+	}
+	
+	if (deltalength)
+	{
+		full_ms = STM32_MASS_ERASE_MS + deltalength * ((double)STM32_PAGE_PROGRAM_MS / STM32_PAGE_SIZE);
+		printf("delta of a 0x%x byte image: estimated mass erase + full flash %.0f ms, saved %.0f ms\n",
+				deltalength, full_ms, full_ms - deltams);
+	}
+	
+	if (hascache)
+	{
+		dfu_page_cache_save(&cache);
+		dfu_page_cache_free(&cache);
+	}
+	
+	for (i=0; i<nsegments; i++)
+		free(held[i]);
+	free(held);
+	free(segments);
+	dfuse_struct_cleanup(dfusefile);
+	
+	return failed ? -1 : 0;
+}
+
+/*
+stmdfu_verify() is a wrapper function that reads back the memory every
+element of an image covers and compares it against the image. Returns
+0 if they match.
+*/
+int stmdfu_verify(dfu_device * dfudev, char * file)
+{
+	stmdfu_segment * segments;
+	dfuse_image_element * element;
+	uint8_t * current;
+	uint32_t nsegments;
+	uint32_t i, k;
+	uint32_t ndiff = 0;
+	uint32_t nbytes = 0;
+	uint32_t first = 0;
+	int alt = -1;
+	
+	dfuse_file * dfusefile = stmdfu_load_dfuse(file);
+	if (NULL == dfusefile)
+		return -1;
+	
+	segments = stmdfu_sort_elements(dfusefile, &nsegments);
+	if (NULL == segments)
+	{
+		dfuse_struct_cleanup(dfusefile);
+		return -1;
+	}
+	
+	for (k=0; k<nsegments; k++)
+	{
+		element = segments[k].element;
+		
+		if (stmdfu_select_alt(dfudev, &alt, segments[k].alternate) ||
+			(0 != dfu_check_range(dfudev, element->element_address, element->element_size, DFU_SECTOR_READABLE)))
+		{
+			ndiff += element->element_size;
+			continue;
+		}
+		
+		current = stmdfu_readback(dfudev, element->element_address, element->element_size);
+		if (NULL == current)
+		{
+			printf("verify failed: couldn't read back device\n");
+			free(segments);
+			dfuse_struct_cleanup(dfusefile);
+			return -1;
+		}
+		
+		if (0 != dfulz_unpack(element))
+		{
+			ndiff += element->element_size;
+			free(current);
+			continue;
+		}
+		
+		for (i=0; i<element->element_size; i++)
+		{
+			if (current[i] != element->data[i])
+			{
+				if (0 == ndiff++)
+					first = element->element_address + i;
+			}
+		}
+		nbytes += element->element_size;
+		
+		free(current);
+		dfulz_drop(element);
+	}
+	
+	if (ndiff)
+		printf("verify failed: %u bytes differ, first at 0x%.8x\n", ndiff, first);
+	else
+		printf("verify ok: %u bytes in %u elements\n", nbytes, nsegments);
+	
+	free(segments);
+	dfuse_struct_cleanup(dfusefile);
+	
+	return ndiff ? -1 : 0;
+}
+
+/*
+stmdfu_hexdigits is used by the dump formatters, which build lines by
+hand rather than calling printf() for every byte.
+*/
+static const char stmdfu_hexdigits[] = "0123456789ABCDEF";
+
+/*
+stmdfu_put_hex8() writes byte as two hex digits at line, and returns
+the position after them.
+*/
+static char * stmdfu_put_hex8(char * line, uint8_t byte)
+{
+	*line++ = stmdfu_hexdigits[byte >> 4];
+	*line++ = stmdfu_hexdigits[byte & 0x0f];
+	
+	return line;
+}
+
+/*
+stmdfu_ihex_record() writes one intel hex record to sink's output.
+*/
+static void stmdfu_ihex_record(stmdfu_dump_sink * sink, uint8_t type, uint16_t offset, const uint8_t * data, uint32_t length)
+{
+	char line[1 + 2*(4 + STMDFU_IHEX_RECLEN + 1) + 1];
+	char * end = line;
+	uint8_t sum = length + (offset >> 8) + (offset & 0xff) + type;
+	uint32_t i;
+	
+	*end++ = ':';
+	end = stmdfu_put_hex8(end, length);
+	end = stmdfu_put_hex8(end, offset >> 8);
+	end = stmdfu_put_hex8(end, offset & 0xff);
+	end = stmdfu_put_hex8(end, type);
+	for (i=0; i<length; i++)
+	{
+		end = stmdfu_put_hex8(end, data[i]);
+		sum += data[i];
+	}
+	end = stmdfu_put_hex8(end, -sum);
+	*end++ = '\n';
+	
+	fwrite(line, 1, end - line, sink->out);
+}
+
+/*
+stmdfu_dump_block() is the dfu_read_flash_stream() callback for dumps.
+It writes each block out in the sink's format as soon as it arrives.
+*/
+static int stmdfu_dump_block(const uint8_t * data, uint32_t length, uint32_t offset, void * user_data)
+{
+	stmdfu_dump_sink * sink = (stmdfu_dump_sink *)user_data;
+	char line[10 * 5 + 1];
+	char * end;
+	uint32_t address;
+	uint32_t i, n;
+	
+	if (sink->format == STMDFU_FORMAT_RAW)
+	{
+		if (length != fwrite(data, 1, length, sink->out))
+			return -1;
+	} else if (sink->format == STMDFU_FORMAT_IHEX)
+	{
+		for (i=0; i<length; i+=n)
+		{
+			address = sink->address + offset + i;
+			
+			//a record can't cross a 64K boundary, and each new 64K
+			//region needs an extended linear address record
+			if ((address >> 16) != sink->upper)
+			{
+				uint8_t upper[2] = {address >> 24, (address >> 16) & 0xff};
+				
+				sink->upper = address >> 16;
+				stmdfu_ihex_record(sink, 0x04, 0, upper, 2);
+			}
+			
+			n = length - i;
+			if (n > STMDFU_IHEX_RECLEN)
+				n = STMDFU_IHEX_RECLEN;
+			if (n > 0x10000 - (address & 0xffff))
+				n = 0x10000 - (address & 0xffff);
+			
+			stmdfu_ihex_record(sink, 0x00, address & 0xffff, &data[i], n);
+		}
+	} else
+	{
+		//ten "0xAB " a line, carried on across blocks
+		for (i=0; i<length; )
+		{
+			end = line;
+			for (; (i<length) && (sink->column < 10); i++, sink->column++)
+			{
+				*end++ = '0';
+				*end++ = 'x';
+				end = stmdfu_put_hex8(end, data[i]);
+				*end++ = ' ';
+			}
+			if (sink->column == 10)
+			{
+				*end++ = '\n';
+				sink->column = 0;
+			}
+			fwrite(line, 1, end - line, sink->out);
+		}
+	}
+	
+	sink->written = offset + length;
+	
+	return ferror(sink->out) ? -1 : 0;
+}
+
+/*
+stmdfu_read_flash() is a wrapper function that reads size bytes of memory
+from address on an stm32 device via dfu, and streams it to file (stdout
+if file is NULL or "-") in the given format. Only a couple of blocks are
+held in memory, however big the dump is.
+*/
+int stmdfu_read_flash(dfu_device * dfudev, uint32_t address, uint32_t size, char * file, int format)
+{
+	stmdfu_dump_sink sink;
+	int tostdout = (NULL == file) || !strcmp(file, "-");
+	int32_t rv;
+	
+	memset(&sink, 0, sizeof(sink));
+	sink.address = address;
+	sink.upper = 0xffffffff;
+	
+	//a raw dump to a file, readable hex to the terminal
+	if (format == STMDFU_FORMAT_DEFAULT)
+		format = tostdout ? STMDFU_FORMAT_HEX : STMDFU_FORMAT_RAW;
+	sink.format = format;
+	
+	//refuse before creating the file, not halfway through the dump
+	if (0 != dfu_check_range(dfudev, address, size, DFU_SECTOR_READABLE))
+		return -1;
+	
+	if (0 != dfu_set_address_pointer(dfudev, address))
+	{
+		printf("couldn't set the address pointer to 0x%.8x, not dumping\n", address);
+		dfu_make_idle(dfudev, 0);
+		return -1;
+	}
+	
+	sink.out = tostdout ? stdout : fopen(file, (format == STMDFU_FORMAT_RAW) ? "wb" : "w");
+	if (NULL == sink.out)
+	{
+		printf("error creating <%s>\n", file);
+		return -1;
+	}
+	
+	dfu_make_idle(dfudev, 0);
+	
+	rv = dfu_read_flash_stream(dfudev, size, stmdfu_dump_block, &sink);
+	
+	if ((format == STMDFU_FORMAT_HEX) && (sink.column != 0))
+		fputc('\n', sink.out);
+	
+	if (format == STMDFU_FORMAT_IHEX)
+		stmdfu_ihex_record(&sink, 0x01, 0, NULL, 0);
+	
+	if (0 > rv)
+		printf("dump failed after %u bytes\n", sink.written);
+	
+	if (tostdout)
+		fflush(stdout);
+	else
+		fclose(sink.out);
+	
+	dfu_make_idle(dfudev, 0);
+	
+	return (0 > rv) ? -1 : 0;
+}
+
+/*
+stmdfu_read_optbytes() is a wrapper function that reads the option bytes
+from an stm32 device via dfu.
+*/
+void stmdfu_read_optbytes(dfu_device * dfudev)
+{
+	int i;
+	
+	uint8_t optbytes[16];
+	
+	dfu_read_optbytes(dfudev, optbytes);
+	
+	printf("optbytes:\n");
+	
+	for (i=0; i<16; i+=2)
+	{
+		printf("0x%.2x\t 0x%.2x\n", optbytes[i], optbytes[i+1]);
+	}
+}
+
+/*
+stmdfu_erase() is a wrapper function that erases 1 page of flash at a
+time on an stm32 device via dfu.
+*/
+int stmdfu_erase(dfu_device * dfudev, int address)
+{
+	dfu_page_cache_forget(dfudev);
+	
+	return dfu_erase(dfudev, address);
+}
+
+/*
+stmdfu_mass_erase() is a wrapper function that erases all flash memory
+of an stm32 device via dfu.
+*/
+int stmdfu_mass_erase(dfu_device * dfudev)
+{
+	dfu_page_cache_forget(dfudev);
+	
+	return dfu_mass_erase(dfudev);
+}
+
+/*
+stmdfu_leave() is a wrapper function that starts the application at the
+start of internal flash, taking the device out of dfu mode.
+*/
+int stmdfu_leave(dfu_device * dfudev)
+{
+	uint32_t address = 0x08000000;
+	
+	if (dfudev->layout[0].nruns)
+		address = dfudev->layout[0].runs[0].address;
+	
+	dfu_set_alternate(dfudev, 0);
+	
+	return dfu_leave_dfu_mode(dfudev, address);
+}
+
+/*
+stmdfu_prepare() selects internal flash on a device that's been found
+and claimed, and puts it in an idle state.
+*/
+static void stmdfu_prepare(dfu_device * dfudev)
+{
+	dfudev->poll.adaptive = opts.adaptive;
+	
+	dfu_set_alternate(dfudev, 0);
+	
+	if (0 > dfu_async_start())
+	{
+		printf("failed to start usb event thread, falling back to synchronous transfers\n");
+	}
+	
+	//now we've got a handle to the DFU device we want to deal with
+	
+	if(!dfu_make_idle(dfudev, 0))
+	{
+		#if STMDFU_DEBUG_PRINTFS
+		printf("entered dfuIDLE state\n");
+		#endif
+	}
+}
+
+/*
+stmdfu_init_dfu() sets up an attached stm32 dfu device and puts it in
+an idle state, so it's ready to handle dfu commands. If simspec isn't
+NULL, a simulated device (see dfusim.h) is used instead.
+*/
+dfu_device * stmdfu_init_dfu(char * simspec)
+{
+	dfu_device * dfudev;
+	
+	if (NULL != simspec)
 	{
-		stmdfu_read_optbytes(dfudev);
+		dfudev = dfusim_open(simspec);
+		if (NULL == dfudev)
+		{
+			printf("couldn't create simulated device <%s>\n", simspec);
+			exit(-1);
+		}
+	} else
+	{
+		dfudev = find_dfu_device(&opts.filter);
 	}
 	
-	if (!strcmp(argv[1], "erase"))
+	stmdfu_prepare(dfudev);
+	
+	return dfudev;
+}
+
+/*
+stmdfu_init_all() sets up every attached stm32 dfu device, or one
+simulated device for each ; separated spec in simspec, and returns a
+newly allocated list of them, with their number in ndevices.
+*/
+dfu_device ** stmdfu_init_all(char * simspec, int * ndevices)
+{
+	dfu_device ** devices;
+	char * copy;
+	char * spec;
+	char * save;
+	int i, n = 0;
+	
+	if (NULL != simspec)
 	{
-		int address = strtol(argv[2], NULL, 0);
+		devices = (dfu_device **)calloc(strlen(simspec) + 1, sizeof(dfu_device *));
+		copy = strdup(simspec);
 		
-		if (address < 0)
-			address = 0;
+		for (spec = strtok_r(copy, ";", &save); spec != NULL; spec = strtok_r(NULL, ";", &save))
+		{
+			devices[n] = dfusim_open(spec);
+			if (NULL == devices[n])
+			{
+				printf("couldn't create simulated device <%s>\n", spec);
+				exit(-1);
+			}
+			
+			if (!stmdfu_filter_match(&opts.filter, devices[n]->location, devices[n]->serial))
+			{
+				devices[n]->transport->release(devices[n]);
+				free(devices[n]);
+				continue;
+			}
+			n++;
+		}
+		free(copy);
 		
-		stmdfu_erase(dfudev, address);
+		//a bare --sim is one default device
+		if ((0 == n) && (0 == *simspec))
+			devices[n++] = stmdfu_init_dfu(simspec);
+		else
+			for (i=0; i<n; i++)
+				stmdfu_prepare(devices[i]);
+	} else
+	{
+		n = find_dfu_devices(&devices, &opts.filter);
+		for (i=0; i<n; i++)
+		{
+			devices[i]->transport->claim(devices[i]);
+			stmdfu_prepare(devices[i]);
+		}
 	}
 	
-	if (!strcmp(argv[1], "masserase"))
+	if (n < 1)
 	{
-		stmdfu_mass_erase(dfudev);
+		printf("No STM32 DFU Device connected%s. Check boot switches and replugin board.\n",
+				(opts.filter.path || opts.filter.serial) ? " that matches --path/--serial" : "");
+		exit(-1);
 	}
 	
-	cleanup(dfudev);
+	*ndevices = n;
 	
-	return 0;
+	return devices;
 }
 
 /*
-stmdfu_write_image() is a wrapper function that extracts an image from
-a dfuse file, and flashes it to an attached stm32 device via usb dfu.
+stmdfu_worker_run() is the thread body for one device of --all: it
+runs the command and times it.
 */
-void stmdfu_write_image(dfu_device * dfudev, char * file)
+static void * stmdfu_worker_run(void * arg)
 {
-	int i,j;
-	int writesize;
+	stmdfu_worker * worker = (stmdfu_worker *)arg;
+	double t0 = stmdfu_now();
 	
-	int dfufile = open(file, O_RDONLY);
-	if (dfufile < 0)
+	printf("[%s] %s started\n", worker->dfudev->location, worker->argv[1]);
+	
+	worker->rv = stmdfu_run(worker->dfudev, worker->argc, worker->argv);
+	worker->seconds = stmdfu_now() - t0;
+	
+	printf("[%s] %s %s in %.2f s\n", worker->dfudev->location, worker->argv[1],
+			worker->rv ? "failed" : "done", worker->seconds);
+	
+	return NULL;
+}
+
+/*
+stmdfu_run_all() runs the command in argv[1] on every device at once,
+one worker thread each, then prints a summary table. Returns 0 if it
+succeeded on every device.
+*/
+int stmdfu_run_all(dfu_device ** devices, int ndevices, int argc, char * argv[])
+{
+	stmdfu_worker * workers;
+	dfuse_file * dfusefile;
+	uint32_t nsegments, bytes = 0;
+	stmdfu_segment * segments;
+	double t0, seconds;
+	int i, nfailed = 0;
+	
+	//commands that print device contents would interleave
+	if (!strcmp(argv[1], "dump") || !strcmp(argv[1], "optbytes"))
 	{
-		printf("error opening <%s>\n", file);
+		printf("%s can't be run with --all\n", argv[1]);
+		return -1;
+	}
+	
+	//how much each device moves, for the aggregate throughput
+	if ((argc > 2) && (!strcmp(argv[1], "flash") || !strcmp(argv[1], "update") || !strcmp(argv[1], "verify")))
+	{
+		dfusefile = stmdfu_load_dfuse(argv[2]);
+		if (NULL == dfusefile)
+			return -1;
+		
+		segments = stmdfu_sort_elements(dfusefile, &nsegments);
+		for (i=0; (NULL != segments) && (i<nsegments); i++)
+			bytes += segments[i].element->element_size;
+		
+		free(segments);
+		dfuse_struct_cleanup(dfusefile);
 	}
 	
-	dfuse_file * dfusefile = (dfuse_file *)malloc(sizeof(dfuse_file));
-	dfusefile->prefix = (dfuse_prefix *)malloc(sizeof(dfuse_prefix));
+	//keep whole lines together when the workers print at once
+	setvbuf(stdout, NULL, _IOLBF, 0);
 	
-	dfuse_readprefix(dfusefile, dfufile);
+	workers = (stmdfu_worker *)calloc(ndevices, sizeof(stmdfu_worker));
 	
-	dfusefile->images = (dfuse_image **)malloc(sizeof(dfuse_image *) * dfusefile->prefix->targets);
-	for (i=0; i<dfusefile->prefix->targets; i++)
+	t0 = stmdfu_now();
+	
+	for (i=0; i<ndevices; i++)
 	{
-		dfusefile->images[i] = (dfuse_image *)malloc(sizeof(dfuse_image));
-		dfusefile->images[i]->tarprefix = (dfuse_target_prefix *)malloc(sizeof(dfuse_target_prefix));
-		
-		dfuse_readtarprefix(dfusefile, dfufile);
+		workers[i].dfudev = devices[i];
+		workers[i].argc = argc;
+		workers[i].argv = argv;
 		
-		dfusefile->images[i]->imgelement = (dfuse_image_element **)malloc(sizeof(dfuse_image_element *) * dfusefile->images[i]->tarprefix->num_elements);
-		for (j=0; j<dfusefile->images[i]->tarprefix->num_elements; j++)
+		if (0 != pthread_create(&workers[i].thread, NULL, stmdfu_worker_run, &workers[i]))
 		{
-			dfusefile->images[i]->imgelement[j] = (dfuse_image_element *)malloc(sizeof(dfuse_image_element));
-			dfuse_readimgelement_meta(dfusefile, dfufile);
-			dfusefile->images[i]->imgelement[j]->data = (uint8_t *)malloc(sizeof(uint8_t) * dfusefile->images[i]->imgelement[j]->element_size);
-			dfuse_readimgelement_data(dfusefile, dfufile);
+			printf("[%s] couldn't start worker thread\n", devices[i]->location);
+			workers[i].rv = -1;
+			workers[i].dfudev = NULL;
 		}
 	}
 	
-	dfusefile->suffix = (dfuse_suffix *)malloc(sizeof(dfuse_suffix));
-	
-	dfuse_readsuffix(dfusefile, dfufile);
+	for (i=0; i<ndevices; i++)
+	{
+		if (NULL != workers[i].dfudev)
+			pthread_join(workers[i].thread, NULL);
+	}
 	
-	dfu_set_address_pointer(dfudev, dfusefile->images[0]->imgelement[0]->element_address);
+	seconds = stmdfu_now() - t0;
 	
-	printf("address pointer set\n");
+	printf("\n%-24s %-8s %10s %12s\n", "device", "result", "time (s)", "rate (KB/s)");
+	for (i=0; i<ndevices; i++)
+	{
+		printf("%-24s %-8s %10.2f %12.1f\n", devices[i]->location, workers[i].rv ? "FAILED" : "ok",
+				workers[i].seconds, (workers[i].rv || !workers[i].seconds) ? 0.0 : bytes / 1024.0 / workers[i].seconds);
+		if (workers[i].rv)
+			nfailed++;
+	}
+	printf("%d of %d devices ok in %.2f s, %.1f KB/s aggregate\n", ndevices - nfailed, ndevices,
+			seconds, seconds ? (double)bytes * (ndevices - nfailed) / 1024.0 / seconds : 0.0);
 	
-	dfu_make_idle(dfudev, 0);
+	free(workers);
 	
-	printf("made idle\n");
+	return nfailed ? -1 : 0;
+}
+
+/*
+stmdfu_daemon_enqueue() queues a bootloader that's just been plugged in
+for the next free worker.
+*/
+static void stmdfu_daemon_enqueue(stmdfu_daemon * daemon, libusb_device * usbdev, dfu_device * dfudev)
+{
+	stmdfu_arrival * arrival = (stmdfu_arrival *)calloc(1, sizeof(stmdfu_arrival));
 	
-	writesize = dfusefile->images[0]->imgelement[0]->element_size / 2048;
-	writesize = (writesize + 1) * 2048;
+	arrival->usbdev = usbdev;
+	arrival->dfudev = dfudev;
+	arrival->arrived = stmdfu_now();
 	
-	dfu_write_flash(dfudev, dfusefile->images[0]->imgelement[0]->data, writesize);
+	pthread_mutex_lock(&daemon->lock);
+	if (NULL == daemon->tail)
+		daemon->head = arrival;
+	else
+		daemon->tail->next = arrival;
+	daemon->tail = arrival;
+	pthread_cond_signal(&daemon->cond);
+	pthread_mutex_unlock(&daemon->lock);
+}
+
+/*
+stmdfu_hotplug() is called on the usb event thread when a bootloader is
+plugged in. No transfers can be made from here, so the device is only
+queued for a worker.
+*/
+static int LIBUSB_CALL stmdfu_hotplug(libusb_context * ctx, libusb_device * usbdev,
+									libusb_hotplug_event event, void * user_data)
+{
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		stmdfu_daemon_enqueue((stmdfu_daemon *)user_data, libusb_ref_device(usbdev), NULL);
 	
-	dfuse_struct_cleanup(dfusefile);
+	return 0;
 }
 
 /*
-stmdfu_read_flash() is a wrapper function that reads size bytes of memory
-from address on an stm32 device via dfu.
+stmdfu_daemon_job() runs the daemon's steps on one board. Returns 0 if
+they all succeeded.
 */
-void stmdfu_read_flash(dfu_device * dfudev, int address, int size)
+static int stmdfu_daemon_job(stmdfu_daemon * daemon, dfu_device * dfudev)
 {
-	int i, j;
+	if ((daemon->steps & STMDFU_STEP_ERASE) && stmdfu_mass_erase(dfudev))
+		return -1;
 	
-	uint8_t * memdump;
+	if ((daemon->steps & STMDFU_STEP_FLASH) && stmdfu_write_image(dfudev, daemon->file))
+		return -1;
 	
-	memdump = (uint8_t *)calloc(size, sizeof(uint8_t));
+	if ((daemon->steps & STMDFU_STEP_UPDATE) && stmdfu_update(dfudev, daemon->file))
+		return -1;
 	
-	dfu_set_address_pointer(dfudev, address);
+	if ((daemon->steps & STMDFU_STEP_VERIFY) && stmdfu_verify(dfudev, daemon->file))
+		return -1;
 	
-	dfu_make_idle(dfudev, 0);
+	if ((daemon->steps & STMDFU_STEP_LEAVE) && stmdfu_leave(dfudev))
+		return -1;
 	
-	dfu_read_flash(dfudev, memdump, size);
+	return 0;
+}
+
+/*
+stmdfu_daemon_worker() is the thread body of a daemon worker: it takes
+boards off the queue, runs the job on each and times it from plug in,
+until the daemon stops and the queue is empty.
+*/
+static void * stmdfu_daemon_worker(void * arg)
+{
+	stmdfu_daemon * daemon = (stmdfu_daemon *)arg;
+	stmdfu_arrival * arrival;
+	dfu_device * dfudev;
+	double latency;
+	int rv;
 	
-	for (i=0; i<ceil(size/10.); i++)
+	for (;;)
 	{
-		for (j=0; j<10; j++)
+		pthread_mutex_lock(&daemon->lock);
+		while ((NULL == daemon->head) && !daemon->stopping)
+			pthread_cond_wait(&daemon->cond, &daemon->lock);
+		
+		arrival = daemon->head;
+		if (NULL != arrival)
 		{
-			if ((i*10+j) < size)
-			{
-				printf("0x%.2X ", memdump[i*10+j]);
-			} else {
-			}
+			daemon->head = arrival->next;
+			if (NULL == daemon->head)
+				daemon->tail = NULL;
+		}
+		pthread_mutex_unlock(&daemon->lock);
+		
+		if (NULL == arrival)
+			break;
+		
+		dfudev = arrival->dfudev;
+		if (NULL != arrival->usbdev)
+		{
+			dfudev = open_dfu_device(arrival->usbdev, &opts.filter);
+			libusb_unref_device(arrival->usbdev);
+			
+			if (NULL != dfudev)
+				dfudev->transport->claim(dfudev);
+		}
+		
+		//not a bootloader with internal flash, or already gone
+		if (NULL == dfudev)
+		{
+			free(arrival);
+			continue;
 		}
-		printf("\n");
+		
+		stmdfu_prepare(dfudev);
+		
+		printf("[%s] plugged in\n", dfudev->location);
+		
+		rv = stmdfu_daemon_job(daemon, dfudev);
+		latency = stmdfu_now() - arrival->arrived;
+		
+		printf("[%s] %s, %.2f s from plug in\n", dfudev->location, rv ? "FAILED" : "done", latency);
+		
+		cleanup(dfudev);
+		free(arrival);
+		
+		pthread_mutex_lock(&daemon->lock);
+		daemon->units++;
+		if (rv)
+			daemon->failed++;
+		daemon->total_s += latency;
+		if ((1 == daemon->units) || (latency < daemon->min_s))
+			daemon->min_s = latency;
+		if (latency > daemon->max_s)
+			daemon->max_s = latency;
+		pthread_mutex_unlock(&daemon->lock);
 	}
 	
-	free(memdump);
+	return NULL;
 }
 
 /*
-stmdfu_read_optbytes() is a wrapper function that reads the option bytes
-from an stm32 device via dfu.
+stmdfu_run_daemon() waits for bootloaders to be plugged in, and runs
+the steps of a job (see STMDFU_STEP_...) with file on each one, until
+interrupted. With simspec, the ; separated simulated devices are
+plugged in at the start, and it returns once they're done. Returns 0
+if every board succeeded.
 */
-void stmdfu_read_optbytes(dfu_device * dfudev)
+int stmdfu_run_daemon(char * simspec, char * file, char * steps)
 {
-	int i;
+	stmdfu_daemon daemon;
+	pthread_t workers[STMDFU_DAEMON_WORKERS];
+	libusb_hotplug_callback_handle hotplug;
+	dfuse_file * dfusefile;
+	dfu_device * dfudev;
+	sigset_t signals;
+	char * copy;
+	char * step;
+	char * save;
+	int i, sig;
+	int rv = 0;
 	
-	uint8_t optbytes[16];
+	memset(&daemon, 0, sizeof(daemon));
+	daemon.file = file;
 	
-	dfu_read_optbytes(dfudev, optbytes);
+	copy = strdup(steps);
+	for (step = strtok_r(copy, ",", &save); step != NULL; step = strtok_r(NULL, ",", &save))
+	{
+		if (!strcmp(step, "erase"))
+			daemon.steps |= STMDFU_STEP_ERASE;
+		else if (!strcmp(step, "flash"))
+			daemon.steps |= STMDFU_STEP_FLASH;
+		else if (!strcmp(step, "update"))
+			daemon.steps |= STMDFU_STEP_UPDATE;
+		else if (!strcmp(step, "verify"))
+			daemon.steps |= STMDFU_STEP_VERIFY;
+		else if (!strcmp(step, "leave"))
+			daemon.steps |= STMDFU_STEP_LEAVE;
+		else
+		{
+			printf("unknown daemon step <%s>\n", step);
+			free(copy);
+			return -1;
+		}
+	}
+	free(copy);
 	
-	printf("optbytes:\n");
+	//a bad image should stop the daemon now, not fail every board
+	if (daemon.steps & (STMDFU_STEP_FLASH | STMDFU_STEP_UPDATE | STMDFU_STEP_VERIFY))
+	{
+		dfusefile = stmdfu_load_dfuse(file);
+		if (NULL == dfusefile)
+			return -1;
+		dfuse_struct_cleanup(dfusefile);
+	}
 	
-	for (i=0; i<16; i+=2)
+	//^C is taken by sigwait() below, whichever thread it lands on
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	
+	//line buffered, so the workers' lines don't run into each other
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	
+	pthread_mutex_init(&daemon.lock, NULL);
+	pthread_cond_init(&daemon.cond, NULL);
+	
+	for (i=0; i<STMDFU_DAEMON_WORKERS; i++)
+		pthread_create(&workers[i], NULL, stmdfu_daemon_worker, &daemon);
+	
+	if (NULL != simspec)
 	{
-		printf("0x%.2x\t 0x%.2x\n", optbytes[i], optbytes[i+1]);
+		copy = strdup(simspec);
+		for (step = strtok_r(copy, ";", &save); step != NULL; step = strtok_r(NULL, ";", &save))
+		{
+			dfudev = dfusim_open(step);
+			if (NULL == dfudev)
+			{
+				printf("couldn't create simulated device <%s>\n", step);
+				rv = -1;
+				continue;
+			}
+			if (!stmdfu_filter_match(&opts.filter, dfudev->location, dfudev->serial))
+			{
+				dfudev->transport->release(dfudev);
+				free(dfudev);
+				continue;
+			}
+			stmdfu_daemon_enqueue(&daemon, NULL, dfudev);
+		}
+		free(copy);
+	} else
+	{
+		libusb_init(NULL);
+		
+		//the event thread delivers hotplug events as well as transfers
+		dfu_async_start();
+		
+		if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		{
+			printf("libusb has no hotplug support on this platform\n");
+			rv = -1;
+		} else if (LIBUSB_SUCCESS != libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+					LIBUSB_HOTPLUG_ENUMERATE, STM32VENDOR, STM32PRODUCT, LIBUSB_HOTPLUG_MATCH_ANY,
+					stmdfu_hotplug, &daemon, &hotplug))
+		{
+			printf("failed to register for hotplug events\n");
+			rv = -1;
+		} else
+		{
+			printf("waiting for STM32 DFU devices, ^C to stop\n");
+			sigwait(&signals, &sig);
+			libusb_hotplug_deregister_callback(NULL, hotplug);
+		}
 	}
+	
+	//boards already queued are still finished
+	pthread_mutex_lock(&daemon.lock);
+	daemon.stopping = 1;
+	pthread_cond_broadcast(&daemon.cond);
+	pthread_mutex_unlock(&daemon.lock);
+	
+	for (i=0; i<STMDFU_DAEMON_WORKERS; i++)
+		pthread_join(workers[i], NULL);
+	
+	if (NULL == simspec)
+	{
+		dfu_async_stop();
+		libusb_exit(NULL);
+	}
+	
+	printf("%u boards, %u failed", daemon.units, daemon.failed);
+	if (daemon.units)
+		printf(", plug in to done min %.2f s, mean %.2f s, max %.2f s",
+				daemon.min_s, daemon.total_s / daemon.units, daemon.max_s);
+	printf("\n");
+	
+	pthread_cond_destroy(&daemon.cond);
+	pthread_mutex_destroy(&daemon.lock);
+	
+	return (rv || daemon.failed) ? -1 : 0;
 }
 
 /*
-stmdfu_erase() is a wrapper function that erases 1 page of flash at a
-time on an stm32 device via dfu.
-*/
-void stmdfu_erase(dfu_device * dfudev, int address)
-{
-	dfu_erase(dfudev, address);
-}
-
-/*
-stmdfu_mass_erase() is a wrapper function that erases all flash memory
-of an stm32 device via dfu.
+stmdfu_filter_match() returns 1 if a device at location with serial
+number serial passes filter. A NULL serial isn't checked.
 */
-void stmdfu_mass_erase(dfu_device * dfudev)
+int stmdfu_filter_match(stmdfu_filter * filter, const char * location, const char * serial)
 {
-	dfu_mass_erase(dfudev);
+	if (NULL == filter)
+		return 1;
+	
+	if ((NULL != filter->path) && strcmp(filter->path, location))
+		return 0;
+	
+	if ((NULL != filter->serial) && (NULL != serial) && strcmp(filter->serial, serial))
+		return 0;
+	
+	return 1;
 }
 
 /*
-stmdfu_init_dfu() sets up an attached stm32 dfu device and puts it in
-an idle state, so it's ready to handle dfu commands.
+stmdfu_descriptor_cache() loads the interface strings of a board's
+alternate settings from the cache, or with save set stores them there.
+They're kept per family and serial number, so opening a board again
+doesn't fetch them over usb. Returns 0 if they were loaded or stored.
 */
-dfu_device * stmdfu_init_dfu()
+static int stmdfu_descriptor_cache(dfu_device * dfudev, char strings[DFU_MAX_ALTS][256], int save)
 {
-	dfu_device * dfudev = find_dfu_device();
+	char path[512];
+	char name[128];
+	char line[300];
+	FILE * cache;
+	int alt, n, i;
+	int loaded = 0;
 	
-	libusb_set_interface_alt_setting(dfudev->handle, 0, 0);
+	if (0 == dfudev->serial[0])
+		return -1;
 	
-	//now we've got a handle to the DFU device we want to deal with
+	//the serial number ends up in a file name
+	n = snprintf(name, sizeof(name), "descriptors-%s-%s", dfudev->family, dfudev->serial);
+	for (i=0; (i<n) && (i<sizeof(name)); i++)
+	{
+		if ((name[i] == '/') || (name[i] == '.') || (name[i] == ' '))
+			name[i] = '_';
+	}
 	
-	if(!dfu_make_idle(dfudev, 0))
+	if (0 != dfu_cache_path(path, sizeof(path), name))
+		return -1;
+	
+	if (save)
 	{
-		#if STMDFU_DEBUG_PRINTFS
-		printf("entered dfuIDLE state\n");
-		#endif
+		cache = fopen(path, "w");
+		if (NULL == cache)
+			return -1;
+		
+		for (alt=0; alt<DFU_MAX_ALTS; alt++)
+		{
+			if (strings[alt][0])
+				fprintf(cache, "%d %s\n", alt, strings[alt]);
+		}
+		
+		fclose(cache);
+		return 0;
 	}
 	
-	return dfudev;
+	cache = fopen(path, "r");
+	if (NULL == cache)
+		return -1;
+	
+	while (NULL != fgets(line, sizeof(line), cache))
+	{
+		line[strcspn(line, "\n")] = 0;
+		if ((1 == sscanf(line, "%d %n", &alt, &n)) && (alt >= 0) && (alt < DFU_MAX_ALTS))
+		{
+			strncpy(strings[alt], &line[n], 255);
+			loaded = 1;
+		}
+	}
+	
+	fclose(cache);
+	
+	return loaded ? 0 : -1;
 }
 
 /*
-find_dfu_device() searches through the tree of attached usb devices,
-and finds any attached stm32 dfu devices (by vendor and product id).
+open_dfu_device() opens usbdev if it's an stm32 dfu device (by vendor
+and product id) with an internal flash alternate setting, that filter
+(if not NULL) lets through. The path is checked before the device is
+opened, and the interface strings are cached per board. Returns NULL if
+it isn't wanted, or can't be opened. The device holds its own reference
+on libusb.
 */
-dfu_device * find_dfu_device()
+dfu_device * open_dfu_device(libusb_device * usbdev, stmdfu_filter * filter)
 {
-	libusb_device ** devlist;
-	libusb_device * dfutemp;
 	dfu_device * dfudev;
 	libusb_device_handle * dfuhandle;
 	struct libusb_device_descriptor devdesc;
 	struct libusb_config_descriptor * cfgdesc;
-	ssize_t nlistdevs;
-	int i, j, k, l;
+	const struct libusb_interface_descriptor * altsetting;
+	char location[32];
+	char strings[DFU_MAX_ALTS][256];
+	int j, k, l, n;
 	int err;
-	int ndfudevs = 0;
-	unsigned char strdesc[100];
+	int found = 0;
+	int cached, fetched = 0;
+	uint8_t ports[8];
+	char strdesc[256];
+	
+	//everything up to libusb_open() comes from descriptors libusb already has
+	if (libusb_get_device_descriptor(usbdev, &devdesc))
+	{
+		printf("failed to get device descriptor\n");
+		return NULL;
+	}
 	
-	dfudev = (dfu_device *)malloc(sizeof(dfu_device));
+	if ((devdesc.idVendor != STM32VENDOR) || (devdesc.idProduct != STM32PRODUCT))
+		return NULL;
 	
-	libusb_init(NULL);
+	//the same bus-port path as the kernel uses, e.g. 1-4.2
+	n = snprintf(location, sizeof(location), "%u", libusb_get_bus_number(usbdev));
+	err = libusb_get_port_numbers(usbdev, ports, sizeof(ports));
+	for (j=0; (j<err) && (n < sizeof(location)); j++)
+	{
+		n += snprintf(&location[n], sizeof(location) - n, "%c%u", j ? '.' : '-', ports[j]);
+	}
 	
-	nlistdevs = libusb_get_device_list(NULL, &devlist);
-	if (nlistdevs < 0)
+	if (!stmdfu_filter_match(filter, location, NULL))
+		return NULL;
+	
+	err = libusb_open(usbdev, &dfuhandle);
+	if (err)
 	{
-		printf("error getting device list\n");
-		exit(-1);
+		printf("error opening device handle <%d>\n", err);
+		return NULL;
 	}
 	
-	for (i=0; i<nlistdevs; i++)
+	dfudev = (dfu_device *)calloc(1, sizeof(dfu_device));
+	strcpy(dfudev->location, location);
+	
+	//the bootloader version in bcdDevice tells stm32 families apart
+	snprintf(dfudev->family, sizeof(dfudev->family), "%.4x-%.4x-%.4x",
+			devdesc.idVendor, devdesc.idProduct, devdesc.bcdDevice);
+	
+	if (devdesc.iSerialNumber)
+	{
+		libusb_get_string_descriptor_ascii(dfuhandle, devdesc.iSerialNumber,
+										(unsigned char *)dfudev->serial, sizeof(dfudev->serial));
+	}
+	
+	if (!stmdfu_filter_match(filter, location, dfudev->serial))
 	{
-		if (libusb_get_device_descriptor(devlist[i], &devdesc))
+		libusb_close(dfuhandle);
+		free(dfudev);
+		return NULL;
+	}
+	
+	memset(strings, 0, sizeof(strings));
+	cached = (0 == stmdfu_descriptor_cache(dfudev, strings, 0));
+	
+	//according to DFU 1.1 standard, a DFU device in DFU Mode
+	//will have only one each of a configuration and interface.
+	//but we'll parse as if there are multiple anyways!
+	
+	//iterate through available configurations
+	for (j=0; j<devdesc.bNumConfigurations; j++)
+	{
+		if (libusb_get_config_descriptor(usbdev, j, &cfgdesc))
 		{
-			printf("failed to get device descriptor\n");
+			printf("failed to get config descriptor %d\n", j);
+			continue;
 		}
-			
-		if ((devdesc.idVendor == STM32VENDOR) && (devdesc.idProduct == STM32PRODUCT))
+		//iterate through available interfaces
+		for (k=0; k<cfgdesc->bNumInterfaces; k++)
 		{
-			err = libusb_open(devlist[i], &dfuhandle);
-			if (err)
-			{
-				printf("error opening device handle <%d>\n", i);
-			}
-			
-			//according to DFU 1.1 standard, a DFU device in DFU Mode
-			//will have only one each of a configuration and interface.
-			//but we'll parse as if there are multiple anyways!
-			
-			//iterate through available configurations
-			for (j=0; j<devdesc.bNumConfigurations; j++)
+			//iterate through available alternate settings
+			for (l=0; l<cfgdesc->interface[k].num_altsetting; l++)
 			{
-				if (libusb_get_config_descriptor(devlist[i], j, &cfgdesc))
+				altsetting = &cfgdesc->interface[k].altsetting[l];
+				
+				if (altsetting->bInterfaceClass != DFU_ITF_CLASS ||
+					altsetting->bInterfaceSubClass != DFU_ITF_SUBCLASS ||
+					altsetting->bInterfaceProtocol != DFU_ITF_PROTOCOL)
+				{
+					continue;
+				}
+				
+				//only strings that aren't cached go over usb
+				memset(strdesc, 0, sizeof(strdesc));
+				if (cached && (altsetting->bAlternateSetting < DFU_MAX_ALTS) &&
+					strings[altsetting->bAlternateSetting][0])
 				{
-					printf("failed to get config descriptor %d::%d\n", i, j);
+					strcpy(strdesc, strings[altsetting->bAlternateSetting]);
+				} else
+				{
+					libusb_get_string_descriptor_ascii(dfuhandle,
+														altsetting->iInterface,
+												  		(unsigned char *)strdesc,
+												  		sizeof(strdesc));
+					fetched = 1;
+				}
+				
+				//every alternate setting describes its memory in its interface string
+				if (altsetting->bAlternateSetting < DFU_MAX_ALTS)
+				{
+					strcpy(strings[altsetting->bAlternateSetting], strdesc);
+					dfu_parse_layout(&dfudev->layout[altsetting->bAlternateSetting], strdesc);
 				}
-				//iterate through available interfaces
-				for (k=0; k<cfgdesc->bNumInterfaces; k++)
+				
+				if (!strncmp(strdesc, "@Internal Flash", 15))
 				{
-					//iterate through available alternate settings
-					for (l=0; l<cfgdesc->interface[k].num_altsetting; l++)
+					#if STMDFU_DEBUG_PRINTFS
+					printf("\ndevice:\n");
+					printf("vendor:product <%x>:<%x>\n", devdesc.idVendor, devdesc.idProduct);
+					printf("class:subclass <%x>:<%x>\n", devdesc.bDeviceClass, devdesc.bDeviceSubClass);
+					printf("usbspec:configs <%x>:<%x>\n", devdesc.bcdUSB, devdesc.bNumConfigurations);
+					
+					printf("interface:\n");
+					printf("<%d>::<%d>::<%d>\n\n",
+							altsetting->bInterfaceClass,
+							altsetting->bInterfaceSubClass,
+							altsetting->bInterfaceProtocol);
+					#endif
+					found = 1;
+					dfudev->interface = k;
+					
+					//transfer size and capabilities come from the DFU functional descriptor
+					if (dfu_parse_functional(dfudev, altsetting->extra, altsetting->extra_length))
 					{
-						libusb_get_string_descriptor_ascii(dfuhandle,
-															cfgdesc->interface[k].altsetting[l].iInterface,
-													  		strdesc,
-													  		100);
-						if (cfgdesc->interface[k].altsetting[l].bInterfaceClass == DFU_ITF_CLASS &&
-							cfgdesc->interface[k].altsetting[l].bInterfaceSubClass == DFU_ITF_SUBCLASS &&
-							cfgdesc->interface[k].altsetting[l].bInterfaceProtocol == DFU_ITF_PROTOCOL &&
-							!strncmp(strdesc, "@Internal Flash", 15))
-						{
-							#if STMDFU_DEBUG_PRINTFS
-							printf("\ndevice:\n");
-							printf("vendor:product <%x>:<%x>\n", devdesc.idVendor, devdesc.idProduct);
-							printf("class:subclass <%x>:<%x>\n", devdesc.bDeviceClass, devdesc.bDeviceSubClass);
-							printf("usbspec:configs <%x>:<%x>\n", devdesc.bcdUSB, devdesc.bNumConfigurations);
-							
-							printf("interface:\n");
-							printf("<%d>::<%d>::<%d>\n\n",
-									cfgdesc->interface[k].altsetting[l].bInterfaceClass,
-									cfgdesc->interface[k].altsetting[l].bInterfaceSubClass,
-									cfgdesc->interface[k].altsetting[l].bInterfaceProtocol);
-							#endif
-							ndfudevs++;
-							dfutemp = devlist[i];
-							dfudev->interface = k;
-						}
+						dfu_parse_functional(dfudev, cfgdesc->extra, cfgdesc->extra_length);
 					}
 				}
-				libusb_free_config_descriptor(cfgdesc);
 			}
-			libusb_close(dfuhandle);
 		}
+		libusb_free_config_descriptor(cfgdesc);
+	}
+	
+	if (!found)
+	{
+		libusb_close(dfuhandle);
+		free(dfudev);
+		return NULL;
 	}
 	
+	if (fetched)
+		stmdfu_descriptor_cache(dfudev, strings, 1);
+	
 	//calling function will need to call libusb_close(dfudev->handle)
-	err = libusb_open(dfutemp, &dfudev->handle);
-	if (err)
+	dfudev->handle = dfuhandle;
+	dfudev->transport = &dfu_libusb_transport;
+	libusb_init(NULL);
+	
+	return dfudev;
+}
+
+/*
+find_dfu_devices() searches through the tree of attached usb devices,
+and opens every attached stm32 dfu device (by vendor and product id)
+that filter lets through. Returns how many were found, and a newly
+allocated list of them in devices. Each device holds its own reference
+on libusb.
+*/
+int find_dfu_devices(dfu_device *** devices, stmdfu_filter * filter)
+{
+	libusb_device ** devlist;
+	dfu_device * dfudev;
+	ssize_t nlistdevs;
+	int i;
+	int ndfudevs = 0;
+	
+	*devices = NULL;
+	
+	libusb_init(NULL);
+	
+	nlistdevs = libusb_get_device_list(NULL, &devlist);
+	if (nlistdevs < 0)
+	{
+		printf("error getting device list\n");
+		exit(-1);
+	}
+	
+	*devices = (dfu_device **)calloc(nlistdevs ? nlistdevs : 1, sizeof(dfu_device *));
+	
+	for (i=0; i<nlistdevs; i++)
 	{
-		printf("error opening dfudev handle \n");
+		dfudev = open_dfu_device(devlist[i], filter);
+		if (NULL != dfudev)
+			(*devices)[ndfudevs++] = dfudev;
 	}
+	
 	libusb_free_device_list(devlist, 1);
+	libusb_exit(NULL);
+	
+	return ndfudevs;
+}
+
+/*
+find_dfu_device() searches through the tree of attached usb devices,
+and finds any attached stm32 dfu devices (by vendor and product id)
+that filter lets through.
+*/
+dfu_device * find_dfu_device(stmdfu_filter * filter)
+{
+	dfu_device ** devices;
+	dfu_device * dfudev;
+	int ndfudevs;
+	int i;
+	
+	ndfudevs = find_dfu_devices(&devices, filter);
 	
 	if (ndfudevs < 1)
 	{
-		printf("No STM32 DFU Device connected. Check boot switches and replugin board.\n");
+		printf("No STM32 DFU Device connected%s. Check boot switches and replugin board.\n",
+				(filter && (filter->path || filter->serial)) ? " that matches --path/--serial" : "");
 		exit(-1);
 	}
 	
@@ -334,15 +2425,17 @@ dfu_device * find_dfu_device()
 		printf("More than 1 STM32 DFU device connected. Targetting last enumerated STM32 DFU device.\n");
 	}
 	
-	err = libusb_claim_interface(dfudev->handle, dfudev->interface);
-	
-	if (err == LIBUSB_ERROR_BUSY)
-	{
-		printf("STM32 DFU device: interface already claimed\n");
-	} else if (err)
+	//only the last one is kept
+	for (i=0; i<ndfudevs-1; i++)
 	{
-		printf("STM32 DFU device: interface can't be claimed\n");
+		libusb_close(devices[i]->handle);
+		free(devices[i]);
+		libusb_exit(NULL);
 	}
+	dfudev = devices[ndfudevs-1];
+	free(devices);
+	
+	dfudev->transport->claim(dfudev);
 	
 	return dfudev;
 }
@@ -352,8 +2445,12 @@ cleanup() releases any usb handles/interfaces and deallocates memory.
 */
 void cleanup(dfu_device * dfudev)
 {
-	libusb_release_interface(dfudev->handle, dfudev->interface);
-	libusb_close(dfudev->handle);
+	int usb = (dfudev->transport == &dfu_libusb_transport);
+	
+	dfu_async_stop();
+	dfudev->transport->release(dfudev);
 	free(dfudev);
-	libusb_exit(NULL);
+	
+	if (usb)
+		libusb_exit(NULL);
 }
\ No newline at end of file
@@ -9,6 +9,114 @@ the operation.
 #define STM32VENDOR 0x0483
 #define STM32PRODUCT 0xdf11
 
+//dump formats
+#define STMDFU_FORMAT_DEFAULT 0
+#define STMDFU_FORMAT_RAW 1
+#define STMDFU_FORMAT_HEX 2
+#define STMDFU_FORMAT_IHEX 3
+
+//data bytes in each intel hex record
+#define STMDFU_IHEX_RECLEN 16
+
+//steps of a daemon job, run in this order
+#define STMDFU_STEP_ERASE 0x01
+#define STMDFU_STEP_FLASH 0x02
+#define STMDFU_STEP_UPDATE 0x04
+#define STMDFU_STEP_VERIFY 0x08
+#define STMDFU_STEP_LEAVE 0x10
+#define STMDFU_STEPS_DEFAULT "flash,verify,leave"
+
+//boards the daemon works on at once
+#define STMDFU_DAEMON_WORKERS 4
+
+/*
+stmdfu_filter picks devices out by bus-port path (e.g. 1-4.2) and usb
+serial number. NULL fields match any device.
+*/
+typedef struct {
+	char * path;
+	char * serial;
+} stmdfu_filter;
+
+/*
+stmdfu_options holds the command line options that come before the command.
+*/
+typedef struct {
+	int adaptive;
+	int pollstats;
+	int sparse;
+	int erase;
+	int all;
+	int format;
+	char * simspec;
+	char * targets;
+	stmdfu_filter filter;
+} stmdfu_options;
+
+/*
+stmdfu_dump_sink is where a dump is streamed to, and how far it's got.
+*/
+typedef struct {
+	FILE * out;
+	int format;
+	uint32_t address;
+	uint32_t written;
+	uint32_t upper;
+	uint32_t column;
+} stmdfu_dump_sink;
+
+/*
+stmdfu_segment is one image element of a dfuse file, together with the
+alternate setting and index of the target it belongs to.
+*/
+typedef struct {
+	uint8_t alternate;
+	int target;
+	dfuse_image_element * element;
+} stmdfu_segment;
+
+/*
+stmdfu_worker is one device's share of an --all run.
+*/
+typedef struct {
+	dfu_device * dfudev;
+	pthread_t thread;
+	int argc;
+	char ** argv;
+	int rv;
+	double seconds;
+} stmdfu_worker;
+
+/*
+stmdfu_arrival is a bootloader that's been plugged in and is waiting for
+a daemon worker. Simulated devices arrive already opened.
+*/
+typedef struct stmdfu_arrival {
+	libusb_device * usbdev;
+	dfu_device * dfudev;
+	double arrived;
+	struct stmdfu_arrival * next;
+} stmdfu_arrival;
+
+/*
+stmdfu_daemon is the job the daemon runs on every board, the queue of
+boards waiting for it, and the tally so far.
+*/
+typedef struct {
+	char * file;
+	int steps;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	stmdfu_arrival * head;
+	stmdfu_arrival * tail;
+	int stopping;
+	uint32_t units;
+	uint32_t failed;
+	double total_s;
+	double min_s;
+	double max_s;
+} stmdfu_daemon;
+
 /*
 stmdfu_...() functions are simply wrapper functions that call
 dfu_...() functions with the necessary parameters. They exist to make
@@ -18,16 +126,150 @@ wrapper functions handle setting up the arguments, looping, etc.
 */
 
 /*
-stmdfu_write_image() is a wrapper function that extracts an image from
-a dfuse file, and flashes it to an attached stm32 device via usb dfu.
+stmdfu_run() runs the command in argv[1] on a device that's ready for
+it. Returns 0 on success, < 0 on failure or an unknown command.
+*/
+int stmdfu_run(dfu_device * dfudev, int argc, char * argv[]);
+
+/*
+stmdfu_run_all() runs the command in argv[1] on every device at once,
+one worker thread each, then prints a summary table. Returns 0 if it
+succeeded on every device.
+*/
+int stmdfu_run_all(dfu_device ** devices, int ndevices, int argc, char * argv[]);
+
+/*
+stmdfu_args_ok() returns 1 if argv[1] is a command stmdfu_run() knows,
+with the arguments it needs, 0 if it isn't.
+*/
+int stmdfu_args_ok(int argc, char * argv[]);
+
+/*
+stmdfu_usage() prints the command line help.
+*/
+void stmdfu_usage();
+
+/*
+stmdfu_now() returns a monotonic timestamp in seconds.
+*/
+double stmdfu_now();
+
+/*
+stmdfu_load_dfuse() maps a whole dfuse file into memory (see
+dfuse_map()), or decodes an ELF, Intel HEX or S-record file into one.
+With --target, only the headers and the targets picked are read.
+Returns NULL if the file can't be opened or is malformed.
+*/
+dfuse_file * stmdfu_load_dfuse(char * file);
+
+/*
+stmdfu_select_targets() drops the targets of dfusefile that --target
+didn't pick. Returns the number left.
+*/
+int stmdfu_select_targets(dfuse_file * dfusefile);
+
+/*
+stmdfu_sort_elements() lists every image element of every target in a
+dfuse file, sorted by alternate setting and then address. Returns NULL
+if two elements of the same alternate setting overlap.
+*/
+stmdfu_segment * stmdfu_sort_elements(dfuse_file * dfusefile, uint32_t * nsegments);
+
+/*
+stmdfu_select_alt() switches the device to alternate setting alt,
+unless *current already is alt, and leaves it idle. Returns 0 on
+success.
+*/
+int stmdfu_select_alt(dfu_device * dfudev, int * current, int alt);
+
+/*
+stmdfu_write_segment() writes length bytes of data to address in one
+address pointer session. With sparse set, blank blocks are skipped.
+Returns 0 on success.
+*/
+int stmdfu_write_segment(dfu_device * dfudev, uint32_t address, uint8_t * data, uint32_t length, int sparse);
+
+/*
+stmdfu_write_packed() writes a packed element (see dfulz.h) in one
+address pointer session, decoding it a download block at a time, so it's
+never all in memory. Returns 0 on success.
+*/
+int stmdfu_write_packed(dfu_device * dfudev, dfuse_image_element * element);
+
+/*
+stmdfu_write_image() is a wrapper function that flashes every image
+element of a dfuse file to an attached stm32 device via usb dfu. Each
+target goes to its alternate setting, elements are written in address
+order, and elements that follow on from each other are written in one
+address pointer session, except packed elements, which are decoded as
+they're downloaded (see stmdfu_write_packed()). A delta file (see
+dfuse_delta) is applied by stmdfu_update() instead. Returns 0 on
+success.
+*/
+int stmdfu_write_image(dfu_device * dfudev, char * file);
+
+/*
+stmdfu_sectors() returns a newly allocated list of the flash sectors
+that overlap [start, end), and their number in nsectors.
+*/
+dfu_sector * stmdfu_sectors(dfu_device * dfudev, uint32_t start, uint32_t end, uint32_t * nsectors);
+
+/*
+stmdfu_plan_erase() erases the sectors flagged in need[], whichever way
+the device family's cached erase model says is fastest. allow_mass says
+whether a mass erase is acceptable, and even then it's only done for
+sectors that cover nearly all the flash (see dfu_erase_plan_make()).
+Returns 0 on success.
+*/
+int stmdfu_plan_erase(dfu_device * dfudev, dfu_sector * sectors, uint32_t nsectors, uint8_t * need, int allow_mass);
+
+/*
+stmdfu_readback() reads length bytes from address into a newly
+allocated buffer, leaving the device idle. Returns NULL on failure.
+*/
+uint8_t * stmdfu_readback(dfu_device * dfudev, uint32_t address, uint32_t length);
+
+/*
+stmdfu_update_element() rewrites the flash sectors of one image element
+that differ from what's already on the device. The sectors the element
+covers are hashed against the new data, and only the sectors whose
+hashes differ are erased and rewritten. What the sectors hold now comes
+from cache (see dfucache.h) when it knows, checked by reading back a few
+of them, and otherwise from reading them all back, unless held isn't
+NULL, in which case it's what they hold, already read back. cache may
+be NULL. full is how many bytes a full flash would have written, for
+the estimate of the time saved, or 0 to leave that to the caller.
+Returns 0 on success.
 */
-void stmdfu_write_image(dfu_device * dfudev, char * file);
+int stmdfu_update_element(dfu_device * dfudev, dfuse_image_element * element, dfu_page_cache * cache,
+							uint8_t * held, uint32_t full);
+
+/*
+stmdfu_update() is a wrapper function that flashes only what changed
+between a dfuse file and what's already on the device. Internal flash
+elements are updated sector by sector (see stmdfu_update_element()), using
+and keeping up the board's page cache, other targets, like option bytes,
+are read back and rewritten if they differ. A delta file is refused
+unless the pages it replaces hash to what the base it was made from held
+there (or to the delta, if it's already been applied), and only those
+sectors are read back. Returns 0 on success.
+*/
+int stmdfu_update(dfu_device * dfudev, char * file);
+
+/*
+stmdfu_verify() is a wrapper function that reads back the memory every
+element of an image covers and compares it against the image. Returns
+0 if they match.
+*/
+int stmdfu_verify(dfu_device * dfudev, char * file);
 
 /*
 stmdfu_read_flash() is a wrapper function that reads size bytes of memory
-from address on an stm32 device via dfu.
+from address on an stm32 device via dfu, and streams it to file (stdout
+if file is NULL or "-") in the given format. Only a couple of blocks are
+held in memory, however big the dump is. Returns 0 on success.
 */
-void stmdfu_read_flash(dfu_device * dfudev, int address, int size);
+int stmdfu_read_flash(dfu_device * dfudev, uint32_t address, uint32_t size, char * file, int format);
 
 /*
 stmdfu_read_optbytes() is a wrapper function that reads the option bytes
@@ -39,25 +281,74 @@ void stmdfu_read_optbytes(dfu_device * dfudev);
 stmdfu_erase() is a wrapper function that erases 1 page of flash at a
 time on an stm32 device via dfu.
 */
-void stmdfu_erase(dfu_device * dfudev, int address);
+int stmdfu_erase(dfu_device * dfudev, int address);
 
 /*
 stmdfu_mass_erase() is a wrapper function that erases all flash memory
 of an stm32 device via dfu.
 */
-void stmdfu_mass_erase(dfu_device * dfudev);
+int stmdfu_mass_erase(dfu_device * dfudev);
+
+/*
+stmdfu_leave() is a wrapper function that starts the application at the
+start of internal flash, taking the device out of dfu mode.
+*/
+int stmdfu_leave(dfu_device * dfudev);
+
+/*
+stmdfu_run_daemon() waits for bootloaders to be plugged in, and runs
+the steps of a job (see STMDFU_STEP_...) with file on each one, until
+interrupted. With simspec, the ; separated simulated devices are
+plugged in at the start, and it returns once they're done. Returns 0
+if every board succeeded.
+*/
+int stmdfu_run_daemon(char * simspec, char * file, char * steps);
 
 /*
 stmdfu_init_dfu() sets up an attached stm32 dfu device and puts it in
-an idle state, so it's ready to handle dfu commands.
+an idle state, so it's ready to handle dfu commands. If simspec isn't
+NULL, a simulated device (see dfusim.h) is used instead.
 */
-dfu_device * stmdfu_init_dfu();
+dfu_device * stmdfu_init_dfu(char * simspec);
+
+/*
+stmdfu_init_all() sets up every attached stm32 dfu device, or one
+simulated device for each ; separated spec in simspec, and returns a
+newly allocated list of them, with their number in ndevices.
+*/
+dfu_device ** stmdfu_init_all(char * simspec, int * ndevices);
+
+/*
+open_dfu_device() opens usbdev if it's an stm32 dfu device (by vendor
+and product id) with an internal flash alternate setting, that filter
+(if not NULL) lets through. The path is checked before the device is
+opened, and the interface strings are cached per board. Returns NULL if
+it isn't wanted, or can't be opened. The device holds its own reference
+on libusb.
+*/
+dfu_device * open_dfu_device(libusb_device * usbdev, stmdfu_filter * filter);
+
+/*
+find_dfu_devices() searches through the tree of attached usb devices,
+and opens every attached stm32 dfu device (by vendor and product id)
+that filter lets through.
+Returns how many were found, and a newly allocated list of them in
+devices. Each device holds its own reference on libusb.
+*/
+int find_dfu_devices(dfu_device *** devices, stmdfu_filter * filter);
 
 /*
 find_dfu_device() searches through the tree of attached usb devices,
-and finds any attached stm32 dfu devices (by vendor and product id).
+and finds any attached stm32 dfu devices (by vendor and product id)
+that filter lets through.
+*/
+dfu_device * find_dfu_device(stmdfu_filter * filter);
+
+/*
+stmdfu_filter_match() returns 1 if a device at location with serial
+number serial passes filter. A NULL serial isn't checked.
 */
-dfu_device * find_dfu_device();
+int stmdfu_filter_match(stmdfu_filter * filter, const char * location, const char * serial);
 
 /*
 cleanup() releases any usb handles/interfaces and deallocates memory.